@@ -0,0 +1,36 @@
+// Copyright (C) 2017-2017 ChaosForge Ltd
+// http://chaosforge.org/
+
+#ifndef NV_ECS_BENCH_HH
+#define NV_ECS_BENCH_HH
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+// Shared helpers of the bench_* projects - build them in release, the
+// debug configuration keeps asserts on.
+
+// best wall time of runs calls of f, in milliseconds
+template < typename F >
+double bench_ms( int runs, F&& f )
+{
+	double best = 1e30;
+	for ( int r = 0; r < runs; ++r )
+	{
+		auto start = std::chrono::steady_clock::now();
+		f();
+		std::chrono::duration< double, std::milli > elapsed = std::chrono::steady_clock::now() - start;
+		best = std::min( best, elapsed.count() );
+	}
+	return best;
+}
+
+// keeps a result alive, so the work producing it isn't optimized away
+inline void bench_keep( double value )
+{
+	static volatile double sink;
+	sink = sink + value;
+}
+
+#endif // NV_ECS_BENCH_HH
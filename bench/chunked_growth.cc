@@ -0,0 +1,68 @@
+// Copyright (C) 2017-2017 ChaosForge Ltd
+// http://chaosforge.org/
+
+// Growth of aos_layout against chunked_layout storages - 128 byte
+// components added FRAME_ADDS per frame up to COUNT, with the worst frame
+// (the aos realloc doublings) and the total, then iterating them and
+// removing every other one (a relocation into each freed row). The chunked
+// storage runs twice, cold and then with its pool warm from the first run.
+
+#include <vector>
+#include "ecs.hh"
+#include "bench.hh"
+
+struct msg_none { static const int message_id = 0; handle entity; };
+using bench_ecs = ecs< mpl::list< msg_none > >;
+
+struct big_aos     { float v[32]; };
+struct big_chunked { float v[32]; };
+
+template <> struct component_storage_layout< big_chunked > { typedef chunked_layout type; };
+
+static const int COUNT      = 240000;
+static const int FRAME_ADDS = 4000;
+
+template < typename C >
+void run( const char* name, bench_ecs& e, std::vector< handle >& hs )
+{
+	double worst = 0.0, adds = 0.0;
+	for ( int first = 0; first < COUNT; first += FRAME_ADDS )
+	{
+		double ms = bench_ms( 1, [&] ()
+		{
+			for ( int i = first; i < first + FRAME_ADDS; ++i )
+				e.add_component< C >( hs[i], C{ { float( i ) } } );
+		} );
+		worst = std::max( worst, ms );
+		adds += ms;
+	}
+	double iterate = bench_ms( 5, [&] ()
+	{
+		double sum = 0.0;
+		e.for_each< C >( [&] ( const C& c ) { sum += c.v[0]; } );
+		bench_keep( sum );
+	} );
+	double remove = bench_ms( 1, [&] ()
+	{
+		for ( int i = 0; i < COUNT; i += 2 )
+			e.remove_component< C >( hs[i] );
+	} );
+	for ( int i = 1; i < COUNT; i += 2 )
+		e.remove_component< C >( hs[i] );
+	printf( "%-16s %9.3f ms %9.2f ms %9.3f ms %9.2f ms\n", name, worst, adds, iterate, remove );
+}
+
+int main()
+{
+	printf( "%d components of %d bytes, %d added per frame\n", COUNT, int( sizeof( big_aos ) ), FRAME_ADDS );
+	printf( "%-16s %12s %12s %12s %12s\n", "layout", "worst frame", "adds", "iterate", "remove half" );
+	bench_ecs e;
+	e.register_component< big_aos >();
+	e.register_component< big_chunked >();
+	std::vector< handle > hs( COUNT );
+	e.create_n( COUNT, hs.begin() );
+	run< big_aos >( "aos", e, hs );
+	run< big_chunked >( "chunked, cold", e, hs );
+	run< big_chunked >( "chunked, warm", e, hs );
+	return 0;
+}
@@ -0,0 +1,84 @@
+// Copyright (C) 2017-2017 ChaosForge Ltd
+// http://chaosforge.org/
+
+// Random get< C >( h ) over 8 component types - the dense component id
+// table against the type_info keyed unordered_map lookup it replaced.
+
+#include <random>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+#include "ecs.hh"
+#include "bench.hh"
+
+struct msg_none { static const int message_id = 0; handle entity; };
+using bench_ecs = ecs< mpl::list< msg_none > >;
+
+template < int K >
+struct comp { int v[4]; };
+
+static const int ENTITIES = 50000;
+static const int LOOKUPS  = 1000000;
+
+// what get< C > did before - find the interface by type, then the virtual
+// index lookup through get_raw
+struct type_map
+{
+	std::unordered_map< const std::type_info*, bench_ecs::component_interface* > m_map;
+
+	template < typename C >
+	void add( bench_ecs& e ) { m_map[&typeid( C )] = e.get_interface< C >(); }
+
+	template < typename C >
+	C* get( handle h ) { return static_cast< C* >( m_map.find( &typeid( C ) )->second->get_raw( h ) ); }
+};
+
+template < typename Getter, size_t... Ks >
+double lookups( Getter&& get, const std::vector< handle >& order, std::index_sequence< Ks... >&& )
+{
+	return bench_ms( 5, [&] ()
+	{
+		long long sum = 0;
+		for ( size_t i = 0; i < order.size(); ++i )
+			( ( sum += ( i % sizeof...( Ks ) == Ks ? get( order[i], (comp< int( Ks ) >*)nullptr ) : 0 ) ), ... );
+		bench_keep( double( sum ) );
+	} );
+}
+
+template < size_t... Ks >
+void run( std::index_sequence< Ks... >&& seq )
+{
+	bench_ecs e;
+	( e.register_component< comp< int( Ks ) > >(), ... );
+	std::vector< handle > hs( ENTITIES );
+	e.create_n( ENTITIES, hs.begin() );
+	for ( handle h : hs )
+		( e.add_component< comp< int( Ks ) > >( h, int( h.index ), 0, 0, 0 ), ... );
+
+	type_map map;
+	( map.add< comp< int( Ks ) > >( e ), ... );
+
+	std::mt19937 rng( 42 );
+	std::vector< handle > order( LOOKUPS );
+	for ( handle& h : order )
+		h = hs[rng() % ENTITIES];
+
+	double dense = lookups( [&] ( handle h, auto* tag )
+	{
+		return e.get< std::remove_pointer_t< decltype( tag ) > >( h )->v[0];
+	}, order, std::index_sequence< Ks... >() );
+	double hashed = lookups( [&] ( handle h, auto* tag )
+	{
+		return map.get< std::remove_pointer_t< decltype( tag ) > >( h )->v[0];
+	}, order, std::move( seq ) );
+
+	printf( "%d random get< C > over %d types, %d entities\n", LOOKUPS, int( sizeof...( Ks ) ), ENTITIES );
+	printf( "type_info map  %8.2f ms  %6.2f ns/get\n", hashed, hashed * 1e6 / LOOKUPS );
+	printf( "component id   %8.2f ms  %6.2f ns/get\n", dense, dense * 1e6 / LOOKUPS );
+}
+
+int main()
+{
+	run( std::make_index_sequence< 8 >() );
+	return 0;
+}
@@ -0,0 +1,122 @@
+// Copyright (C) 2017-2017 ChaosForge Ltd
+// http://chaosforge.org/
+
+// Immediate dispatch to 8 handlers per message - message_queue delegates
+// against the std::function list they replaced, and through the ecs to
+// on( msg ), on( msg, ecs& ) and on( msg, component& ) systems.
+
+#include <functional>
+#include <random>
+#include <vector>
+#include "ecs.hh"
+#include "bench.hh"
+
+struct msg_hit { static const int message_id = 0; handle entity; int damage; };
+using msg_list = mpl::list< msg_hit >;
+using bench_ecs = ecs< msg_list >;
+
+static const int HANDLERS   = 8;
+static const int DISPATCHES = 1000000;
+static const int ENTITIES   = 50000;
+
+struct health { int hp; };
+
+template < int K >
+struct counter_system
+{
+	long long total = 0;
+	void on( const msg_hit& m ) { total += m.damage; }
+};
+
+template < int K >
+struct ecs_system
+{
+	long long total = 0;
+	void on( const msg_hit& m, bench_ecs& ) { total += m.damage; }
+};
+
+template < int K >
+struct health_system
+{
+	using components = mpl::list< health >;
+	long long total = 0;
+	void on( const msg_hit& m, health& h ) { total += h.hp + m.damage; }
+};
+
+template < template < int > class System, size_t... Ks, typename Queue >
+void register_all( Queue& q, std::index_sequence< Ks... > )
+{
+	( q.template register_system< System< int( Ks ) > >(), ... );
+}
+
+template < template < int > class System >
+double ecs_dispatch( const char* name, const std::vector< handle >& targets, bench_ecs& e )
+{
+	register_all< System >( e, std::make_index_sequence< HANDLERS >() );
+	double ms = bench_ms( 5, [&] ()
+	{
+		for ( handle h : targets )
+			e.dispatch< msg_hit >( h, 1 );
+	} );
+	printf( "%-28s %8.2f ms  %6.2f ns/handler\n", name, ms, ms * 1e6 / ( double( DISPATCHES ) * HANDLERS ) );
+	return ms;
+}
+
+int main()
+{
+	printf( "%d dispatches to %d handlers\n", DISPATCHES, HANDLERS );
+	std::mt19937 rng( 5 );
+
+	// plain queue - the old std::function list against the delegates
+	{
+		typedef message_queue< msg_list > queue_type;
+		queue_type q;
+		std::vector< counter_system< 0 > > systems( HANDLERS );
+		std::vector< std::function< void( const queue_type::message& ) > > functions;
+		for ( auto& s : systems )
+		{
+			q.register_handler( &s );
+			functions.push_back( [&s] ( const queue_type::message& m ) { s.on( message_cast< msg_hit >( m ) ); } );
+		}
+		queue_type::message m{ msg_hit::message_id, 0, 0.0f, {} };
+		new ( &m.payload ) msg_hit{ handle(), 1 };
+		double function = bench_ms( 5, [&] ()
+		{
+			for ( int i = 0; i < DISPATCHES; ++i )
+				for ( auto& f : functions )
+					f( m );
+		} );
+		double delegate = bench_ms( 5, [&] ()
+		{
+			for ( int i = 0; i < DISPATCHES; ++i )
+				q.dispatch( m );
+		} );
+		long long total = 0;
+		for ( auto& s : systems )
+			total += s.total;
+		bench_keep( double( total ) );
+		printf( "%-28s %8.2f ms  %6.2f ns/handler\n", "std::function list", function, function * 1e6 / ( double( DISPATCHES ) * HANDLERS ) );
+		printf( "%-28s %8.2f ms  %6.2f ns/handler\n", "delegates", delegate, delegate * 1e6 / ( double( DISPATCHES ) * HANDLERS ) );
+	}
+
+	std::vector< handle > entities( ENTITIES );
+	std::vector< handle > targets( DISPATCHES );
+	{
+		bench_ecs e;
+		ecs_dispatch< counter_system >( "ecs on( msg )", targets, e );
+	}
+	{
+		bench_ecs e;
+		ecs_dispatch< ecs_system >( "ecs on( msg, ecs& )", targets, e );
+	}
+	{
+		bench_ecs e;
+		e.register_component< health >();
+		e.create_n( ENTITIES, entities.begin() );
+		e.add_components< health >( entities, 10 );
+		for ( handle& h : targets )
+			h = entities[rng() % ENTITIES];
+		ecs_dispatch< health_system >( "ecs on( msg, health& )", targets, e );
+	}
+	return 0;
+}
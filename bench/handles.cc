@@ -0,0 +1,103 @@
+// Copyright (C) 2017-2017 ChaosForge Ltd
+// http://chaosforge.org/
+
+// Speed and memory of the handle layout this is built with (premake builds
+// it once per layout, see NV_ECS_HANDLE_INDEX_BITS). Every entity gets a
+// position, half of them a velocity and one in 16 a relational link.
+
+#include <memory_resource>
+#include <random>
+#include <vector>
+#include "ecs.hh"
+#include "bench.hh"
+
+struct msg_none { static const int message_id = 0; handle entity; };
+using bench_ecs = ecs< mpl::list< msg_none > >;
+
+struct position { float x; float y; };
+struct velocity { float x; float y; };
+struct link { handle owner; handle target; };
+
+struct move_system
+{
+	using components = mpl::list< position, velocity >;
+	void update( position& p, const velocity& v, float dt )
+	{
+		p.x += v.x * dt;
+		p.y += v.y * dt;
+	}
+};
+
+// live bytes allocated by the world
+class counting_resource : public std::pmr::memory_resource
+{
+public:
+	size_t live = 0;
+private:
+	void* do_allocate( size_t bytes, size_t align ) override
+	{
+		live += bytes;
+		return std::pmr::new_delete_resource()->allocate( bytes, align );
+	}
+	void do_deallocate( void* p, size_t bytes, size_t align ) override
+	{
+		live -= bytes;
+		std::pmr::new_delete_resource()->deallocate( p, bytes, align );
+	}
+	bool do_is_equal( const std::pmr::memory_resource& other ) const noexcept override { return this == &other; }
+};
+
+void run( int count )
+{
+	double create = 1e30, frame = 1e30, get = 1e30, remove = 1e30;
+	size_t bytes = 0;
+	for ( int r = 0; r < 3; ++r )
+	{
+		counting_resource resource;
+		bench_ecs e( &resource );
+		e.register_component< position >();
+		e.register_component< velocity >();
+		e.register_component< link >( true );
+		e.register_system< move_system >();
+		std::vector< handle > hs( count );
+		create = std::min( create, bench_ms( 1, [&] ()
+		{
+			e.create_n( count, hs.begin() );
+			for ( int i = 0; i < count; ++i )
+			{
+				e.add_component< position >( hs[i], 0.f, float( i ) );
+				if ( i % 2 == 0 )
+					e.add_component< velocity >( hs[i], 1.f, 1.f );
+				if ( i % 16 == 0 )
+					e.add_component< link >( hs[i], hs[i], hs[( i * 7 ) % count] );
+			}
+		} ) );
+		bytes = resource.live;
+		frame = std::min( frame, bench_ms( 10, [&] () { e.update( 0.016f ); } ) );
+
+		std::mt19937 rng( 1 );
+		std::vector< handle > order( 1000000 );
+		for ( handle& h : order )
+			h = hs[rng() % count];
+		get = std::min( get, bench_ms( 1, [&] ()
+		{
+			double sum = 0.0;
+			for ( handle h : order )
+				sum += e.get< position >( h )->y;
+			bench_keep( sum );
+		} ) * 1e6 / double( order.size() ) );
+		remove = std::min( remove, bench_ms( 1, [&] () { e.remove( hs ); } ) );
+	}
+	printf( "%2d/%-2d %2d bytes %8d  %9.2f ms %9.3f ms %8.2f ns %9.2f ms %8.1f\n",
+		handle::INDEX_BITS, handle::COUNTER_BITS, int( sizeof( handle ) ), count,
+		create, frame, get, remove, double( bytes ) / count );
+}
+
+int main()
+{
+	printf( "layout handle entities  create+add  update/frame  get<pos>  remove all  bytes/entity\n" );
+	run( 60000 );
+	if ( handle::MAX_INDEX >= 1000000 )
+		run( 1000000 );
+	return 0;
+}
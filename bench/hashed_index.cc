@@ -0,0 +1,147 @@
+// Copyright (C) 2017-2017 ChaosForge Ltd
+// http://chaosforge.org/
+
+// hashed_index_table (open addressing) against the std::unordered_map
+// based table it replaced, at 1k, 100k and 1M entries scattered over a
+// 24 bit handle space: insert, get (half of them misses) and remove_swap.
+
+#define NV_ECS_HANDLE_INDEX_BITS 24
+#define NV_ECS_HANDLE_COUNTER_BITS 8
+
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include "index_table.hh"
+#include "bench.hh"
+
+// the previous hashed_index_table
+class unordered_index_table final : public index_table
+{
+public:
+	explicit unordered_index_table( component_storage* storage ) : m_storage( storage ) {}
+
+	int insert( handle h )
+	{
+		int lindex = m_storage->size();
+		m_indexes[h.index] = lindex;
+		return lindex;
+	}
+
+	bool exists( handle h ) const { return m_indexes.find( h.index ) != m_indexes.end(); }
+
+	int get( handle h ) const
+	{
+		auto ih = m_indexes.find( h.index );
+		return ih == m_indexes.end() ? -1 : ih->second;
+	}
+
+	void swap( handle a, handle b )
+	{
+		auto ai = m_indexes.find( a.index );
+		auto bi = m_indexes.find( b.index );
+		if ( ai == m_indexes.end() || bi == m_indexes.end() ) return;
+		std::swap( ai->second, bi->second );
+		m_storage->swap( ai->second, bi->second );
+	}
+
+	int remove_swap( handle h )
+	{
+		auto ih = m_indexes.find( h.index );
+		if ( ih == m_indexes.end() ) return -1;
+		return remove_swap_by_index( ih->second );
+	}
+
+	int remove_swap_by_index( int dead_eindex )
+	{
+		if ( dead_eindex >= m_storage->size() ) return -1;
+		m_indexes.erase( m_storage->index( dead_eindex ) );
+		int swap_handle = m_storage->remove_swap( dead_eindex );
+		if ( swap_handle != -1 )
+			m_indexes[swap_handle] = dead_eindex;
+		return dead_eindex;
+	}
+
+	void clear() { m_indexes.clear(); m_storage->clear(); }
+	int size() const { return m_storage->size(); }
+	void reserve( int count, int ) { m_indexes.reserve( m_indexes.size() + count ); }
+	void reindex()
+	{
+		for ( int i = 0; i < m_storage->size(); ++i )
+			m_indexes[m_storage->index( i )] = i;
+	}
+
+private:
+	std::unordered_map< int, int > m_indexes;
+	component_storage*             m_storage = nullptr;
+};
+
+struct item { int v[2]; };
+
+struct timings
+{
+	double insert;
+	double get;
+	double remove;
+};
+
+template < typename Table >
+timings run( const std::vector< handle >& present, const std::vector< handle >& lookups, const std::vector< handle >& removed )
+{
+	timings result{ 1e30, 1e30, 1e30 };
+	for ( int r = 0; r < 3; ++r )
+	{
+		component_storage_handler< item > storage( true );
+		Table table( &storage );
+		result.insert = std::min( result.insert, bench_ms( 1, [&] ()
+		{
+			for ( handle h : present )
+			{
+				table.insert( h );
+				storage.template append< item >( h.index, int( h.index ), 0 );
+			}
+		} ) );
+		result.get = std::min( result.get, bench_ms( 1, [&] ()
+		{
+			long long sum = 0;
+			for ( handle h : lookups )
+				sum += table.get( h );
+			bench_keep( double( sum ) );
+		} ) );
+		result.remove = std::min( result.remove, bench_ms( 1, [&] ()
+		{
+			for ( handle h : removed )
+				table.remove_swap( h );
+		} ) );
+	}
+	return result;
+}
+
+int main()
+{
+	printf( "%9s %-10s %10s %10s %10s  (ns per operation)\n", "entries", "table", "insert", "get", "remove" );
+	for ( int count : { 1000, 100000, 1000000 } )
+	{
+		// distinct indices spread over the whole index space
+		std::mt19937 rng{ uint32_t( count ) };
+		std::vector< handle > present( count );
+		for ( int i = 0; i < count; ++i )
+			present[i] = handle( ( unsigned( i ) * 7919u + 1 ) & handle::MAX_INDEX, 1 );
+		std::vector< handle > lookups( std::max( count, 1000000 ) );
+		for ( handle& h : lookups )
+			h = rng() % 2 ? present[rng() % count] : handle( rng() & handle::MAX_INDEX, 1 );
+		std::vector< handle > removed( present.begin(), present.begin() + count / 2 );
+		std::shuffle( removed.begin(), removed.end(), rng );
+
+		timings open = run< hashed_index_table >( present, lookups, removed );
+		timings map  = run< unordered_index_table >( present, lookups, removed );
+		auto print = [&] ( const char* name, const timings& t )
+		{
+			printf( "%9d %-10s %10.2f %10.2f %10.2f\n", count, name, t.insert * 1e6 / count,
+				t.get * 1e6 / lookups.size(), t.remove * 1e6 / removed.size() );
+		};
+		print( "unordered", map );
+		print( "open", open );
+	}
+	return 0;
+}
@@ -0,0 +1,97 @@
+// Copyright (C) 2017-2017 ChaosForge Ltd
+// http://chaosforge.org/
+
+// Column kernels against the scalar paths over 60k entities: a soa_layout
+// cooldown ticked by for_each over proxies or by a sub_clamp kernel, and
+// movement as an aos_layout register_component_update system or as a
+// madd kernel over soa_layout position and velocity. Dense movement has
+// runs of matching rows the kernel binds in place, the sparse one has to
+// gather and scatter position.
+
+#include "ecs.hh"
+#include "bench.hh"
+
+struct msg_none { static const int message_id = 0; handle entity; };
+using bench_ecs = ecs< mpl::list< msg_none > >;
+
+static const int ENTITIES = 60000;
+static const int FRAMES   = 50;
+
+struct cooldown { float t; int n; };
+template <> struct component_storage_layout< cooldown > { typedef soa_layout type; };
+
+struct position { float x; float y; };
+struct velocity { float x; float y; };
+struct soa_position { float x; float y; };
+struct soa_velocity { float x; float y; };
+template <> struct component_storage_layout< soa_position > { typedef soa_layout type; };
+template <> struct component_storage_layout< soa_velocity > { typedef soa_layout type; };
+
+struct move_system
+{
+	using components = mpl::list< position, velocity >;
+	void update( position& p, const velocity& v, float dt )
+	{
+		p.x += v.x * dt;
+		p.y += v.y * dt;
+	}
+};
+
+// every entity moves when dense, otherwise only three in four
+template < typename P, typename V >
+void fill_movers( bench_ecs& e, bool dense )
+{
+	e.register_component< P >();
+	e.register_component< V >();
+	for ( int i = 0; i < ENTITIES; ++i )
+	{
+		handle h = e.create();
+		e.add_component< P >( h, 0.f, 0.f );
+		if ( dense || i % 4 )
+			e.add_component< V >( h, 1.f, float( i % 7 ) );
+	}
+}
+
+void movement( bool dense )
+{
+	bench_ecs a, b;
+	fill_movers< position, velocity >( a, dense );
+	fill_movers< soa_position, soa_velocity >( b, dense );
+	a.register_system< move_system >();
+	double scalar = bench_ms( FRAMES, [&] () { a.update( 0.5f ); } );
+	double vector = bench_ms( FRAMES, [&] ()
+	{
+		b.kernel< soa_position, const soa_velocity >( [] ( auto& p, const auto& v )
+		{
+			simd::madd( p.template field< 0 >(), v.template field< 0 >(), 0.5f );
+			simd::madd( p.template field< 1 >(), v.template field< 1 >(), 0.5f );
+		} );
+	} );
+	printf( "%s  update    %7.3f ms   kernel %7.3f ms   x%.2f\n", dense ? "movement dense" : "movement 3/4 ", scalar, vector, scalar / vector );
+}
+
+int main()
+{
+	printf( "%d entities, best frame of %d, isa %d\n", ENTITIES, FRAMES, int( simd::current() ) );
+	{
+		bench_ecs a, b;
+		for ( bench_ecs* e : { &a, &b } )
+		{
+			e->register_component< cooldown >();
+			for ( int i = 0; i < ENTITIES; ++i )
+				e->add_component< cooldown >( e->create(), float( i % 10 ), i % 5 );
+		}
+		double scalar = bench_ms( FRAMES, [&] ()
+		{
+			a.for_each< cooldown >( [] ( auto c ) { c.template get< 0 >() = std::max( c.template get< 0 >() - 0.1f, 0.f ); } );
+		} );
+		double vector = bench_ms( FRAMES, [&] ()
+		{
+			b.kernel< cooldown >( [] ( auto& c ) { simd::sub_clamp( c.template field< 0 >(), 0.1f, 0.f ); } );
+		} );
+		printf( "soa cooldown    for_each  %7.3f ms   kernel %7.3f ms   x%.2f\n", scalar, vector, scalar / vector );
+	}
+	movement( true );
+	movement( false );
+	return 0;
+}
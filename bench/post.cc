@@ -0,0 +1,85 @@
+// Copyright (C) 2017-2017 ChaosForge Ltd
+// http://chaosforge.org/
+
+// Producer scaling of message posting - POSTS messages split over 1 to 8
+// std::threads, through post_from (a segment per producer) and through a
+// mutex around queue, then merging and dispatching them.
+
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "message_queue.hh"
+#include "bench.hh"
+
+struct msg_small { static const int message_id = 0; handle entity; int v; };
+struct msg_large { static const int message_id = 1; handle entity; int v[30]; };
+typedef message_queue< mpl::list< msg_small, msg_large > > queue_type;
+
+static const int POSTS = 400000;
+
+struct sink
+{
+	long long total = 0;
+	void on( const msg_small& m ) { total += m.v; }
+	void on( const msg_large& m ) { total += m.v[29]; }
+};
+
+template < typename Post >
+void post_all( int producers, Post&& post )
+{
+	std::vector< std::thread > threads;
+	for ( int p = 0; p < producers; ++p )
+		threads.emplace_back( [&, p] ()
+		{
+			for ( int i = p; i < POSTS; i += producers )
+				post( unsigned( p ), i );
+		} );
+	for ( auto& t : threads )
+		t.join();
+}
+
+int main()
+{
+	printf( "%d posts, one in 8 with a 124 byte payload\n", POSTS );
+	printf( "%9s %12s %14s %16s\n", "producers", "post_from", "mutex+queue", "merge+dispatch" );
+	for ( int producers : { 1, 2, 4, 8 } )
+	{
+		double lock_free = 1e30, locked = 1e30, merge = 1e30;
+		for ( int r = 0; r < 3; ++r )
+		{
+			queue_type q;
+			sink s;
+			q.register_handler( &s );
+			q.set_producer_count( unsigned( producers ) );
+			lock_free = std::min( lock_free, bench_ms( 1, [&] ()
+			{
+				post_all( producers, [&] ( unsigned p, int i )
+				{
+					if ( i % 8 == 0 )
+						q.post_from< msg_large >( p, float( i % 1000 ) * 0.001f, msg_large{ handle(), { i } } );
+					else
+						q.post_from< msg_small >( p, float( i % 1000 ) * 0.001f, handle(), i );
+				} );
+			} ) );
+			merge = std::min( merge, bench_ms( 1, [&] () { q.update_time( 2.0f ); } ) );
+			bench_keep( double( s.total ) );
+
+			queue_type mq;
+			std::mutex m;
+			locked = std::min( locked, bench_ms( 1, [&] ()
+			{
+				post_all( producers, [&] ( unsigned, int i )
+				{
+					std::lock_guard< std::mutex > lock( m );
+					if ( i % 8 == 0 )
+						mq.queue< msg_large >( float( i % 1000 ) * 0.001f, msg_large{ handle(), { i } } );
+					else
+						mq.queue< msg_small >( float( i % 1000 ) * 0.001f, handle(), i );
+				} );
+			} ) );
+		}
+		printf( "%9d %9.2f ms %11.2f ms %13.2f ms\n", producers, lock_free, locked, merge );
+	}
+	printf( "hardware threads: %u\n", std::thread::hardware_concurrency() );
+	return 0;
+}
@@ -0,0 +1,83 @@
+// Copyright (C) 2017-2017 ChaosForge Ltd
+// http://chaosforge.org/
+
+// Delayed messages through heap_queue and wheel_queue - count timers with
+// spread out delays, every one re-queued by its handler until it fired 4
+// times, driven by update_time frames and then by update_step.
+
+#include <random>
+#include "message_queue.hh"
+#include "bench.hh"
+
+struct msg_timer
+{
+	static const int message_id = 0;
+	int   left;
+	float period;
+};
+
+template < typename Queue >
+struct timers
+{
+	typedef message_queue< mpl::list< msg_timer >, Queue > queue_type;
+
+	struct rearm
+	{
+		queue_type* q;
+		int         fired = 0;
+		void on( const msg_timer& m )
+		{
+			fired++;
+			if ( m.left > 1 )
+				q->template queue< msg_timer >( m.period, m.left - 1, m.period );
+		}
+	};
+
+	queue_type q;
+	rearm      handler{ &q };
+
+	explicit timers( int count )
+	{
+		q.register_handler( &handler );
+		std::mt19937 rng( 7 );
+		for ( int i = 0; i < count; ++i )
+		{
+			float period = 0.05f + float( rng() % 4000 ) * 0.001f;
+			q.template queue< msg_timer >( float( rng() % 1000 ) * 0.001f, 4, period );
+		}
+	}
+};
+
+template < typename Queue >
+double frames( int count )
+{
+	return bench_ms( 3, [&] ()
+	{
+		timers< Queue > t( count );
+		while ( t.q.events_pending() )
+			t.q.update_time( 1.0f / 60.0f );
+		bench_keep( t.handler.fired );
+	} );
+}
+
+template < typename Queue >
+double steps( int count )
+{
+	return bench_ms( 3, [&] ()
+	{
+		timers< Queue > t( count );
+		while ( t.q.events_pending() )
+			t.q.update_step();
+		bench_keep( t.handler.fired );
+	} );
+}
+
+int main()
+{
+	printf( "%8s %18s %18s %18s %18s\n", "timers", "heap update_time", "wheel update_time", "heap update_step", "wheel update_step" );
+	for ( int count : { 1000, 20000, 60000, 200000 } )
+		printf( "%8d %15.2f ms %15.2f ms %15.2f ms %15.2f ms\n", count,
+			frames< heap_queue >( count ), frames< wheel_queue<> >( count ),
+			steps< heap_queue >( count ), steps< wheel_queue<> >( count ) );
+	return 0;
+}
@@ -0,0 +1,371 @@
+// Copyright (C) 2017-2017 ChaosForge Ltd
+// http://chaosforge.org/
+
+#ifndef NV_ECS_ARCHETYPE_STORAGE_HH
+#define NV_ECS_ARCHETYPE_STORAGE_HH
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+#include "handle.hh"
+#include "component_storage.hh"
+
+// Stores the components of every entity that share the same set of
+// archetype_layout components in one table. A table keeps its rows in
+// chunks of about CHUNK_BYTES, and each chunk holds one array per
+// component. Adding or removing a component moves the entity to the table
+// of the new set, so lookups are only needed by handle - iteration over a
+// set of components walks the matching tables column by column. Chunks
+// are allocated from the memory resource given at construction.
+class archetype_storage
+{
+public:
+	static constexpr int CHUNK_BYTES = 16 * 1024;
+	static constexpr int MAX_CHUNK_ROWS = 1024;
+	static constexpr size_t CHUNK_ALIGN = 16;
+
+	class archetype
+	{
+	public:
+		int size() const { return int( m_handles.size() ); }
+		int chunk_count() const { return int( m_chunks.size() ); }
+		int chunk_rows( int chunk ) const
+		{
+			int rows = size() - ( chunk << m_shift );
+			return rows < ( 1 << m_shift ) ? rows : ( 1 << m_shift );
+		}
+		bool contains( int id ) const
+		{
+			return id < int( m_column_of.size() ) && m_column_of[id] >= 0;
+		}
+		const std::vector< int >& components() const { return m_ids; }
+		handle handle_at( int row ) const { return m_handles[row]; }
+
+		// start of the column of component id in chunk
+		char* column_data( int id, int chunk ) const
+		{
+			int c = m_column_of[id];
+			return m_chunks[chunk] + m_offsets[c];
+		}
+
+		// component id of row
+		char* component( int id, int row ) const
+		{
+			return data( m_column_of[id], row );
+		}
+
+		char* data( int column, int row ) const
+		{
+			return m_chunks[row >> m_shift] + m_offsets[column] + ( row & m_mask ) * m_sizes[column];
+		}
+
+	private:
+		friend class archetype_storage;
+
+		std::vector< int >    m_ids;       // sorted component ids
+		std::vector< int >    m_column_of; // component id -> column, or -1
+		std::vector< int >    m_sizes;
+		std::vector< int >    m_offsets;   // column offset inside a chunk
+		std::vector< relocator_t > m_relocators; // nullptr moves with memcpy
+		std::vector< char* >  m_chunks;
+		std::vector< handle > m_handles;
+		std::vector< int >    m_add_edge;    // component id -> archetype, cached
+		std::vector< int >    m_remove_edge; // component id -> archetype, cached
+		int                   m_chunk_bytes = 0;
+		int                   m_shift = 0;
+		int                   m_mask = 0;
+	};
+
+	explicit archetype_storage( std::pmr::memory_resource* resource = std::pmr::get_default_resource() )
+		: m_resource( resource ) {}
+	archetype_storage( const archetype_storage& ) = delete;
+	archetype_storage& operator=( const archetype_storage& ) = delete;
+
+	// relocator moves a component between rows, nullptr for trivially
+	// copyable ones that can be moved bytewise
+	void register_type( int id, int size, int align, destructor_t destructor, relocator_t relocator )
+	{
+		assert( align <= int( CHUNK_ALIGN ) && "archetype_layout supports up to 16 byte alignment!" );
+		if ( id >= int( m_types.size() ) )
+		{
+			m_types.resize( id + 1 );
+			m_counts.resize( id + 1, 0 );
+		}
+		m_types[id] = type_entry{ size, align, destructor, relocator };
+	}
+
+	void* get( handle h, int id ) const
+	{
+		if ( !h || h.index >= m_records.size() ) return nullptr;
+		const record& r = m_records[h.index];
+		if ( r.archetype < 0 ) return nullptr;
+		const archetype& a = *m_archetypes[r.archetype];
+		if ( !a.contains( id ) ) return nullptr;
+		return a.data( a.m_column_of[id], r.row );
+	}
+
+	template < typename Component, typename... Args >
+	Component& add( handle h, int id, Args&&... args )
+	{
+		assert( !get( h, id ) && "Reinserting handle!" );
+		if ( h.index >= m_records.size() )
+			m_records.resize( h.index + 1 );
+		record& r = m_records[h.index];
+		int target = r.archetype < 0 ? find_archetype( std::vector< int >{ id } ) : add_edge( r.archetype, id );
+		move_entity( h, target );
+		m_counts[id]++;
+		archetype& a = *m_archetypes[target];
+		Component* result = (Component*)a.data( a.m_column_of[id], r.row );
+		construct_object< Component >( result, std::forward<Args>( args )... );
+		return *result;
+	}
+
+	// destroys and removes component id of h
+	void remove( handle h, int id )
+	{
+		void* c = get( h, id );
+		if ( !c ) return;
+		m_types[id].destructor( c );
+		m_counts[id]--;
+		record& r = m_records[h.index];
+		int target = remove_edge( r.archetype, id );
+		move_entity( h, target, id );
+	}
+
+	// destroys and removes all components of h
+	void remove_entity( handle h )
+	{
+		if ( !h || h.index >= m_records.size() ) return;
+		record& r = m_records[h.index];
+		if ( r.archetype < 0 ) return;
+		archetype& a = *m_archetypes[r.archetype];
+		for ( int c = 0; c < int( a.m_ids.size() ); ++c )
+		{
+			m_types[a.m_ids[c]].destructor( a.data( c, r.row ) );
+			m_counts[a.m_ids[c]]--;
+		}
+		remove_row( a, r.row );
+		r = record();
+	}
+
+	// component ids of the table h is in, or nullptr
+	const std::vector< int >* components( handle h ) const
+	{
+		if ( !h || h.index >= m_records.size() || m_records[h.index].archetype < 0 ) return nullptr;
+		return &m_archetypes[m_records[h.index].archetype]->m_ids;
+	}
+
+	// number of entities having component id
+	int count( int id ) const
+	{
+		return id < int( m_counts.size() ) ? m_counts[id] : 0;
+	}
+
+	// calls f( archetype& ) for every non-empty table having all the ids
+	template < typename F >
+	void for_each_archetype( const int* ids, int count, F&& f )
+	{
+		for ( auto& a : m_archetypes )
+		{
+			if ( a->size() == 0 ) continue;
+			bool match = true;
+			for ( int i = 0; i < count && match; ++i )
+				match = a->contains( ids[i] );
+			if ( match )
+				f( *a );
+		}
+	}
+
+	// calls f( void* ) for every instance of component id
+	template < typename F >
+	void for_each_instance( int id, F&& f )
+	{
+		for_each_archetype( &id, 1, [&] ( archetype& a )
+		{
+			int column = a.m_column_of[id];
+			for ( int row = 0; row < a.size(); ++row )
+				f( a.data( column, row ) );
+		} );
+	}
+
+	void clear()
+	{
+		for ( auto& a : m_archetypes )
+		{
+			for ( int c = 0; c < int( a->m_ids.size() ); ++c )
+				for ( int row = 0; row < a->size(); ++row )
+					m_types[a->m_ids[c]].destructor( a->data( c, row ) );
+			a->m_handles.clear();
+		}
+		std::fill( m_counts.begin(), m_counts.end(), 0 );
+		m_records.clear();
+	}
+
+	~archetype_storage()
+	{
+		clear();
+		for ( auto& a : m_archetypes )
+			for ( char* chunk : a->m_chunks )
+				free_chunk( *a, chunk );
+	}
+
+private:
+	struct type_entry
+	{
+		int          size = 0;
+		int          align = 1;
+		destructor_t destructor = nullptr;
+		relocator_t  relocator = nullptr;
+	};
+
+	struct record
+	{
+		int archetype = -1;
+		int row       = -1;
+	};
+
+	int find_archetype( const std::vector< int >& ids )
+	{
+		if ( ids.empty() ) return -1;
+		auto it = m_lookup.find( ids );
+		if ( it != m_lookup.end() ) return it->second;
+
+		std::unique_ptr< archetype > a( new archetype );
+		a->m_ids = ids;
+		a->m_column_of.resize( ids.back() + 1, -1 );
+		int row_bytes = 0;
+		for ( int c = 0; c < int( ids.size() ); ++c )
+		{
+			a->m_column_of[ids[c]] = c;
+			a->m_sizes.push_back( m_types[ids[c]].size );
+			a->m_relocators.push_back( m_types[ids[c]].relocator );
+			row_bytes += m_types[ids[c]].size;
+		}
+		int rows = 1;
+		while ( rows < MAX_CHUNK_ROWS && rows * 2 * row_bytes <= CHUNK_BYTES )
+			rows *= 2;
+		int offset = 0;
+		for ( int c = 0; c < int( ids.size() ); ++c )
+		{
+			int align = m_types[ids[c]].align;
+			offset = ( offset + align - 1 ) / align * align;
+			a->m_offsets.push_back( offset );
+			offset += rows * a->m_sizes[c];
+		}
+		a->m_chunk_bytes = offset;
+		while ( ( 1 << a->m_shift ) < rows ) a->m_shift++;
+		a->m_mask = rows - 1;
+
+		int index = int( m_archetypes.size() );
+		m_archetypes.push_back( std::move( a ) );
+		m_lookup[ids] = index;
+		return index;
+	}
+
+	int add_edge( int from, int id )
+	{
+		archetype& a = *m_archetypes[from];
+		if ( id < int( a.m_add_edge.size() ) && a.m_add_edge[id] >= 0 )
+			return a.m_add_edge[id];
+		std::vector< int > ids = a.m_ids;
+		ids.insert( std::lower_bound( ids.begin(), ids.end(), id ), id );
+		int result = find_archetype( ids );
+		if ( id >= int( a.m_add_edge.size() ) )
+			a.m_add_edge.resize( id + 1, -1 );
+		a.m_add_edge[id] = result;
+		return result;
+	}
+
+	int remove_edge( int from, int id )
+	{
+		archetype& a = *m_archetypes[from];
+		if ( id < int( a.m_remove_edge.size() ) && a.m_remove_edge[id] >= 0 )
+			return a.m_remove_edge[id];
+		std::vector< int > ids = a.m_ids;
+		ids.erase( std::find( ids.begin(), ids.end(), id ) );
+		int result = find_archetype( ids );
+		if ( result < 0 ) return -1;
+		if ( id >= int( a.m_remove_edge.size() ) )
+			a.m_remove_edge.resize( id + 1, -1 );
+		a.m_remove_edge[id] = result;
+		return result;
+	}
+
+	int append_row( archetype& a, handle h )
+	{
+		int row = a.size();
+		if ( ( row >> a.m_shift ) >= int( a.m_chunks.size() ) )
+		{
+			a.m_chunks.push_back( (char*)m_resource->allocate( size_t( a.m_chunk_bytes ), CHUNK_ALIGN ) );
+		}
+		a.m_handles.push_back( h );
+		return row;
+	}
+
+	// moves the last row into row, components in row have to be destroyed
+	// or moved out already
+	void remove_row( archetype& a, int row )
+	{
+		int last = a.size() - 1;
+		if ( row != last )
+		{
+			for ( int c = 0; c < int( a.m_ids.size() ); ++c )
+				relocate( a, c, a.data( c, row ), a.data( c, last ) );
+			a.m_handles[row] = a.m_handles[last];
+			m_records[a.m_handles[row].index].row = row;
+		}
+		a.m_handles.pop_back();
+		if ( a.m_chunks.size() > size_t( ( a.size() + a.m_mask ) >> a.m_shift ) + 1 )
+		{
+			free_chunk( a, a.m_chunks.back() );
+			a.m_chunks.pop_back();
+		}
+	}
+
+	void free_chunk( const archetype& a, char* chunk )
+	{
+		m_resource->deallocate( chunk, size_t( a.m_chunk_bytes ), CHUNK_ALIGN );
+	}
+
+	static void relocate( const archetype& a, int column, void* target, void* source )
+	{
+		if ( a.m_relocators[column] )
+			a.m_relocators[column]( target, source );
+		else
+			memcpy( target, source, a.m_sizes[column] );
+	}
+
+	// moves the components of h into table target (-1 for none), skipping
+	// the already destroyed component skip
+	void move_entity( handle h, int target, int skip = -1 )
+	{
+		record& r = m_records[h.index];
+		int row = target < 0 ? -1 : append_row( *m_archetypes[target], h );
+		if ( r.archetype >= 0 )
+		{
+			archetype& src = *m_archetypes[r.archetype];
+			for ( int c = 0; c < int( src.m_ids.size() ); ++c )
+			{
+				int id = src.m_ids[c];
+				if ( id == skip ) continue;
+				archetype& dst = *m_archetypes[target];
+				relocate( src, c, dst.data( dst.m_column_of[id], row ), src.data( c, r.row ) );
+			}
+			remove_row( src, r.row );
+		}
+		r.archetype = target;
+		r.row       = row;
+	}
+
+	std::pmr::memory_resource*                  m_resource;
+	std::vector< type_entry >                   m_types;
+	std::vector< int >                          m_counts;
+	std::vector< record >                       m_records;
+	std::vector< std::unique_ptr< archetype > > m_archetypes;
+	std::map< std::vector< int >, int >         m_lookup;
+};
+
+#endif // NV_ECS_ARCHETYPE_STORAGE_HH
@@ -0,0 +1,77 @@
+// Copyright (C) 2017-2017 ChaosForge Ltd
+// http://chaosforge.org/
+
+#ifndef NV_ECS_CHUNK_POOL_HH
+#define NV_ECS_CHUNK_POOL_HH
+
+#include <cstddef>
+#include <memory_resource>
+#include <mutex>
+#include <vector>
+
+// Byte size of the blocks of chunked_layout storages, e.g.:
+//   defines { "NV_ECS_CHUNK_SIZE=65536" }
+#ifndef NV_ECS_CHUNK_SIZE
+#define NV_ECS_CHUNK_SIZE 16384
+#endif
+
+// Fixed size, cache line aligned blocks for chunked storages, taken from
+// the upstream resource. Released blocks stay on a free list for the next
+// storage that grows and only go upstream with the pool. Storages of
+// different components can grow concurrently, so the list is locked - it
+// is touched once per block.
+class chunk_pool
+{
+public:
+	static constexpr size_t CHUNK_SIZE  = NV_ECS_CHUNK_SIZE;
+	static constexpr size_t CHUNK_ALIGN = 64;
+
+	explicit chunk_pool( std::pmr::memory_resource* upstream = std::pmr::get_default_resource() )
+		: m_upstream( upstream ) {}
+	chunk_pool( const chunk_pool& ) = delete;
+	chunk_pool& operator=( const chunk_pool& ) = delete;
+
+	void* acquire()
+	{
+		std::lock_guard< std::mutex > lock( m_mutex );
+		if ( m_free.empty() )
+			return m_upstream->allocate( CHUNK_SIZE, CHUNK_ALIGN );
+		void* result = m_free.back();
+		m_free.pop_back();
+		return result;
+	}
+
+	void release( void* chunk )
+	{
+		std::lock_guard< std::mutex > lock( m_mutex );
+		m_free.push_back( chunk );
+	}
+
+	size_t free_count() const
+	{
+		std::lock_guard< std::mutex > lock( m_mutex );
+		return m_free.size();
+	}
+
+	~chunk_pool()
+	{
+		for ( void* chunk : m_free )
+			m_upstream->deallocate( chunk, CHUNK_SIZE, CHUNK_ALIGN );
+	}
+
+	// pool of chunked storages created outside of an ecs (which has its
+	// own) - never destroyed, so storages of static objects can still
+	// release into it
+	static chunk_pool& shared()
+	{
+		static chunk_pool* pool = new chunk_pool;
+		return *pool;
+	}
+
+private:
+	std::pmr::memory_resource* m_upstream;
+	mutable std::mutex         m_mutex;
+	std::vector< void* >       m_free;
+};
+
+#endif // NV_ECS_CHUNK_POOL_HH
@@ -0,0 +1,295 @@
+// Copyright (C) 2017-2017 ChaosForge Ltd
+// http://chaosforge.org/
+
+#ifndef NV_ECS_COMMAND_BUFFER_HH
+#define NV_ECS_COMMAND_BUFFER_HH
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "handle.hh"
+
+// Deterministic playback order of recorded commands - the update handler
+// that recorded them, the parallel loop within it and the chunk of that loop
+// (0 for the handler itself). Commands recorded outside of update handlers
+// come first.
+struct command_key
+{
+	int system = -1;
+	int phase  = 0;
+	int part   = 0;
+
+	bool operator==( const command_key& rhs ) const
+	{
+		return system == rhs.system && phase == rhs.phase && part == rhs.part;
+	}
+	bool operator<( const command_key& rhs ) const
+	{
+		if ( system != rhs.system ) return system < rhs.system;
+		return phase != rhs.phase ? phase < rhs.phase : part < rhs.part;
+	}
+
+	static command_key& current()
+	{
+		static thread_local command_key key;
+		return key;
+	}
+
+	// key of the chunks of a parallel loop started by the calling thread -
+	// its own later commands go after them
+	static command_key fork()
+	{
+		command_key result = current();
+		current().phase++;
+		current().part = 0;
+		return result;
+	}
+};
+
+// Sets the command key of the calling thread for its lifetime
+class command_scope
+{
+public:
+	command_scope( int system, int phase = 0, int part = 0 ) : m_saved( command_key::current() )
+	{
+		command_key::current() = command_key{ system, phase, part };
+	}
+	~command_scope() { command_key::current() = m_saved; }
+	command_scope( const command_scope& ) = delete;
+	command_scope& operator=( const command_scope& ) = delete;
+private:
+	command_key m_saved;
+};
+
+// Structural changes recorded for later playback on Ecs (see
+// ecs::commands and ecs::apply_commands). Every thread records into its own
+// buffer, so recording takes no locks. create() returns a pending handle
+// that can be used by later commands of the same buffer - pending handles
+// have a zero counter, which no live handle has.
+template < typename Ecs >
+class command_buffer
+{
+public:
+	static constexpr int BLOCK_SIZE = 16 * 1024;
+
+	command_buffer() = default;
+	command_buffer( const command_buffer& ) = delete;
+	command_buffer& operator=( const command_buffer& ) = delete;
+
+	handle create()
+	{
+		// pending handles are numbered in the index bits
+		assert( m_pending < unsigned( handle::MAX_INDEX ) && "Too many pending creates in one command buffer!" );
+		handle result( ++m_pending, 0 );
+		m_created.resize( m_pending );
+		record< create_command >( result );
+		return result;
+	}
+
+	void remove( handle h )
+	{
+		record< remove_command >( h );
+	}
+
+	template < typename Component, typename... Args >
+	void add_component( handle h, Args&&... args )
+	{
+		typedef add_component_command< Component, std::decay_t< Args >... > command;
+		record< command >( h, std::tuple< std::decay_t< Args >... >( std::forward< Args >( args )... ) );
+	}
+
+	template < typename Component >
+	void remove_component( handle h )
+	{
+		record< remove_component_command< Component > >( h );
+	}
+
+	void attach( handle parent, handle child )
+	{
+		record< attach_command >( parent, child );
+	}
+
+	void detach( handle h )
+	{
+		record< detach_command >( h );
+	}
+
+	bool empty() const { return m_segments.empty(); }
+
+	// segments of commands recorded under one key, in recording order
+	int segment_count() const { return int( m_segments.size() ); }
+	const command_key& segment_key( int s ) const { return m_segments[s].key; }
+
+	// runs segment s - commands it records go to new segments
+	void play( Ecs& e, int s )
+	{
+		for ( size_t i = 0; i < m_segments[s].commands.size(); ++i )
+		{
+			entry c = m_segments[s].commands[i];
+			c.run( e, *this, c.data );
+			c.destroy( c.data );
+		}
+		m_segments[s].commands.clear();
+	}
+
+	// drops the first count segments (played already)
+	void consume( int count )
+	{
+		m_segments.erase( m_segments.begin(), m_segments.begin() + count );
+		if ( m_segments.empty() )
+			reset();
+	}
+
+	~command_buffer()
+	{
+		for ( auto& s : m_segments )
+			for ( auto& c : s.commands )
+				c.destroy( c.data );
+	}
+
+private:
+	struct entry
+	{
+		void ( *run )( Ecs&, command_buffer&, void* );
+		void ( *destroy )( void* );
+		void* data;
+	};
+
+	struct segment
+	{
+		command_key           key;
+		std::vector< entry >  commands;
+	};
+
+	struct create_command
+	{
+		handle h;
+		void run( Ecs& e, command_buffer& cb ) { cb.m_created[h.index - 1] = e.create(); }
+	};
+
+	struct remove_command
+	{
+		handle h;
+		void run( Ecs& e, command_buffer& cb )
+		{
+			handle r = cb.resolve( h );
+			if ( e.is_valid( r ) )
+				e.remove( r );
+		}
+	};
+
+	// handle arguments are resolved too, so a component can refer to its
+	// pending owner
+	template < typename Component, typename... Args >
+	struct add_component_command
+	{
+		handle                h;
+		std::tuple< Args... > args;
+		void run( Ecs& e, command_buffer& cb )
+		{
+			handle r = cb.resolve( h );
+			if ( e.is_valid( r ) )
+				std::apply( [&] ( Args&... a ) { e.template add_component< Component >( r, cb.argument( a )... ); }, args );
+		}
+	};
+
+	template < typename Component >
+	struct remove_component_command
+	{
+		handle h;
+		void run( Ecs& e, command_buffer& cb )
+		{
+			handle r = cb.resolve( h );
+			if ( e.is_valid( r ) )
+				e.template remove_component< Component >( r );
+		}
+	};
+
+	struct attach_command
+	{
+		handle parent;
+		handle child;
+		void run( Ecs& e, command_buffer& cb )
+		{
+			handle p = cb.resolve( parent );
+			handle c = cb.resolve( child );
+			if ( e.is_valid( p ) && e.is_valid( c ) )
+				e.attach( p, c );
+		}
+	};
+
+	struct detach_command
+	{
+		handle h;
+		void run( Ecs& e, command_buffer& cb )
+		{
+			handle r = cb.resolve( h );
+			if ( e.is_valid( r ) )
+				e.detach( r );
+		}
+	};
+
+	handle resolve( handle h ) const
+	{
+		if ( h.counter != 0 || h.index == 0 ) return h;
+		assert( h.index <= m_created.size() && "Pending handle from another command buffer!" );
+		return m_created[h.index - 1];
+	}
+
+	template < typename T >
+	T&& argument( T& a ) const { return std::move( a ); }
+	handle argument( handle& h ) const { return resolve( h ); }
+
+	template < typename Command, typename... Args >
+	void record( Args&&... args )
+	{
+		void* data = allocate( sizeof( Command ), alignof( Command ) );
+		new ( data ) Command{ std::forward< Args >( args )... };
+		const command_key& key = command_key::current();
+		if ( m_segments.empty() || !( m_segments.back().key == key ) )
+			m_segments.push_back( segment{ key, {} } );
+		m_segments.back().commands.push_back( entry{
+			[] ( Ecs& e, command_buffer& cb, void* p ) { ( (Command*)p )->run( e, cb ); },
+			[] ( void* p ) { ( (Command*)p )->~Command(); },
+			data } );
+	}
+
+	void* allocate( size_t size, size_t align )
+	{
+		assert( align <= alignof( std::max_align_t ) && "Overaligned command!" );
+		size_t offset = ( m_used + align - 1 ) / align * align;
+		if ( m_blocks.empty() || offset + size > m_block_size )
+		{
+			m_block_size = std::max< size_t >( BLOCK_SIZE, size );
+			m_blocks.emplace_back( new char[m_block_size] );
+			offset = 0;
+		}
+		m_used = offset + size;
+		return m_blocks.back().get() + offset;
+	}
+
+	// keeps the first block for the next frame
+	void reset()
+	{
+		if ( m_blocks.size() > 1 )
+			m_blocks.resize( 1 );
+		m_block_size = m_blocks.empty() ? 0 : BLOCK_SIZE;
+		m_used       = 0;
+		m_pending    = 0;
+		m_created.clear();
+	}
+
+	std::vector< segment >                   m_segments;
+	std::vector< std::unique_ptr< char[] > > m_blocks;
+	size_t                                   m_block_size = 0;
+	size_t                                   m_used = 0;
+	unsigned                                 m_pending = 0;
+	std::vector< handle >                    m_created;
+};
+
+#endif // NV_ECS_COMMAND_BUFFER_HH
@@ -0,0 +1,107 @@
+// Copyright (C) 2017-2017 ChaosForge Ltd
+// http://chaosforge.org/
+
+#ifndef NV_ECS_COMPONENT_BATCH_HH
+#define NV_ECS_COMPONENT_BATCH_HH
+
+#include <array>
+#include <tuple>
+#include "component_storage.hh"
+
+namespace detail
+{
+	template < typename Component, int Size, typename Is >
+	struct batch_lanes;
+
+	template < typename Component, int Size, size_t... Is >
+	struct batch_lanes< Component, Size, std::index_sequence< Is... > >
+	{
+		typedef std::tuple< std::array< field_type< Component, int( Is ) >, Size >... > type;
+	};
+}
+
+// A batch of up to Size components of a soa_layout storage, as one
+// contiguous lane array per field, so kernels over it vectorize. The batch
+// is either bound directly to a row range of the columns, with nothing to
+// copy, or gathered from and scattered back to the storage by row.
+template < typename Component, int Size >
+class component_batch
+{
+public:
+	static constexpr int FIELD_COUNT = field_count< Component >;
+	static constexpr int CAPACITY    = Size;
+
+	component_batch()
+	{
+		unbind( std::make_index_sequence< FIELD_COUNT >() );
+	}
+	component_batch( const component_batch& ) = delete;
+	component_batch& operator=( const component_batch& ) = delete;
+
+	int size() const { return m_size; }
+
+	template < int I >
+	span< field_type< Component, I > > field()
+	{
+		return span< field_type< Component, I > >( (field_type< Component, I >*)m_fields[I], m_size );
+	}
+
+	template < int I >
+	span< const field_type< Component, I > > field() const
+	{
+		return span< const field_type< Component, I > >( (const field_type< Component, I >*)m_fields[I], m_size );
+	}
+
+	void bind( soa_storage_handler< Component >& storage, int first, int count )
+	{
+		bind_columns( storage, first, std::make_index_sequence< FIELD_COUNT >() );
+		m_size = count;
+	}
+
+	// gathers the rows into the lanes, see store
+	void load( const soa_storage_handler< Component >& storage, const int* rows, int count )
+	{
+		assert( count <= Size && "Batch overflow!" );
+		unbind( std::make_index_sequence< FIELD_COUNT >() );
+		m_size = count;
+		for ( int lane = 0; lane < count; ++lane )
+			load_columns( lane, storage, rows[lane], std::make_index_sequence< FIELD_COUNT >() );
+	}
+
+	void store( soa_storage_handler< Component >& storage, const int* rows ) const
+	{
+		for ( int lane = 0; lane < m_size; ++lane )
+			store_columns( lane, storage, rows[lane], std::make_index_sequence< FIELD_COUNT >() );
+	}
+
+private:
+	template < size_t... Is >
+	void unbind( std::index_sequence< Is... >&& )
+	{
+		( ( m_fields[Is] = std::get< Is >( m_lanes ).data() ), ... );
+	}
+
+	template < size_t... Is >
+	void bind_columns( soa_storage_handler< Component >& storage, int first, std::index_sequence< Is... >&& )
+	{
+		( ( m_fields[Is] = storage.template column< int( Is ) >().data() + first ), ... );
+	}
+
+	template < size_t... Is >
+	void load_columns( int lane, const soa_storage_handler< Component >& storage, int row, std::index_sequence< Is... >&& )
+	{
+		( ( std::get< Is >( m_lanes )[lane] = storage.template column< int( Is ) >()[row] ), ... );
+	}
+
+	template < size_t... Is >
+	void store_columns( int lane, soa_storage_handler< Component >& storage, int row, std::index_sequence< Is... >&& ) const
+	{
+		( ( storage.template column< int( Is ) >()[row] = std::get< Is >( m_lanes )[lane] ), ... );
+	}
+
+	typename detail::batch_lanes< Component, Size, std::make_index_sequence< FIELD_COUNT > >::type m_lanes;
+	void* m_fields[FIELD_COUNT];
+	int   m_size = 0;
+};
+
+#endif // NV_ECS_COMPONENT_BATCH_HH
@@ -14,8 +14,15 @@
 #define NV_ECS_COMPONENT_STORAGE_HH
 
 #include <algorithm>
+#include <cstring>
+#include <memory_resource>
+#include <numeric>
+#include <vector>
 #include "handle.hh"
 #include "handle_manager.hh"
+#include "chunk_pool.hh"
+#include "field_reflection.hh"
+#include "span.hh"
 
 template < typename T, typename ...Args >
 inline void raw_construct_object( void* object, Args&&... params )
@@ -35,13 +42,42 @@ void raw_destroy_object( void* object )
 	static_cast<T*>(object)->T::~T();
 }
 
+template < typename T >
+void raw_relocate_object( void* target, void* source )
+{
+	new (target)T( std::move( *static_cast<T*>(source) ) );
+	static_cast<T*>(source)->T::~T();
+}
+
+// swaps two objects through a buffer on the stack
+template < typename T >
+void raw_swap_object( void* a, void* b )
+{
+	alignas( T ) char tmp[sizeof( T )];
+	raw_relocate_object< T >( tmp, a );
+	raw_relocate_object< T >( a, b );
+	raw_relocate_object< T >( b, tmp );
+}
+
 using constructor_t = void( *)(void*);
 using destructor_t  = void( *)(void*);
+using relocator_t   = void( *)(void*, void*);
+using swapper_t     = void( *)(void*, void*);
 
 class component_storage
 {
+public:
+	static constexpr size_t LINE_SIZE = 64;
 protected:
 	component_storage() {}
+	// where rows are allocated - before the first one
+	void use_memory( std::pmr::memory_resource* resource, chunk_pool* pool )
+	{
+		assert( m_allocated == 0 && "Storage memory has to be set before it allocates!" );
+		m_resource = resource;
+		m_pool     = pool;
+	}
+
 	template < typename T >
 	void initialize( bool owner_included )
 	{
@@ -53,50 +89,150 @@ protected:
 		m_csize = sizeof( T );
 		m_owner_data = owner_included;
 	}
+
+	// one column per field, the owner index is always kept separately
+	template < typename T, size_t... Is >
+	void initialize_columns( std::index_sequence< Is... >&& )
+	{
+		static_assert( std::is_trivially_copyable< T >::value, "soa_layout needs trivially copyable components!" );
+		m_data = nullptr;
+		m_size = 0;
+		m_allocated = 0;
+		m_constructor = nullptr;
+		m_destructor  = nullptr;
+		m_csize = sizeof( T );
+		m_owner_data = false;
+		m_columns = { column{ nullptr, int( sizeof( field_type< T, Is > ) ) }... };
+	}
+
+	// rows in blocks of a chunk_pool, the owner index (unless stored in
+	// the component) after the components of each block
+	template < typename T >
+	void initialize_chunked( bool owner_included )
+	{
+		static_assert( sizeof( T ) + sizeof( int ) <= chunk_pool::CHUNK_SIZE, "Component too big for a chunk!" );
+		static_assert( alignof( T ) <= chunk_pool::CHUNK_ALIGN, "Overaligned component!" );
+		initialize< T >( owner_included );
+		m_relocator = raw_relocate_object < T >;
+		m_swapper   = raw_swap_object < T >;
+		const size_t row = sizeof( T ) + ( owner_included ? 0 : sizeof( int ) );
+		m_chunk_shift = 0;
+		while ( ( size_t( 2 ) << m_chunk_shift ) * row + sizeof( int ) <= chunk_pool::CHUNK_SIZE )
+			m_chunk_shift++;
+		m_index_offset = int( ( ( size_t( 1 ) << m_chunk_shift ) * sizeof( T ) + sizeof( int ) - 1 ) / sizeof( int ) * sizeof( int ) );
+	}
 public:
 	void reserve( int count )
 	{
 		reallocate( count );
 	}
 	int size() const { return m_size; }
+	int capacity() const { return m_allocated; }
 	int raw_size() const { return m_size * m_csize; }
+	int element_size() const { return m_csize; }
+	// smallest row count spanning whole cache lines in every array of the
+	// storage, or a block of a chunked one
+	int line_rows() const
+	{
+		if ( is_chunked() )
+			return chunk_rows();
+		// powers of two, so the largest is a multiple of the others
+		auto lines = [] ( int size ) { return int( LINE_SIZE ) / std::gcd( size, int( LINE_SIZE ) ); };
+		int result = m_owner_data ? 1 : lines( int( sizeof( int ) ) );
+		if ( is_columnar() )
+			for ( auto& c : m_columns )
+				result = std::max( result, lines( c.size ) );
+		else
+			result = std::max( result, lines( m_csize ) );
+		return result;
+	}
 	void reset()
 	{
 		clear();
-		free( m_data );
-		free( m_indices );
+		for ( char* c : m_chunks )
+			m_pool->release( c );
+		m_chunks.clear();
+		free_block( m_data, size_t( m_allocated ) * m_csize );
+		free_block( (char*)m_indices, m_allocated * sizeof( int ) );
+		for ( auto& c : m_columns )
+		{
+			free_block( c.data, size_t( m_allocated ) * c.size );
+			c.data = nullptr;
+		}
 		m_data = nullptr;
 		m_indices = nullptr;
 		m_allocated = 0;
 	}
 	void clear()
 	{
+		if ( is_chunked() )
+		{
+			for ( int i = 0; i < m_size; ++i )
+				m_destructor( chunk_row( i ) );
+			m_size = 0;
+			return;
+		}
 		int   count = m_size;
 		char* d     = m_data;
-		for ( ; count > 0; --count, d += m_csize )
-			m_destructor(d);
+		if ( m_destructor )
+			for ( ; count > 0; --count, d += m_csize )
+				m_destructor(d);
 		m_size = 0;
 	}
-	void* raw() { return m_data; }
-	const void* raw() const { return m_data; }
-	void* raw( int i ) { return m_data + m_csize * i; }
-	const void* raw( int i ) const { return m_data + m_csize * i; }
+	// soa_layout storages have no contiguous component data
+	bool is_columnar() const { return !m_columns.empty(); }
+	// neither have chunked_layout ones, see chunk_rows
+	bool is_chunked() const { return m_chunk_shift >= 0; }
+	int chunk_rows() const { return is_chunked() ? 1 << m_chunk_shift : m_allocated; }
+	void* raw() { assert( !is_chunked() ); return m_data; }
+	const void* raw() const { assert( !is_chunked() ); return m_data; }
+	void* raw( int i ) { return is_chunked() ? chunk_row( i ) : m_data + m_csize * i; }
+	const void* raw( int i ) const { return is_chunked() ? chunk_row( i ) : m_data + m_csize * i; }
 	int index( int i ) const
 	{
+		if ( is_chunked() )
+			return m_owner_data ? ((const handle*)chunk_row( i ))->index : *chunk_index( i );
 		return m_indices ? m_indices[i] : ((handle*)( m_data + m_csize * i ))->index;
 	}
 
+	// whether rows [first, first + count) belong to the same entities in both
+	bool same_owners( const component_storage& other, int first, int count ) const
+	{
+		if ( first + count > m_size || first + count > other.m_size )
+			return false;
+		if ( m_indices && other.m_indices )
+			return memcmp( m_indices + first, other.m_indices + first, count * sizeof( int ) ) == 0;
+		for ( int i = first; i < first + count; ++i )
+			if ( index( i ) != other.index( i ) )
+				return false;
+		return true;
+	}
+
 	template < typename T, typename... Args >
 	T& append( int index, Args&&... args )
 	{
 		grow();
-		T* result = (T*)m_data + m_size - 1;
+		T* result = (T*)raw( m_size - 1 );
 		construct_object<T>( result, std::forward<Args>( args )... );
-		if ( m_indices )
-			m_indices[ m_size - 1 ] = index;
+		set_index( m_size - 1, index );
 		return *result;
 	}
 
+	// appends a row for the caller to construct - see reserve_more
+	void append_uninitialized( int index )
+	{
+		grow();
+		set_index( m_size - 1, index );
+	}
+
+	// makes room for count more rows, keeping the doubling growth - chunked
+	// storages only add the blocks needed
+	void reserve_more( int count )
+	{
+		if ( m_size + count > m_allocated )
+			reallocate( is_chunked() ? m_size + count : std::max( m_size + count, m_allocated * 2 ) );
+	}
+
 	int remove_swap( int dead_eindex )
 	{
 		if ( dead_eindex >= m_size ) return -1;
@@ -113,25 +249,88 @@ public:
 	{
 		if ( m_size == 0 ) return;
 		m_size--;
-		char* ia = m_data + m_csize * a;
-		char* ie = m_data + m_csize * m_size;
-		m_destructor( ia );
-		if ( ia >= ie ) return;
-		memmove( ia, ie, m_csize );
+		if ( is_chunked() )
+		{
+			m_destructor( chunk_row( a ) );
+			if ( a >= m_size ) return;
+			m_relocator( chunk_row( a ), chunk_row( m_size ) );
+			if ( !m_owner_data )
+				*chunk_index( a ) = *chunk_index( m_size );
+			return;
+		}
+		if ( is_columnar() )
+		{
+			if ( a >= m_size ) return;
+			for ( auto& c : m_columns )
+				memcpy( c.data + c.size * a, c.data + c.size * m_size, c.size );
+		}
+		else
+		{
+			char* ia = m_data + m_csize * a;
+			char* ie = m_data + m_csize * m_size;
+			m_destructor( ia );
+			if ( ia >= ie ) return;
+			memmove( ia, ie, m_csize );
+		}
 		if ( m_indices )
 			m_indices[a] = m_indices[m_size];
 	}
 
 	void swap( int a, int b )
 	{
+		if ( is_chunked() )
+		{
+			if ( a == b ) return;
+			m_swapper( chunk_row( a ), chunk_row( b ) );
+			if ( !m_owner_data )
+				std::swap( *chunk_index( a ), *chunk_index( b ) );
+			return;
+		}
 		// this could be optimized
-		char* ia = m_data + m_csize * a;
-		char* ib = m_data + m_csize * b;
-		std::swap_ranges( ia, ia + m_csize, ib );
+		if ( is_columnar() )
+			for ( auto& c : m_columns )
+				std::swap_ranges( c.data + c.size * a, c.data + c.size * ( a + 1 ), c.data + c.size * b );
+		else
+		{
+			char* ia = m_data + m_csize * a;
+			char* ib = m_data + m_csize * b;
+			std::swap_ranges( ia, ia + m_csize, ib );
+		}
 		if ( m_indices )
 			std::swap( m_indices[a], m_indices[b] );
 	}
 
+	// row i becomes the old row order[i] - rows are moved bytewise, like in
+	// pop_swap. The index table has to be reindexed afterwards.
+	void permute( const int* order )
+	{
+		if ( is_chunked() )
+		{
+			std::vector< char* > old;
+			old.swap( m_chunks );
+			for ( size_t c = 0; c < old.size(); ++c )
+				m_chunks.push_back( (char*)m_pool->acquire() );
+			const int mask = ( 1 << m_chunk_shift ) - 1;
+			for ( int i = 0; i < m_size; ++i )
+			{
+				char* source = old[order[i] >> m_chunk_shift];
+				m_relocator( chunk_row( i ), source + m_csize * ( order[i] & mask ) );
+				if ( !m_owner_data )
+					*chunk_index( i ) = ((int*)( source + m_index_offset ))[order[i] & mask];
+			}
+			for ( char* c : old )
+				m_pool->release( c );
+			return;
+		}
+		if ( is_columnar() )
+			for ( auto& c : m_columns )
+				c.data = permuted( c.data, c.size, order );
+		else
+			m_data = permuted( m_data, m_csize, order );
+		if ( m_indices )
+			m_indices = (int*)permuted( (char*)m_indices, sizeof( int ), order );
+	}
+
 
 
 	~component_storage()
@@ -139,23 +338,90 @@ public:
 		reset();
 	}
 protected:
+	char* chunk_row( int i ) const
+	{
+		return m_chunks[i >> m_chunk_shift] + m_csize * ( i & ( ( 1 << m_chunk_shift ) - 1 ) );
+	}
+
+	int* chunk_index( int i ) const
+	{
+		return (int*)( m_chunks[i >> m_chunk_shift] + m_index_offset ) + ( i & ( ( 1 << m_chunk_shift ) - 1 ) );
+	}
+
+	void set_index( int i, int index )
+	{
+		if ( is_chunked() )
+		{
+			if ( !m_owner_data )
+				*chunk_index( i ) = index;
+		}
+		else if ( m_indices )
+			m_indices[i] = index;
+	}
+
 	void grow()
 	{
 		int new_size = m_size + 1;
 		if ( new_size > m_allocated )
-			reallocate( m_allocated > 3 ? m_allocated * 2 : 8 );
+			reallocate( is_chunked() ? new_size : m_allocated > 3 ? m_allocated * 2 : 8 );
 		m_size = new_size;
 	}
 
 	void reallocate( int new_size )
 	{
-		m_data    = (char*)( realloc( m_data, new_size * m_csize ) );
+		if ( is_chunked() )
+		{
+			while ( m_allocated < new_size )
+			{
+				m_chunks.push_back( (char*)m_pool->acquire() );
+				m_allocated += 1 << m_chunk_shift;
+			}
+			return;
+		}
+		if ( is_columnar() )
+			for ( auto& c : m_columns )
+				c.data = resize_block( c.data, size_t( m_allocated ) * c.size, size_t( new_size ) * c.size );
+		else
+			m_data = resize_block( m_data, size_t( m_allocated ) * m_csize, size_t( new_size ) * m_csize );
 		if ( !m_owner_data )
-			m_indices = (int*)(realloc( m_indices, new_size * sizeof( int ) ));
+			m_indices = (int*)resize_block( (char*)m_indices, m_allocated * sizeof( int ), new_size * sizeof( int ) );
 		m_allocated = new_size;
-		assert( m_data );
 	}
 
+	char* permuted( char* data, int size, const int* order )
+	{
+		char* result = resize_block( nullptr, 0, size_t( m_allocated ) * size );
+		for ( int i = 0; i < m_size; ++i )
+			memcpy( result + size * i, data + size * order[i], size );
+		free_block( data, size_t( m_allocated ) * size );
+		return result;
+	}
+
+	// cache line aligned blocks of m_resource, so row ranges spanning whole
+	// lines (see line_rows) start on a line too - realloc can't keep that
+	char* resize_block( char* data, size_t size, size_t new_size )
+	{
+		char* result = (char*)m_resource->allocate( new_size, LINE_SIZE );
+		if ( data )
+		{
+			memcpy( result, data, std::min( size, new_size ) );
+			m_resource->deallocate( data, size, LINE_SIZE );
+		}
+		return result;
+	}
+
+	void free_block( char* data, size_t size )
+	{
+		if ( data )
+			m_resource->deallocate( data, size, LINE_SIZE );
+	}
+
+	struct column
+	{
+		char* data;
+		int   size;
+	};
+
 	int       m_csize = 0;
 	int       m_allocated = 0;
 	int       m_size = 0;
@@ -165,6 +431,17 @@ protected:
 
 	constructor_t m_constructor = nullptr;
 	destructor_t  m_destructor = nullptr;
+	relocator_t   m_relocator = nullptr;
+	swapper_t     m_swapper = nullptr;
+
+	std::vector< column > m_columns;
+
+	std::pmr::memory_resource* m_resource = std::pmr::get_default_resource();
+
+	std::vector< char* > m_chunks;
+	chunk_pool*          m_pool = nullptr;
+	int                  m_chunk_shift = -1; // log2 of rows per chunk
+	int                  m_index_offset = 0; // of the owner indices in a chunk
 };
 
 template < typename Component >
@@ -177,8 +454,9 @@ public:
 	typedef Component&        reference;
 	typedef const Component&  const_reference;
 
-	component_storage_handler( bool owner_stored ) 
+	component_storage_handler( bool owner_stored, std::pmr::memory_resource* resource = std::pmr::get_default_resource(), chunk_pool* pool = &chunk_pool::shared() )
 	{
+		use_memory( resource, pool );
 		initialize<Component>( owner_stored );
 	}
 	Component* data() { return (Component*)m_data; }
@@ -190,13 +468,221 @@ public:
 	inline const_iterator  begin()  const { return (const Component*)m_data; }
 	inline iterator        end() { return ((Component*)m_data)+m_size; }
 	inline const_iterator  end()  const { return ( (Component*)m_data ) + m_size; }
+
+	// the rows from first up to last, contiguous - see chunked_storage_handler
+	span< Component > rows( int first, int last ) { return span< Component >( data() + first, last - first ); }
+};
+
+// Rows of a chunked_layout component, in blocks of chunk_rows() from a
+// chunk_pool. Growing adds blocks and never moves a component, so pointers
+// stay valid until their component is removed (which moves the last one
+// into its row) or reordered. Components are moved with their move
+// constructor, not bytewise.
+template < typename Component >
+class chunked_storage_handler : public component_storage
+{
+public:
+	typedef Component         value_type;
+	typedef Component&        reference;
+	typedef const Component&  const_reference;
+
+	template < typename Storage, typename T >
+	class basic_iterator
+	{
+	public:
+		basic_iterator( Storage* storage, int index ) : m_storage( storage ), m_index( index ) {}
+		T& operator*() const { return ( *m_storage )[m_index]; }
+		T* operator->() const { return &( *m_storage )[m_index]; }
+		basic_iterator& operator++() { ++m_index; return *this; }
+		bool operator!=( const basic_iterator& rhs ) const { return m_index != rhs.m_index; }
+		bool operator==( const basic_iterator& rhs ) const { return m_index == rhs.m_index; }
+	private:
+		Storage* m_storage;
+		int      m_index;
+	};
+
+	typedef basic_iterator< chunked_storage_handler, Component >             iterator;
+	typedef basic_iterator< const chunked_storage_handler, const Component > const_iterator;
+
+	chunked_storage_handler( bool owner_stored, std::pmr::memory_resource* resource = std::pmr::get_default_resource(), chunk_pool* pool = &chunk_pool::shared() )
+	{
+		use_memory( resource, pool );
+		initialize_chunked< Component >( owner_stored );
+	}
+
+	inline const Component& operator[] ( int i ) const
+	{
+		return ( (const Component*)m_chunks[i >> m_chunk_shift] )[i & ( ( 1 << m_chunk_shift ) - 1 )];
+	}
+	inline Component& operator[] ( int i )
+	{
+		return ( (Component*)m_chunks[i >> m_chunk_shift] )[i & ( ( 1 << m_chunk_shift ) - 1 )];
+	}
+
+	// the rows from first up to last or the end of the chunk of first,
+	// whichever comes sooner - walk a range chunk by chunk with these
+	span< Component > rows( int first, int last )
+	{
+		int end = std::min( last, ( first | ( ( 1 << m_chunk_shift ) - 1 ) ) + 1 );
+		return span< Component >( &( *this )[first], end - first );
+	}
+
+	inline iterator        begin() { return iterator( this, 0 ); }
+	inline const_iterator  begin() const { return const_iterator( this, 0 ); }
+	inline iterator        end() { return iterator( this, m_size ); }
+	inline const_iterator  end() const { return const_iterator( this, m_size ); }
+};
+
+template < typename Component >
+class soa_storage_handler;
+
+// Proxy reference to a component of a soa_layout storage
+template < typename Component >
+class soa_reference
+{
+public:
+	soa_reference( soa_storage_handler< Component >* storage, int index )
+		: m_storage( storage ), m_index( index ) {}
+	soa_reference( const soa_reference& ) = default;
+
+	template < int I >
+	field_type< Component, I >& get() const { return m_storage->template column< I >()[m_index]; }
+
+	operator Component() const { return m_storage->load( m_index ); }
+	const soa_reference& operator=( const Component& c ) const
+	{
+		m_storage->store( m_index, c );
+		return *this;
+	}
+	const soa_reference& operator=( const soa_reference& rhs ) const
+	{
+		return *this = Component( rhs );
+	}
+	int index() const { return m_index; }
+
+private:
+	soa_storage_handler< Component >* m_storage;
+	int                               m_index;
+};
+
+// Splits an aggregate component into one array per field (see field_tie),
+// all of them kept in lockstep with the owner indices.
+template < typename Component >
+class soa_storage_handler : public component_storage
+{
+public:
+	typedef Component                  value_type;
+	typedef soa_reference< Component > reference;
+
+	static constexpr int FIELD_COUNT = field_count< Component >;
+
+	class iterator
+	{
+	public:
+		iterator( soa_storage_handler* storage, int index ) : m_storage( storage ), m_index( index ) {}
+		reference operator*() const { return reference( m_storage, m_index ); }
+		iterator& operator++() { ++m_index; return *this; }
+		bool operator!=( const iterator& rhs ) const { return m_index != rhs.m_index; }
+		bool operator==( const iterator& rhs ) const { return m_index == rhs.m_index; }
+	private:
+		soa_storage_handler* m_storage;
+		int                  m_index;
+	};
+
+	soa_storage_handler( [[maybe_unused]] bool owner_stored, std::pmr::memory_resource* resource = std::pmr::get_default_resource(), chunk_pool* pool = &chunk_pool::shared() )
+	{
+		use_memory( resource, pool );
+		assert( !owner_stored && "soa_layout components can't be relational!" );
+		initialize_columns< Component >( std::make_index_sequence< FIELD_COUNT >() );
+	}
+
+	template < int I >
+	span< field_type< Component, I > > column()
+	{
+		return span< field_type< Component, I > >( (field_type< Component, I >*)m_columns[I].data, m_size );
+	}
+
+	template < int I >
+	span< const field_type< Component, I > > column() const
+	{
+		return span< const field_type< Component, I > >( (const field_type< Component, I >*)m_columns[I].data, m_size );
+	}
+
+	Component load( int i ) const
+	{
+		Component result{};
+		copy_fields( field_tie( result ), i, std::make_index_sequence< FIELD_COUNT >() );
+		return result;
+	}
+
+	void store( int i, const Component& c )
+	{
+		assign_fields( field_tie( c ), i, std::make_index_sequence< FIELD_COUNT >() );
+	}
+
+	template < typename T, typename... Args >
+	reference append( int index, Args&&... args )
+	{
+		static_assert( std::is_same< T, Component >::value, "Wrong component type!" );
+		Component c{ std::forward<Args>( args )... };
+		grow();
+		store( m_size - 1, c );
+		m_indices[m_size - 1] = index;
+		return reference( this, m_size - 1 );
+	}
+
+	reference operator[] ( int i ) { return reference( this, i ); }
+	iterator begin() { return iterator( this, 0 ); }
+	iterator end() { return iterator( this, m_size ); }
+
+private:
+	template < typename Tuple, size_t... Is >
+	void copy_fields( Tuple&& fields, int i, std::index_sequence< Is... >&& ) const
+	{
+		( ( std::get< Is >( fields ) = column< int( Is ) >()[i] ), ... );
+	}
+
+	template < typename Tuple, size_t... Is >
+	void assign_fields( Tuple&& fields, int i, std::index_sequence< Is... >&& )
+	{
+		( ( column< int( Is ) >()[i] = std::get< Is >( fields ) ), ... );
+	}
 };
 
+// Storage layout policy of a component type - aos_layout keeps whole
+// components in one array, soa_layout splits aggregates into one array
+// per field, chunked_layout keeps whole components in fixed size blocks
+// that never move (see chunked_storage_handler), archetype_layout stores
+// the component together with the other archetype_layout components of
+// its entity (see archetype_storage). Specialize to change it:
+//   template <> struct component_storage_layout< velocity > { typedef soa_layout type; };
+struct aos_layout {};
+struct soa_layout {};
+struct chunked_layout {};
+struct archetype_layout {};
+
+template < typename Component >
+struct component_storage_layout
+{
+	typedef aos_layout type;
+};
+
+template < typename Component >
+using storage_layout_of = typename component_storage_layout< Component >::type;
+
+template < typename Component >
+constexpr bool is_archetype_layout = std::is_same< storage_layout_of< Component >, archetype_layout >::value;
+
+template < typename Component >
+using storage_handler_of = std::conditional_t< std::is_same< storage_layout_of< Component >, soa_layout >::value,
+	soa_storage_handler< Component >, std::conditional_t< std::is_same< storage_layout_of< Component >, chunked_layout >::value,
+	chunked_storage_handler< Component >, component_storage_handler< Component > > >;
+
 template < typename Component >
-component_storage_handler< Component >* storage_cast( component_storage* storage )
+storage_handler_of< Component >* storage_cast( component_storage* storage )
 {
 	// TODO: error checking
-	return ( component_storage_handler< Component >* )storage;
+	return ( storage_handler_of< Component >* )storage;
 }
 
 #endif // NV_ECS_COMPONENT_STORAGE_HH
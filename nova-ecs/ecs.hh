@@ -13,16 +13,25 @@
 #ifndef NV_ECS_HH
 #define NV_ECS_HH
 
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <memory>
+#include <memory_resource>
+#include <tuple>
 #include <type_traits>
-#include <typeinfo>
 #include <vector>
-#include <unordered_map>
 #include "handle.hh"
 #include "index_table.hh"
 #include "message_queue.hh"
 #include "handle_manager.hh"
 #include "handle_tree_manager.hh"
 #include "component_storage.hh"
+#include "archetype_storage.hh"
+#include "component_batch.hh"
+#include "command_buffer.hh"
+#include "simd.hh"
+#include "thread_pool.hh"
 
 template < typename Enumerator >
 class enumerator_provider
@@ -47,20 +56,48 @@ protected:
 	iterator m_begin;
 };
 
-template < typename MessageList >
-class ecs : public message_queue< MessageList >
+namespace detail
+{
+	inline int next_component_id()
+	{
+		static std::atomic< int > counter{ 0 };
+		return counter.fetch_add( 1 );
+	}
+}
+
+// Dense per-type component id, assigned when the type is first registered
+// with any ecs. Used to index the flat component table of the ecs. Worlds
+// on different threads can register the same type at once, the first id
+// stored wins.
+template < typename Component >
+struct component_id
+{
+	static inline std::atomic< int > value{ -1 };
+};
+
+template < typename MessageList, typename Queue = heap_queue >
+class ecs : public message_queue< MessageList, Queue >
 {
 public:
-	typedef ecs< MessageList >   this_type;
+	typedef ecs< MessageList, Queue > this_type;
+	typedef command_buffer< this_type > command_buffer_type;
 
-	using message_queue< MessageList >::message_list;
-	using message_queue< MessageList >::message_type;
-	using message_queue< MessageList >::message;
+	using typename message_queue< MessageList, Queue >::message_list;
+	using typename message_queue< MessageList, Queue >::message_type;
+	using typename message_queue< MessageList, Queue >::message;
+	using typename message_queue< MessageList, Queue >::time_type;
+
+	static constexpr int KERNEL_BATCH = 256;
+
+	template < typename Component >
+	using kernel_batch = component_batch< std::remove_const_t< Component >, KERNEL_BATCH >;
 
 	using update_handler     = std::function< void( float ) >;
 	using destroy_handler    = std::function< void( void* ) >;
 	using create_handler     = std::function< void( handle, void* ) >;
 
+	struct group_data;
+
 	class component_interface
 	{
 	public:
@@ -77,13 +114,69 @@ public:
 		}
 
 		bool               m_relational;
-		index_table*       m_index;
-		component_storage* m_storage;
+		bool               m_relational_dirty = false; // see set_relational_deferred
+		bool               m_archetype = false; // no index and storage, see archetype_storage
+		bool               m_typed_index = true; // m_index is the index_table_of the component
+		int                m_id = -1;
+		index_table*       m_index = nullptr;
+		component_storage* m_storage = nullptr;
+		group_data*        m_group = nullptr;
+		void ( *m_release )( ecs&, component_interface* ) = nullptr; // of m_index and m_storage
 
 		std::vector< create_handler >  m_create;
 		std::vector< destroy_handler > m_destroy;
 	};
 
+	// entities having all members sit in rows [0, size) of every member
+	// storage, in the same order
+	struct group_data
+	{
+		std::vector< component_interface* > members;
+		int                                 size = 0;
+	};
+
+	template < typename... Components >
+	class group_view
+	{
+	public:
+		group_view( this_type& ecs, group_data* data )
+			: m_data( data ), m_storages( ecs.template get_storage< Components >()... ) {}
+
+		int size() const { return m_data->size; }
+
+		// calls f( Components&... ) for every entity in the group
+		template < typename F >
+		void each( F&& f )
+		{
+			each_impl( f, std::index_sequence_for< Components... >() );
+		}
+
+	private:
+		template < typename F, size_t... Is >
+		void each_impl( F& f, std::index_sequence< Is... >&& )
+		{
+			group_rows( 0, m_data->size, f, std::get< Is >( m_storages )->data()... );
+		}
+
+		group_data*                                        m_data;
+		std::tuple< storage_handler_of< Components >*... > m_storages;
+	};
+
+	struct component_access
+	{
+		std::vector< component_interface* > reads;
+		std::vector< component_interface* > writes;
+	};
+
+	struct update_entry
+	{
+		update_handler     handler;
+		component_access   access;
+		bool               exclusive = true;
+		int                predecessors = 0;
+		std::vector< int > successors;
+	};
+
 	class enumerator
 	{
 	public:
@@ -102,36 +195,27 @@ public:
 	public:
 		explicit recursive_component_enumerator( ecs& aecs, handle root ) : m_ecs( aecs ), m_root( root )
 		{
-			m_current   = m_root;
-			m_interface = m_ecs.get_interface< Component >();
-			if ( m_interface && m_current )
+			m_accessor = m_ecs.get_accessor< Component >();
+			if ( m_root )
 				next();
 		}
 		bool done() const { return m_component == nullptr; }
 		Component& current() { return *m_component; }
 		void next()
 		{
-			unsigned index = next_index();
-			m_component = index >= 0 ? (Component*)m_interface->m_storage->raw( index ) : nullptr;
+			m_component = nullptr;
+			for ( span< const handle > range = m_ecs.m_handles.subtree( m_root ); m_position < range.size() && !m_component; )
+				if ( handle h = range[m_position++] )
+					m_component = m_accessor.get( h );
 		}
 
 	private:
-		int next_index()
-		{
-			for ( ;;)
-			{
-				if ( !m_current ) return -1;
-				int index = m_interface->m_index->get( m_current );
-				m_current = m_ecs.next_handle( m_current, m_root );
-				if ( index >= 0 ) return index;
-			}
-		}
 
 		ecs&  m_ecs;
 		handle          m_root;
-		handle          m_current;
-		component_interface* m_interface = nullptr;
-		Component*           m_component = nullptr;
+		int             m_position = 0;
+		component_accessor< Component > m_accessor;
+		Component*                      m_component = nullptr;
 	};
 
 	template < typename Component >
@@ -146,20 +230,23 @@ public:
 		static constexpr int SIZE = sizeof...( Components );
 		component_interface* cis[SIZE];
 		void* cmps[SIZE];
+		std::tuple< component_accessor< Components >... > accessors;
 
 		gather_components( this_type& ecs )
+			: accessors( ecs.template get_accessor< Components >()... )
 		{
 			fill< 0, Components... >( ecs );
 		}
 
 		bool run( handle h )
 		{
-			for ( unsigned i = 0; i < SIZE; ++i )
-			{
-				cmps[i] = cis[i]->get_raw( h );
-				if ( !cmps[i] ) return false;
-			}
-			return true;
+			return run_impl( h, -1, nullptr, std::make_index_sequence< SIZE >() );
+		}
+
+		// as run, but the component at slot known is already at hand
+		bool run( handle h, int known, void* c )
+		{
+			return run_impl( h, known, c, std::make_index_sequence< SIZE >() );
 		}
 
 		template< typename Component >
@@ -171,7 +258,7 @@ public:
 		template < typename SC >
 		SC& get()
 		{
-			return run_get< 0, SC, Components...>();
+			return *(SC*)cmps[ index_of< SC >() ];
 		}
 
 	private:
@@ -186,22 +273,19 @@ public:
 		template < int Index >
 		void fill( this_type& ) {}
 
-		template < int Index, typename SC, typename C, typename... Cs >
-		C& run_get()
+		template < size_t... Is >
+		bool run_impl( handle h, int known, void* c, std::index_sequence< Is... >&& )
 		{
-			return get_impl< Index, SC, C, Cs... >( std::is_same< SC, C >{} );
+			return ( ( ( cmps[Is] = int( Is ) == known ? c : std::get< Is >( accessors ).get( h ) ) != nullptr ) && ... );
 		}
 
-		template < int Index, typename SC, typename C, typename C2, typename... Cs >
-		C& get_impl( std::false_type&& )
-		{
-			return get_impl< Index + 1, SC, C2, Cs...>( std::is_same< SC, C >() );
-		}
-
-		template < int Index, typename SC, typename C, typename... Cs >
-		C& get_impl( std::true_type&& )
+		template < typename SC >
+		static constexpr int index_of()
 		{
-			return *(C*)cmps[Index];
+			constexpr bool match[] = { std::is_same< SC, Components >::value... };
+			for ( int i = 0; i < SIZE; ++i )
+				if ( match[i] ) return i;
+			return -1;
 		}
 
 	};
@@ -215,6 +299,22 @@ public:
 		bool runc( Component& ) { return true; }
 	};
 
+	// Component storages, archetype tables, index tables, the handle
+	// hierarchy and queued messages of the world are allocated from
+	// resource, which has to outlive it. With a monotonic one a world is
+	// dropped without freeing its allocations one by one. resource is only
+	// used from the thread changing the world (chunk_pool locks around it),
+	// so it needs no synchronization - post_from segments, which producer
+	// threads fill at once, stay on new_delete_resource() for that reason.
+	explicit ecs( std::pmr::memory_resource* resource = std::pmr::get_default_resource() )
+		: message_queue< MessageList, Queue >( resource )
+		, m_resource( resource ), m_chunk_pool( resource )
+		, m_handles( resource ), m_dead_handles( resource ), m_dead_mark( resource ), m_walk( resource )
+		, m_archetypes( resource )
+	{}
+
+	std::pmr::memory_resource* resource() const { return m_resource; }
+
 	template< typename System, typename... Args >
 	System* register_system( Args&&... args )
 	{
@@ -245,16 +345,44 @@ public:
 			register_create< System, mpl::head<component_list>, handle >( (System*)(c) );
 	}
 
-	template < typename Component, typename IndexTable = flat_index_table >
+	// An explicit IndexTable overrides component_index_table< Component >,
+	// but typed access then goes through the virtual index_table interface -
+	// specialize component_index_table instead to have it called directly.
+	// The storage layout always comes from component_storage_layout, as
+	// every typed access path is compiled for it.
+	template < typename Component, typename IndexTable = index_table_of< Component > >
 	void register_component( bool relational = false )
 	{
-		component_interface* result = new component_interface;
+		int id = component_id< Component >::value;
+		if ( id < 0 && component_id< Component >::value.compare_exchange_strong( id, detail::next_component_id() ) )
+			id = component_id< Component >::value;
+		component_interface* result = make_object< component_interface >();
 		result->m_relational = relational;
-		result->m_storage = new component_storage_handler< Component >( relational );
-		result->m_index   = new IndexTable( result->m_storage );
+		result->m_id         = id;
+		if constexpr ( is_archetype_layout< Component > )
+		{
+			assert( !relational && "archetype_layout components can't be relational!" );
+			result->m_archetype = true;
+			m_archetypes.register_type( id, sizeof( Component ), alignof( Component ), raw_destroy_object< Component >,
+				std::is_trivially_copyable< Component >::value ? nullptr : raw_relocate_object< Component > );
+		}
+		else
+		{
+			typedef storage_handler_of< Component > storage_type;
+			result->m_storage = make_object< storage_type >( relational, m_resource, &m_chunk_pool );
+			result->m_index   = make_object< IndexTable >( result->m_storage, m_resource );
+			result->m_typed_index = std::is_same< IndexTable, index_table_of< Component > >::value;
+			result->m_release = [] ( ecs& e, component_interface* ci )
+			{
+				e.destroy_object( static_cast< IndexTable* >( ci->m_index ) );
+				e.destroy_object( static_cast< storage_type* >( ci->m_storage ) );
+			};
+		}
 
 		m_components.push_back( result );
-		m_component_map[&typeid(Component)] = result;
+		if ( id >= int( m_component_map.size() ) )
+			m_component_map.resize( id + 1, nullptr );
+		m_component_map[id] = result;
 	}
 
 	handle create()
@@ -262,14 +390,151 @@ public:
 		return m_handles.create_handle();
 	}
 
+	// creates count handles and writes them to out
+	template < typename OutputIt >
+	OutputIt create_n( int count, OutputIt out )
+	{
+		m_handles.reserve( count );
+		for ( int i = 0; i < count; ++i )
+			*out++ = m_handles.create_handle();
+		return out;
+	}
+
 	void update( float dtime )
 	{
+		reorder_relational();
 		this->update_time( dtime );
-		for ( auto u : m_update_handlers )
-			u( dtime );
-		for ( auto h : m_dead_handles )
-			remove( h );
-		m_dead_handles.clear();
+		if ( m_pool )
+			run_scheduled_updates( dtime );
+		else
+			for ( int i = 0; i < int( m_update_handlers.size() ); ++i )
+			{
+				command_scope scope( i );
+				m_update_handlers[i].handler( dtime );
+			}
+		apply_commands();
+		if ( !m_dead_handles.empty() )
+		{
+			// destroy handlers may mark more for the next frame
+			std::pmr::vector< handle > dead( m_resource );
+			dead.swap( m_dead_handles );
+			remove( dead );
+		}
+	}
+
+	// Update handlers that don't conflict on component access will run
+	// concurrently on count worker threads. Zero reverts to serial updates.
+	void set_thread_count( unsigned count )
+	{
+		apply_commands();
+		m_pool.reset( count > 0 ? new thread_pool( count ) : nullptr );
+		m_commands.resize( m_pool ? m_pool->size() + 1 : 1 );
+		for ( auto& b : m_commands )
+			if ( !b ) b.reset( new command_buffer_type );
+		this->set_producer_count( m_pool ? m_pool->size() + 1 : 1 );
+	}
+
+	// Relational storages keep parents before children. A change that
+	// breaks that (attaching, adding or removing a row) reorders the storage
+	// right away, a pass over all of it. Deferred, the storages are only
+	// marked and reordered in one pass by the next update (or
+	// reorder_relational) - until then they are in no particular order.
+	void set_relational_deferred( bool deferred )
+	{
+		m_relational_deferred = deferred;
+		if ( !deferred )
+			reorder_relational();
+	}
+
+	// puts the rows of marked relational storages in depth-first handle
+	// order, which has every parent before its children - read off the
+	// handle order, or sorted by it for storages much smaller than that
+	void reorder_relational()
+	{
+		std::vector< std::pair< int, int > > keys;
+		std::vector< int > order;
+		for ( auto c : m_components )
+		{
+			if ( !c->m_relational_dirty ) continue;
+			c->m_relational_dirty = false;
+			component_storage* storage = c->m_storage;
+			span< const handle > handles = m_handles.depth_first();
+			order.clear();
+			if ( storage->size() * 8 >= handles.size() )
+			{
+				for ( handle h : handles )
+				{
+					int i = h ? c->m_index->get( h ) : -1;
+					if ( i >= 0 )
+						order.push_back( i );
+				}
+			}
+			else
+			{
+				keys.clear();
+				for ( int i = 0; i < storage->size(); ++i )
+					keys.emplace_back( m_handles.position( m_handles.get_handle( storage->index( i ) ) ), i );
+				std::sort( keys.begin(), keys.end() );
+				for ( auto& k : keys )
+					order.push_back( k.second );
+			}
+			assert( int( order.size() ) == storage->size() && "Relational storage row of a dead handle!" );
+			int i = 0;
+			while ( i < int( order.size() ) && order[i] == i )
+				++i;
+			if ( i == int( order.size() ) ) continue; // already in order
+			storage->permute( order.data() );
+			c->m_index->reindex();
+		}
+	}
+
+	// queue from any pool worker or the thread owning the ecs - merged in
+	// on the next update, see message_queue::post_from
+	template < typename Payload, typename ...Args >
+	bool post( time_type delay, Args&&... args )
+	{
+		return this->template post_from< Payload >( m_pool ? m_pool->current_queue() : 0, delay, std::forward<Args>( args )... );
+	}
+
+	// Command buffer of the calling thread - structural changes recorded in
+	// it are applied by apply_commands, which update calls after the update
+	// handlers. Only for the pool workers and the thread owning the ecs.
+	command_buffer_type& commands()
+	{
+		if ( m_commands.empty() )
+			m_commands.emplace_back( new command_buffer_type );
+		return *m_commands[m_pool ? m_pool->current_queue() : 0];
+	}
+
+	// Plays back all recorded commands ordered by command_key - the update
+	// handler and parallel chunk that recorded them - so the result doesn't
+	// depend on which thread ran what. Commands recorded during playback are
+	// left for the next call.
+	void apply_commands()
+	{
+		struct pending
+		{
+			command_key          key;
+			command_buffer_type* buffer;
+			int                  segment;
+		};
+		std::vector< pending > order;
+		std::vector< int > counts;
+		for ( auto& b : m_commands )
+		{
+			counts.push_back( b->segment_count() );
+			for ( int s = 0; s < counts.back(); ++s )
+				order.push_back( pending{ b->segment_key( s ), b.get(), s } );
+		}
+		if ( order.empty() ) return;
+		std::stable_sort( order.begin(), order.end(), [] ( const pending& a, const pending& b ) { return a.key < b.key; } );
+		{
+			command_scope scope( INT_MAX );
+			for ( auto& p : order )
+				p.buffer->play( *this, p.segment );
+		}
+		for ( size_t i = 0; i < m_commands.size(); ++i )
+			m_commands[i]->consume( counts[i] );
 	}
 
 	void clear()
@@ -277,12 +542,23 @@ public:
 		this->reset_events();
 		for ( auto c : m_components )
 		{
+			if ( c->m_archetype )
+			{
+				m_archetypes.for_each_instance( c->m_id, [=] ( void* data ) { call_destructors( c, data ); } );
+				continue;
+			}
 			for ( int i = 0; i < c->m_storage->size(); ++i )
 				call_destructors( c, c->m_storage->raw( i ) );
 			c->m_storage->clear();
 			c->m_index->clear();
+			c->m_relational_dirty = false;
 		}
+		for ( auto& g : m_groups )
+			g->size = 0;
+		m_archetypes.clear();
 		m_handles.clear();
+		for ( auto& b : m_commands )
+			b.reset( new command_buffer_type );
 	}
 
 	~ecs()
@@ -296,9 +572,9 @@ public:
 
 		for ( auto ci : m_components )
 		{
-			delete ci->m_index;
-			delete ci->m_storage;
-			delete ci;
+			if ( ci->m_release )
+				ci->m_release( *this, ci );
+			destroy_object( ci );
 		}
 	}
 
@@ -308,7 +584,7 @@ public:
 			return false;
 		for ( auto c : m_components )
 			if ( c->m_relational )
-				relational_recursive_rebuild( c, child );
+				relational_changed( c, child );
 		return true;
 	}
 
@@ -321,7 +597,7 @@ public:
 	template< typename Component >
 	int get_debug_index( handle h )
 	{
-		return get_interface<Component>()->m_index->get( h );
+		return get_accessor<Component>().get_index( h );
 	}
 
 	handle get_parent( handle h ) const
@@ -341,14 +617,7 @@ public:
 
 	handle next_handle( handle current, handle root )
 	{
-		if ( handle child = first_child( current ) )
-			return child;
-		for ( ;;) {
-			if ( !current || current == root ) return handle();
-			if ( handle nxt = next( current ) )
-				return nxt;
-			current = get_parent( current );
-		};
+		return current ? m_handles.next_in_subtree( current, root ) : handle();
 	}
 
 	bool is_valid( handle h ) const
@@ -370,50 +639,220 @@ public:
 	template < typename C, typename F >
 	void remove_component_if( F&& f )
 	{
-		auto storage = get_storage<C>();
-		auto temp_component = get_interface<C>();
-		unsigned i = 0;
-		while ( i < storage->size() )
-			if ( f( ( *storage )[i] ) )
-				remove_component_by_index( temp_component, i );
-			else
-				++i;
+		if constexpr ( is_archetype_layout< C > )
+		{
+			std::vector< handle > dead;
+			const int id = component_id< C >::value;
+			m_archetypes.for_each_archetype( &id, 1, [&] ( archetype_storage::archetype& a )
+			{
+				for ( int row = 0; row < a.size(); ++row )
+					if ( f( *(C*)a.component( id, row ) ) )
+						dead.push_back( a.handle_at( row ) );
+			} );
+			for ( handle h : dead )
+				remove_component( get_interface<C>(), h );
+		}
+		else
+		{
+			auto storage = get_storage<C>();
+			auto temp_component = get_interface<C>();
+			// rows can't be reordered under the scan
+			bool deferred = m_relational_deferred;
+			m_relational_deferred = true;
+			int i = 0;
+			while ( i < storage->size() )
+				if ( f( ( *storage )[i] ) )
+					remove_component_by_index( temp_component, i );
+				else
+					++i;
+			m_relational_deferred = deferred;
+			if ( !deferred )
+				reorder_relational();
+		}
 	}
 
 	template < typename C>
 	void remove_component( handle h )
 	{
-		auto temp_component = get_interface<C>();
 		remove_component( get_interface<C>(), h );
 	}
 
-	template < typename C, typename F >
+	// calls f( C&, Cs&... ) for every entity that has all the listed components,
+	// iterating the smallest of the participating storages - or, when all of
+	// them are archetype_layout, the columns of the matching archetypes
+	template < typename C, typename... Cs, typename F >
 	void for_each( F&& f )
 	{
-		auto storage = get_storage<C>();
-		assert( storage && "Invalid component" );
-		for ( auto& c : *storage )
+		if constexpr ( archetype_join< C, Cs... > )
+			archetype_rows< C, Cs... >( f );
+		else
+		{
+			if constexpr ( group_join< C, Cs... > )
+				if ( group_data* g = join_group< C, Cs... >() )
+					return group_rows( 0, g->size, f, get_storage< C >()->data(), get_storage< Cs >()->data()... );
+			int driver = join_driver< C, Cs... >();
+			join_rows< C, Cs... >( driver, 0, join_storage< C, Cs... >( driver )->size(), f );
+		}
+	}
+
+	// as for_each, but the driving storage is split into chunks that are run
+	// on the thread pool - f must be safe to call concurrently. Without a pool
+	// (see set_thread_count) this is the same as for_each.
+	template < typename C, typename... Cs, typename F >
+	void parallel_for_each( F&& f )
+	{
+		if constexpr ( archetype_join< C, Cs... > )
+			parallel_archetype_rows< C, Cs... >( f );
+		else
+		{
+			if constexpr ( group_join< C, Cs... > )
+				if ( group_data* g = join_group< C, Cs... >() )
+					return parallel_group_rows< C, Cs... >( g, f );
+			int driver = join_driver< C, Cs... >();
+			component_storage* storage = join_storage< C, Cs... >( driver );
+			int count = storage->size();
+			if ( !m_pool || count == 0 )
+				return join_rows< C, Cs... >( driver, 0, count, f );
+			command_key key = command_key::fork();
+			m_pool->parallel_for( count, parallel_chunk_size( storage, count ), [&] ( int begin, int end )
+			{
+				command_scope scope( key.system, key.phase, begin + 1 );
+				join_rows< C, Cs... >( driver, begin, end, f );
+			} );
+		}
+	}
+
+	// Owning group of C, Cs... - reorders the member storages so that the
+	// entities having all of them are packed in the same prefix, and keeps it
+	// that way on add_component and remove_component. The group is iterated
+	// in lockstep with no lookups, and for_each / systems over exactly these
+	// components use it automatically. A component can be owned by only one
+	// group, and owning slows down adding and removing it.
+	template < typename C, typename... Cs >
+	group_view< C, Cs... > group()
+	{
+		static_assert( sizeof...( Cs ) > 0, "A group needs at least two components!" );
+		static_assert( group_join< C, Cs... >, "Groups need aos_layout components!" );
+		component_interface* cis[] = { get_interface< C >(), get_interface< Cs >()... };
+		group_data* g = cis[0]->m_group;
+		if ( !g )
+		{
+			m_groups.emplace_back( new group_data );
+			g = m_groups.back().get();
+			for ( auto ci : cis )
+			{
+				assert( ci && !ci->m_group && "Component already owned by a group!" );
+				assert( !ci->m_relational && "Relational components can't be owned by a group!" );
+				ci->m_group = g;
+				g->members.push_back( ci );
+			}
+			group_rebuild( g );
+		}
+		assert( ( join_group< C, Cs... >() == g ) && "Components owned by a different group!" );
+		return group_view< C, Cs... >( *this, g );
+	}
+
+	// Calls fn( kernel_batch< C >&, kernel_batch< Cs >&... ) for every entity
+	// having all the listed soa_layout components, KERNEL_BATCH entities at a
+	// time. Every component field is a contiguous lane array in the batch (see
+	// simd.hh for ready column kernels). Batches of components listed as const
+	// are passed as const and not written back. Batches are bound to the
+	// columns in place wherever the joined storages hold the same entities in
+	// the same rows (e.g. filled in the same order), elsewhere a join pays a
+	// gather and scatter per batch:
+	//   ecs.kernel< position, const velocity >( [=] ( auto& p, const auto& v )
+	//   {
+	//       simd::madd( p.template field<0>(), v.template field<0>(), dtime );
+	//   } );
+	// aos_layout and chunked_layout components have no kernel - gathering
+	// them costs more than the vector math saves over for_each and updates.
+	template < typename C, typename... Cs, typename F >
+	void kernel( F&& fn )
+	{
+		using component_list = mpl::list< C, Cs... >;
+		using batches_type   = std::tuple< kernel_batch< C >, kernel_batch< Cs >... >;
+		constexpr int count  = 1 + sizeof...( Cs );
+		static_assert( std::conjunction_v< std::is_same< storage_layout_of< std::remove_const_t< C > >, soa_layout >,
+			std::is_same< storage_layout_of< std::remove_const_t< Cs > >, soa_layout >... >,
+			"kernel needs soa_layout components, use for_each!" );
+		if constexpr ( count == 1 )
+		{
+			// columns are already lane arrays
+			auto* storage = get_storage< std::remove_const_t< C > >();
+			kernel_batch< C > batch;
+			for ( int i = 0; i < storage->size(); i += KERNEL_BATCH )
+			{
+				batch.bind( *storage, i, std::min( KERNEL_BATCH, storage->size() - i ) );
+				fn( static_cast< std::conditional_t< std::is_const< C >::value, const kernel_batch< C >&, kernel_batch< C >& > >( batch ) );
+			}
+		}
+		else
 		{
-			f( c );
+			std::unique_ptr< batches_type > batches( new batches_type );
+			auto accessors = std::make_tuple( get_accessor< std::remove_const_t< C > >(), get_accessor< std::remove_const_t< Cs > >()... );
+			int driver = join_driver< std::remove_const_t< C >, std::remove_const_t< Cs >... >();
+			component_storage* storage = join_storage< std::remove_const_t< C >, std::remove_const_t< Cs >... >( driver );
+			int rows[count][KERNEL_BATCH];
+			int lanes = 0;
+			for ( int first = 0; first < storage->size(); first += KERNEL_BATCH )
+			{
+				int last = std::min( first + KERNEL_BATCH, storage->size() );
+				if ( kernel_aligned( accessors, storage, first, last - first, std::make_index_sequence< count >() ) )
+				{
+					// the same entities in the same rows everywhere, run in place
+					if ( lanes > 0 )
+						run_kernel_batch( component_list(), std::make_index_sequence< count >(), *batches, accessors, rows, lanes, fn );
+					lanes = 0;
+					run_kernel_block( component_list(), std::make_index_sequence< count >(), *batches, accessors, first, last - first, fn );
+					continue;
+				}
+				for ( int i = first; i < last; ++i )
+				{
+					if ( !kernel_rows( accessors, m_handles.get_handle( storage->index( i ) ), driver, i, rows, lanes, std::make_index_sequence< count >() ) )
+						continue;
+					if ( ++lanes == KERNEL_BATCH )
+					{
+						run_kernel_batch( component_list(), std::make_index_sequence< count >(), *batches, accessors, rows, lanes, fn );
+						lanes = 0;
+					}
+				}
+			}
+			if ( lanes > 0 )
+				run_kernel_batch( component_list(), std::make_index_sequence< count >(), *batches, accessors, rows, lanes, fn );
 		}
 	}
 
 
+	// calls f on h and its whole subtree in depth-first order - the subtree
+	// as it was on entry, so handles f attaches aren't visited and ones it
+	// removes are skipped
 	template < typename F >
 	void recursive_call( handle h, F&& f )
 	{
-		f( h );
-		for ( auto c : children( h ) )
-			recursive_call( c, f );
+		if ( !m_handles.is_valid( h ) ) return;
+		// m_walk is a stack, nested calls push their range past ours
+		size_t first = m_walk.size();
+		span< const handle > range = m_handles.subtree( h );
+		m_walk.insert( m_walk.end(), range.begin(), range.end() );
+		size_t last = m_walk.size();
+		for ( size_t i = first; i < last; ++i )
+		{
+			handle c = m_walk[i];
+			if ( m_handles.is_valid( c ) )
+				f( c );
+		}
+		m_walk.resize( first );
 	}
 
 	template < typename Component, typename F >
 	void recursive_component_call( handle h, F&& f )
 	{
-		if ( auto* cmp = get<Component>( h ) )
-			f( cmp );
-		for ( auto c : children( h ) )
-			recursive_component_call<Component>( c, f );
+		auto accessor = get_accessor< Component >();
+		recursive_call( h, [&] ( handle c )
+		{
+			if ( auto* cmp = accessor.get( c ) )
+				f( cmp );
+		} );
 	}
 
 
@@ -424,15 +863,56 @@ public:
 
 	void remove( handle h )
 	{
+		// relational storages are reordered once, after the whole subtree
+		bool deferred = m_relational_deferred;
+		m_relational_deferred = true;
 		handle ch = m_handles.first( h );
 		while ( handle r = ch )
 		{
 			ch = m_handles.next( ch );
 			remove( r );
 		}
+		remove_archetype_entity( h );
 		for ( auto c : m_components )
-			remove_component( c, h );
+			if ( !c->m_archetype )
+				remove_component( c, h );
 		m_handles.free_handle( h );
+		m_relational_deferred = deferred;
+		if ( !deferred )
+			reorder_relational();
+	}
+
+	// Removes the handles and all their descendants, skipping invalid and
+	// repeated ones. Every storage is visited once for the whole set - the
+	// dead rows are found with a scan or by lookups (whichever is cheaper),
+	// have their destroy handlers called and are removed highest first.
+	void remove( span< const handle > handles )
+	{
+		std::vector< handle > dead;
+		collect_dead( handles, dead );
+		if ( dead.empty() ) return;
+		for ( auto& g : m_groups )
+			for ( handle h : dead )
+				group_leave( g.get(), h );
+		for ( handle h : dead )
+			remove_archetype_entity( h );
+		std::vector< int > rows;
+		for ( auto c : m_components )
+		{
+			if ( c->m_archetype ) continue;
+			dead_rows( c, dead, rows );
+			for ( int i : rows )
+				call_destructors( c, c->m_storage->raw( i ) );
+			for ( int i : rows )
+				c->m_index->remove_swap_by_index( i );
+			if ( c->m_relational && !rows.empty() )
+				c->m_relational_dirty = true;
+		}
+		for ( handle h : dead )
+			m_dead_mark[h.index] = false;
+		m_handles.free_handles( dead );
+		if ( !m_relational_deferred )
+			reorder_relational();
 	}
 
 	bool exists( handle h ) const
@@ -443,40 +923,109 @@ public:
 	template < typename Component >
 	Component* get( handle h )
 	{
-		auto it = m_component_map.find( &typeid(Component) );
-		assert( it != m_component_map.end() && "Get fail!" );
-		return static_cast<Component*>( it->second->get_raw( h ) );
+		return get_accessor< Component >().get( h );
 	}
 
 	template < typename Component >
 	const Component* get( handle h ) const
 	{
-		auto it = m_component_map.find( &typeid(Component) );
-		assert( it != m_component_map.end() && "Get fail!" );
-		return static_cast<const Component*>( it->second->get_raw( h ) );
+		return get_accessor< Component >().get( h );
 	}
 
 	template < typename Component >
-	component_storage_handler< Component >*
-		get_storage()
+	storage_handler_of< Component >* get_storage()
 	{
-		return storage_cast<Component>(m_component_map[&typeid(Component)]->m_storage );
+		return storage_cast<Component>( get_interface< Component >()->m_storage );
 	}
 
 	template < typename Component >
-	const component_storage_handler< Component >* get_storage() const
+	const storage_handler_of< Component >* get_storage() const
 	{
-		return storage_cast<Component>(m_component_map[&typeid(Component)]->m_storage);
+		return storage_cast<Component>( get_interface< Component >()->m_storage );
 	}
 
+	// returns Component&, or a soa_reference for soa_layout components
 	template < typename Component, typename ...Args >
-	Component& add_component( handle h, Args&&... args )
+	decltype(auto) add_component( handle h, Args&&... args )
 	{
-		component_interface* ci = get_interface<Component>();
-		auto* cs = get_storage<Component>();
-		int i = ci->m_index->insert( h );
-		assert( i == int( cs->size() ) && "Fail!" );
-		return cs->append<Component>( h.index, std::forward<Args>( args )... );
+		if constexpr ( is_archetype_layout< Component > )
+			return m_archetypes.template add< Component >( h, component_id< Component >::value, std::forward<Args>( args )... );
+		else
+			return add_table_component< Component >( h, std::forward<Args>( args )... );
+	}
+
+	template < typename Component, typename ...Args >
+	decltype(auto) add_table_component( handle h, Args&&... args )
+	{
+		auto ca = get_accessor<Component>();
+		[[maybe_unused]] int i = ca.insert( h );
+		assert( i == int( ca.storage->size() ) && "Fail!" );
+		decltype(auto) result = ca.storage->template append<Component>( h.index, std::forward<Args>( args )... );
+		component_interface* ci = get_interface< Component >();
+		if ( ci->m_group )
+		{
+			group_enter( ci->m_group, h );
+			return ( *ca.storage )[ca.get_index( h )];
+		}
+		// children having it come before the new row
+		if ( ci->m_relational && m_handles.first( h ) )
+		{
+			relational_changed( ci, h );
+			return ( *ca.storage )[ca.get_index( h )];
+		}
+		return result;
+	}
+
+	// Adds a copy of components[i] to handles[i]. Index and storage room is
+	// made once, trivially copyable aos_layout components are copied with a
+	// single memcpy, and create handlers run after all rows are in place.
+	template < typename Component >
+	void add_components( span< const handle > handles, span< const Component > components )
+	{
+		assert( handles.size() == components.size() && "add_components size mismatch!" );
+		if constexpr ( is_archetype_layout< Component > )
+		{
+			for ( int i = 0; i < handles.size(); ++i )
+				m_archetypes.template add< Component >( handles[i], component_id< Component >::value, components[i] );
+		}
+		else
+		{
+			int first = insert_rows< Component >( handles );
+			auto* storage = get_storage< Component >();
+			if constexpr ( std::is_same< storage_layout_of< Component >, soa_layout >::value )
+				for ( int i = 0; i < handles.size(); ++i )
+					storage->store( first + i, components[i] );
+			else if constexpr ( std::is_trivially_copyable< Component >::value && std::is_same< storage_layout_of< Component >, aos_layout >::value )
+				memcpy( storage->data() + first, components.data(), handles.size() * sizeof( Component ) );
+			else
+				for ( int i = 0; i < handles.size(); ++i )
+					construct_object< Component >( &( *storage )[first + i], components[i] );
+		}
+		added_rows< Component >( handles );
+	}
+
+	// as above, with every component constructed from args
+	template < typename Component, typename... Args,
+		typename = std::enable_if_t< detail::is_brace_constructible< Component, const Args&... >( 0 ) > >
+	void add_components( span< const handle > handles, const Args&... args )
+	{
+		if constexpr ( is_archetype_layout< Component > )
+		{
+			for ( handle h : handles )
+				m_archetypes.template add< Component >( h, component_id< Component >::value, args... );
+		}
+		else
+		{
+			int first = insert_rows< Component >( handles );
+			auto* storage = get_storage< Component >();
+			if constexpr ( std::is_same< storage_layout_of< Component >, soa_layout >::value )
+				for ( int i = 0; i < handles.size(); ++i )
+					storage->store( first + i, Component{ args... } );
+			else
+				for ( int i = 0; i < handles.size(); ++i )
+					construct_object< Component >( &( *storage )[first + i], args... );
+		}
+		added_rows< Component >( handles );
 	}
 
 	template < typename Component, typename ...Args >
@@ -501,34 +1050,32 @@ public:
 	template < typename System, typename Components, template <class...> class List, typename... Messages >
 	void register_component_messages( System* h, List<Messages...>&& )
 	{
-		int unused_0[] = { ( register_ecs_component_message<System,Messages>( h, Components() , std::bool_constant< has_ecs_component_message< this_type, System, Components, Messages > >() ), 0 )... };
-		int unused_1[] = { ( register_component_message<System,Messages>( h, Components(), std::bool_constant< has_component_message< System, Components, Messages > >() ), 0 )... };
+		( register_ecs_component_message<System,Messages>( h, Components() , std::bool_constant< has_ecs_component_message< this_type, System, Components, Messages > >() ), ... );
+		( register_component_message<System,Messages>( h, Components(), std::bool_constant< has_component_message< System, Components, Messages > >() ), ... );
 	}
 
 	template < typename System, template <class...> class List, typename... Messages >
 	void register_ecs_messages( System* h, List<Messages...>&& )
 	{
-		int unused_0[] = { ( register_ecs_message<System,Messages>( h, std::bool_constant< has_ecs_message< this_type, System, Messages > >() ), 0 )... };
+		( register_ecs_message<System,Messages>( h, std::bool_constant< has_ecs_message< this_type, System, Messages > >() ), ... );
 	}
 
 	template < typename System, typename Message, typename C, typename... Cs >
 	void register_component_message( System* s, mpl::list< C, Cs...>&&, std::true_type&& )
 	{
-		component_interface* ci = get_interface<C>();
+		auto ca = get_accessor<C>();
 		this->register_callback( Message::message_id, [=] ( const message& msg )
 		{
 			const Message& m = message_cast<Message>( msg );
-			auto callback = [=] ( handle h )
+			gather_components<0, Cs... > gather( *this );
+			auto callback = [&] ( handle h )
 			{
-				if ( void* c = ci->get_raw( h ) )
-				{
-					gather_components<0, Cs... > gather( *this );
+				if ( C* c = ca.get( h ) )
 					if ( gather.run( h ) )
-						s->on( m, *( (C*)( c ) ), gather.template get<Cs>()... );
-				}
+						s->on( m, *c, gather.template get<Cs>()... );
 			};
 			if ( msg.recursive )
-				this->recursive_call( m.entity, std::move( callback ) );
+				this->recursive_call( m.entity, callback );
 			else
 				callback( m.entity );
 
@@ -538,18 +1085,16 @@ public:
 	template < typename System, typename Message, typename C, typename... Cs >
 	void register_ecs_component_message( System* s, mpl::list< C, Cs...>&&, std::true_type&& )
 	{
-		component_interface* ci = get_interface<C>();
+		auto ca = get_accessor<C>();
 		this->register_callback( Message::message_id, [=] ( const message& msg )
 		{
 			const Message& m = message_cast<Message>( msg );
-			auto callback = [=] ( handle h )
+			gather_components<0, Cs... > gather( *this );
+			auto callback = [&] ( handle h )
 			{
-				if ( void* c = ci->get_raw( h ) )
-				{
-					gather_components<0, Cs... > gather( *this );
+				if ( C* c = ca.get( h ) )
 					if ( gather.run( h ) )
-						s->on( m, *this, *( (C*)( c ) ), gather.template get<Cs>()... );
-				}
+						s->on( m, *this, *c, gather.template get<Cs>()... );
 			};
 			if ( msg.recursive )
 				this->recursive_call( m.entity, callback );
@@ -589,6 +1134,7 @@ public:
 	template < typename System, typename Component >
 	void register_destroy( System* s )
 	{
+		static_assert( !std::is_same< storage_layout_of< Component >, soa_layout >::value, "destroy can't take a soa_layout component!" );
 		component_interface* ci = get_interface<Component>();
 		assert( ci && "Unregistered component!" );
 		ci->m_destroy.push_back( [=] ( void* data )
@@ -601,11 +1147,12 @@ public:
 	template < typename System, typename Component, typename H >
 	void register_create( System* s )
 	{
+		static_assert( !std::is_same< storage_layout_of< Component >, soa_layout >::value, "create can't take a soa_layout component!" );
 		component_interface* ci = get_interface<Component>();
 		assert( ci && "Unregistered component!" );
-		ci->m_create.push_back( [=] ( H h, void* data, const lua::stack_proxy& p )
+		ci->m_create.push_back( [=] ( H h, void* data )
 		{
-			s->create( h, *( (Component*)data ), p );
+			s->create( h, *( (Component*)data ) );
 		}
 		);
 	}
@@ -613,74 +1160,495 @@ public:
 	template < typename System, typename C, typename... Cs >
 	void register_component_update( System* s, mpl::list< C, Cs...>&& )
 	{
-		auto* storage = get_storage<C>();
 		register_update( [=] ( float dtime )
 		{
-			gather_components<0, Cs... > gather( *this );
-			for ( auto& c : *storage )
-			{
-				if ( gather.runc( c ) )
-					s->update( c, gather.template get<Cs>()..., dtime );
-			}
-		} );
+			auto f = [=] ( C& c, Cs&... cs ) { s->update( c, cs..., dtime ); };
+			if constexpr ( is_parallel_system< System > )
+				parallel_for_each< C, Cs... >( f );
+			else
+				for_each< C, Cs... >( f );
+		}, component_update_access< System, C, Cs... >( std::make_integer_sequence< int, 1 + sizeof...( Cs ) >() ) );
 	}
 
 	template < typename System, typename C, typename... Cs >
 	void register_ecs_component_update( System* s, mpl::list< C, Cs...>&& )
 	{
-		auto* storage = get_storage<C>();
+		static_assert( !is_parallel_system< System >, "Updates taking the ecs can't be parallel!" );
 		register_update( [=] ( float dtime )
 		{
-			gather_components<0, Cs... > gather(*this);
-			for ( auto& c : *storage )
-			{
-				if ( gather.runc( c ) )
-					s->update( *this, c, gather.template get<Cs>()..., dtime );
-			}
+			for_each< C, Cs... >( [=] ( C& c, Cs&... cs ) { s->update( *this, c, cs..., dtime ); } );
 		} );
 	}
 
+	// Handlers registered without an access set can touch anything (including
+	// the ecs itself), so they never run alongside other handlers.
 	void register_update( update_handler&& handler )
 	{
-		m_update_handlers.push_back( handler );
+		update_entry entry;
+		entry.handler = std::move( handler );
+		add_update_entry( std::move( entry ) );
+	}
+
+	void register_update( update_handler&& handler, component_access&& access )
+	{
+		update_entry entry;
+		entry.handler   = std::move( handler );
+		entry.access    = std::move( access );
+		entry.exclusive = false;
+		add_update_entry( std::move( entry ) );
 	}
 
 	template < typename Component >
 	component_interface* get_interface()
 	{
-		return m_component_map[&typeid(Component)];
+		int id = component_id< Component >::value;
+		return unsigned( id ) < m_component_map.size() ? m_component_map[id] : nullptr;
+	}
+
+	template < typename Component >
+	component_accessor< Component > get_accessor() const
+	{
+		const component_interface* ci = get_interface< Component >();
+		assert( ci && "Unregistered component!" );
+		if constexpr ( is_archetype_layout< Component > )
+			return { const_cast< archetype_storage* >( &m_archetypes ), ci->m_id };
+		else
+		{
+			if ( !ci->m_typed_index )
+				return { nullptr, storage_cast< Component >( ci->m_storage ), ci->m_index };
+			return { static_cast< index_table_of< Component >* >( ci->m_index ), storage_cast< Component >( ci->m_storage ) };
+		}
 	}
 
 	template < typename Component >
 	const component_interface* get_interface() const
 	{
-		return m_component_map[&typeid(Component)];
+		int id = component_id< Component >::value;
+		return unsigned( id ) < m_component_map.size() ? m_component_map[id] : nullptr;
 	}
 
 protected:
+	template < typename T, typename... Args >
+	T* make_object( Args&&... args )
+	{
+		void* data = m_resource->allocate( sizeof( T ), alignof( T ) );
+		return new ( data ) T( std::forward< Args >( args )... );
+	}
+
+	template < typename T >
+	void destroy_object( T* object )
+	{
+		object->~T();
+		m_resource->deallocate( object, sizeof( T ), alignof( T ) );
+	}
+
+	template < typename... Cs >
+	static constexpr bool archetype_join = ( is_archetype_layout< Cs > && ... );
+
+	// index (in C, Cs...) of the smallest storage, which drives the join -
+	// archetype_layout components have none and are only probed
+	template < typename C, typename... Cs >
+	int join_driver()
+	{
+		if constexpr ( sizeof...( Cs ) == 0 )
+			return 0;
+		component_interface* cis[] = { get_interface<C>(), get_interface<Cs>()... };
+		int result = -1;
+		for ( int i = 0; i < int( sizeof...( Cs ) ) + 1; ++i )
+			if ( !cis[i]->m_archetype && ( result < 0 || cis[i]->m_storage->size() < cis[result]->m_storage->size() ) )
+				result = i;
+		return result;
+	}
+
+	template < typename... Cs >
+	static constexpr bool group_join = ( std::is_same< storage_layout_of< Cs >, aos_layout >::value && ... );
+
+	// the group owning exactly C, Cs..., if any
+	template < typename C, typename... Cs >
+	group_data* join_group()
+	{
+		component_interface* cis[] = { get_interface<C>(), get_interface<Cs>()... };
+		group_data* g = cis[0]->m_group;
+		if ( !g || g->members.size() != sizeof...( Cs ) + 1 ) return nullptr;
+		for ( auto ci : cis )
+			if ( ci->m_group != g ) return nullptr;
+		return g;
+	}
+
+	template < typename F, typename... Ts >
+	static void group_rows( int begin, int end, F& f, Ts*... columns )
+	{
+		for ( int i = begin; i < end; ++i )
+			f( columns[i]... );
+	}
 
-	void relational_rebuild( component_interface* ci, int i )
+	template < typename C, typename... Cs, typename F >
+	void parallel_group_rows( group_data* g, F& f )
 	{
-		handle h = *(handle*)(ci->m_storage->raw( i ));
-		handle p = get_parent( h );
-		if ( !p ) return;
-		if ( i < ci->m_index->get( p ) )
+		int count = g->size;
+		if ( !m_pool || count == 0 )
+			return group_rows( 0, count, f, get_storage< C >()->data(), get_storage< Cs >()->data()... );
+		command_key key = command_key::fork();
+		m_pool->parallel_for( count, parallel_chunk_size( get_interface< C >()->m_storage, count ), [&] ( int begin, int end )
 		{
-			ci->m_index->swap( h, p );
-			relational_rebuild( ci, i );
+			command_scope scope( key.system, key.phase, begin + 1 );
+			group_rows( begin, end, f, get_storage< C >()->data(), get_storage< Cs >()->data()... );
+		} );
+	}
+
+	void group_rebuild( group_data* g )
+	{
+		component_interface* driver = g->members[0];
+		for ( auto ci : g->members )
+			if ( ci->m_storage->size() < driver->m_storage->size() )
+				driver = ci;
+		std::vector< handle > handles( driver->m_storage->size() );
+		for ( int i = 0; i < int( handles.size() ); ++i )
+			handles[i] = m_handles.get_handle( driver->m_storage->index( i ) );
+		g->size = 0;
+		for ( handle h : handles )
+			group_enter( g, h );
+	}
+
+	void group_enter( group_data* g, handle h )
+	{
+		for ( auto ci : g->members )
+			if ( ci->m_index->get( h ) < 0 ) return;
+		for ( auto ci : g->members )
+			group_swap( ci, h, g->size );
+		g->size++;
+	}
+
+	void group_leave( group_data* g, handle h )
+	{
+		int i = g->members[0]->m_index->get( h );
+		if ( i < 0 || i >= g->size ) return;
+		g->size--;
+		for ( auto ci : g->members )
+			group_swap( ci, h, g->size );
+	}
+
+	// moves h to row i of the storage of ci
+	void group_swap( component_interface* ci, handle h, int i )
+	{
+		handle other = m_handles.get_handle( ci->m_storage->index( i ) );
+		if ( other != h )
+			ci->m_index->swap( h, other );
+	}
+
+	template < typename C, typename... Cs, typename F >
+	void archetype_rows( F& f )
+	{
+		const int ids[] = { component_id< C >::value, component_id< Cs >::value... };
+		m_archetypes.for_each_archetype( ids, 1 + int( sizeof...( Cs ) ), [&] ( archetype_storage::archetype& a )
+		{
+			for ( int chunk = 0; chunk < a.chunk_count(); ++chunk )
+				archetype_chunk< C, Cs... >( a, chunk, ids, f, std::make_index_sequence< 1 + sizeof...( Cs ) >() );
+		} );
+	}
+
+	// one task per archetype chunk
+	template < typename C, typename... Cs, typename F >
+	void parallel_archetype_rows( F& f )
+	{
+		if ( !m_pool )
+			return archetype_rows< C, Cs... >( f );
+		const int ids[] = { component_id< C >::value, component_id< Cs >::value... };
+		std::vector< std::pair< archetype_storage::archetype*, int > > chunks;
+		m_archetypes.for_each_archetype( ids, 1 + int( sizeof...( Cs ) ), [&] ( archetype_storage::archetype& a )
+		{
+			for ( int chunk = 0; chunk < a.chunk_count(); ++chunk )
+				if ( a.chunk_rows( chunk ) > 0 )
+					chunks.emplace_back( &a, chunk );
+		} );
+		command_key key = command_key::fork();
+		m_pool->parallel_for( int( chunks.size() ), 1, [&] ( int begin, int end )
+		{
+			command_scope scope( key.system, key.phase, begin + 1 );
+			for ( int i = begin; i < end; ++i )
+				archetype_chunk< C, Cs... >( *chunks[i].first, chunks[i].second, ids, f, std::make_index_sequence< 1 + sizeof...( Cs ) >() );
+		} );
+	}
+
+	template < typename... Ts, typename F, size_t... Is >
+	static void archetype_chunk( archetype_storage::archetype& a, int chunk, const int* ids, F& f, std::index_sequence< Is... >&& )
+	{
+		std::tuple< Ts*... > columns( (Ts*)a.column_data( ids[Is], chunk )... );
+		int rows = a.chunk_rows( chunk );
+		for ( int i = 0; i < rows; ++i )
+			f( std::get< Is >( columns )[i]... );
+	}
+
+	template < typename C, typename... Cs >
+	component_storage* join_storage( int driver )
+	{
+		component_interface* cis[] = { get_interface<C>(), get_interface<Cs>()... };
+		assert( cis[driver] && "Invalid component" );
+		return cis[driver]->m_storage;
+	}
+
+	template < typename C, typename... Cs, typename F >
+	void join_rows( int driver, int begin, int end, F& f )
+	{
+		if constexpr ( sizeof...( Cs ) == 0 && !std::is_same< storage_layout_of< C >, soa_layout >::value )
+		{
+			// chunk by chunk, each a contiguous run
+			auto* storage = get_storage<C>();
+			for ( int i = begin; i < end; )
+			{
+				span< C > rows = storage->rows( i, end );
+				for ( C& c : rows )
+					f( c );
+				i += rows.size();
+			}
+		}
+		else if constexpr ( sizeof...( Cs ) == 0 )
+		{
+			auto* storage = get_storage<C>();
+			for ( int i = begin; i < end; ++i )
+				f( ( *storage )[i] );
+		}
+		else
+		{
+			gather_components<0, C, Cs... > gather( *this );
+			component_storage* storage = gather.cis[driver]->m_storage;
+			for ( int i = begin; i < end; ++i )
+				if ( gather.run( m_handles.get_handle( storage->index( i ) ), driver, storage->raw( i ) ) )
+					f( gather.template get<C>(), gather.template get<Cs>()... );
 		}
 	}
 
-	void relational_recursive_rebuild( component_interface* ci, handle h )
+	template < typename Accessors, size_t... Is >
+	static bool kernel_rows( const Accessors& accessors, handle h, int driver, int row, int ( *rows )[KERNEL_BATCH], int lane, std::index_sequence< Is... >&& )
 	{
-		handle p = get_parent( h );
-		if ( !p ) return;
-		if ( ci->m_index->get( h ) < ci->m_index->get( p ) )
+		return ( ( ( rows[Is][lane] = int( Is ) == driver ? row : std::get< Is >( accessors ).get_index( h ) ) >= 0 ) && ... );
+	}
+
+	template < typename Accessors, size_t... Is >
+	static bool kernel_aligned( const Accessors& accessors, const component_storage* storage, int first, int count, std::index_sequence< Is... >&& )
+	{
+		return ( ( std::get< Is >( accessors ).storage == storage || std::get< Is >( accessors ).storage->same_owners( *storage, first, count ) ) && ... );
+	}
+
+	template < typename... Ts, size_t... Is, typename Batches, typename Accessors, typename F >
+	static void run_kernel_batch( mpl::list< Ts... >&&, std::index_sequence< Is... >&&, Batches& batches, Accessors& accessors, int ( *rows )[KERNEL_BATCH], int lanes, F& fn )
+	{
+		( std::get< Is >( batches ).load( *std::get< Is >( accessors ).storage, rows[Is], lanes ), ... );
+		fn( static_cast< std::conditional_t< std::is_const< Ts >::value, const kernel_batch< Ts >&, kernel_batch< Ts >& > >( std::get< Is >( batches ) )... );
+		( ( std::is_const< Ts >::value ? void() : std::get< Is >( batches ).store( *std::get< Is >( accessors ).storage, rows[Is] ) ), ... );
+	}
+
+	template < typename... Ts, size_t... Is, typename Batches, typename Accessors, typename F >
+	static void run_kernel_block( mpl::list< Ts... >&&, std::index_sequence< Is... >&&, Batches& batches, Accessors& accessors, int first, int count, F& fn )
+	{
+		( std::get< Is >( batches ).bind( *std::get< Is >( accessors ).storage, first, count ), ... );
+		fn( static_cast< std::conditional_t< std::is_const< Ts >::value, const kernel_batch< Ts >&, kernel_batch< Ts >& > >( std::get< Is >( batches ) )... );
+	}
+
+	// rows per parallel chunk - a multiple of line_rows, so with the line
+	// aligned storage blocks chunks never share a cache line
+	int parallel_chunk_size( const component_storage* storage, int count ) const
+	{
+		const int step = storage->line_rows();
+		int chunks = int( m_pool->size() + 1 ) * 4;
+		int rows   = std::max( ( count + chunks - 1 ) / chunks, 256 );
+		return ( rows + step - 1 ) / step * step;
+	}
+
+	template < typename System, typename... Cs, int... Is >
+	component_access component_update_access( std::integer_sequence< int, Is... >&& )
+	{
+		using component_list = mpl::list< Cs... >;
+		component_access result;
+		( ( has_const_component_update< System, component_list, float, Is > ? result.reads : result.writes ).push_back( get_interface< Cs >() ), ... );
+		return result;
+	}
+
+	static bool contains( const std::vector< component_interface* >& list, component_interface* ci )
+	{
+		return std::find( list.begin(), list.end(), ci ) != list.end();
+	}
+
+	static bool conflicts( const update_entry& a, const update_entry& b )
+	{
+		if ( a.exclusive || b.exclusive ) return true;
+		for ( auto ci : a.access.writes )
+			if ( contains( b.access.writes, ci ) || contains( b.access.reads, ci ) )
+				return true;
+		for ( auto ci : b.access.writes )
+			if ( contains( a.access.reads, ci ) )
+				return true;
+		return false;
+	}
+
+	// every handler waits for all earlier handlers it conflicts with, which
+	// keeps the results identical to the serial registration order
+	void add_update_entry( update_entry&& entry )
+	{
+		int index = int( m_update_handlers.size() );
+		for ( int i = 0; i < index; ++i )
+			if ( conflicts( m_update_handlers[i], entry ) )
+			{
+				m_update_handlers[i].successors.push_back( index );
+				entry.predecessors++;
+			}
+		m_update_handlers.push_back( std::move( entry ) );
+		m_update_pending = std::vector< std::atomic< int > >( m_update_handlers.size() );
+	}
+
+	void run_scheduled_updates( float dtime )
+	{
+		int count = int( m_update_handlers.size() );
+		for ( int i = 0; i < count; ++i )
+			m_update_pending[i].store( m_update_handlers[i].predecessors, std::memory_order_relaxed );
+		m_update_remaining.store( count, std::memory_order_release );
+		for ( int i = 0; i < count; ++i )
+			if ( m_update_handlers[i].predecessors == 0 )
+				schedule_update( i, dtime );
+		m_pool->wait( m_update_remaining );
+	}
+
+	void schedule_update( int index, float dtime )
+	{
+		m_pool->submit( [=] ()
+		{
+			update_entry& u = m_update_handlers[index];
+			{
+				command_scope scope( index );
+				u.handler( dtime );
+			}
+			for ( int s : u.successors )
+				if ( m_update_pending[s].fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+					schedule_update( s, dtime );
+			m_update_remaining.fetch_sub( 1, std::memory_order_acq_rel );
+		} );
+	}
+
+	// the row of h moved or h got a new parent or children - if its row
+	// is no longer between its parent's and its children's the storage is
+	// reordered (swapping rows around would only move the violation)
+	void relational_changed( component_interface* ci, handle h )
+	{
+		if ( m_relational_deferred )
+		{
+			ci->m_relational_dirty = true;
+			return;
+		}
+		int i = ci->m_index->get( h );
+		if ( i < 0 ) return;
+		handle p = m_handles.get_parent( h );
+		bool ordered = !p || ci->m_index->get( p ) < i;
+		for ( handle c = m_handles.first( h ); ordered && c; c = m_handles.next( c ) )
+		{
+			int ic = ci->m_index->get( c );
+			ordered = ic < 0 || ic > i;
+		}
+		if ( ordered ) return;
+		ci->m_relational_dirty = true;
+		reorder_relational();
+	}
+
+	// the last row moved into i, unless it was the one removed
+	void relational_removed( component_interface* ci, int i )
+	{
+		if ( i < ci->m_storage->size() )
+			relational_changed( ci, *(handle*)( ci->m_storage->raw( i ) ) );
+	}
+
+	// index entries and storage rows for handles, left for the caller to
+	// construct - returns the first row
+	template < typename Component >
+	int insert_rows( span< const handle > handles )
+	{
+		auto ca = get_accessor< Component >();
+		int max_index = 0;
+		for ( handle h : handles )
+			max_index = std::max( max_index, int( h.index ) );
+		ca.reserve( handles.size(), max_index );
+		ca.storage->reserve_more( handles.size() );
+		int first = ca.storage->size();
+		for ( handle h : handles )
+		{
+			ca.insert( h );
+			ca.storage->append_uninitialized( h.index );
+		}
+		return first;
+	}
+
+	template < typename Component >
+	void added_rows( span< const handle > handles )
+	{
+		component_interface* ci = get_interface< Component >();
+		if ( ci->m_group )
+			for ( handle h : handles )
+				group_enter( ci->m_group, h );
+		if ( ci->m_relational )
+		{
+			ci->m_relational_dirty = true;
+			if ( !m_relational_deferred )
+				reorder_relational();
+		}
+		if constexpr ( !std::is_same< storage_layout_of< Component >, soa_layout >::value )
+			for ( auto& ch : ci->m_create )
+				for ( handle h : handles )
+					ch( h, get< Component >( h ) );
+	}
+
+	// valid handles and their descendants, parents first, marked in
+	// m_dead_mark - whole subtree ranges, taken in depth-first order so a
+	// handle listed below another one is already marked when reached
+	void collect_dead( span< const handle > handles, std::vector< handle >& dead )
+	{
+		std::vector< std::pair< int, handle > > roots;
+		for ( handle h : handles )
+			if ( m_handles.is_valid( h ) )
+				roots.emplace_back( m_handles.position( h ), h );
+		std::sort( roots.begin(), roots.end(), [] ( const auto& a, const auto& b ) { return a.first < b.first; } );
+		for ( auto& r : roots )
+		{
+			if ( r.second.index < m_dead_mark.size() && m_dead_mark[r.second.index] ) continue;
+			for ( handle h : m_handles.subtree( r.second ) )
+			{
+				if ( !h ) continue;
+				if ( h.index >= m_dead_mark.size() )
+					m_dead_mark.resize( std::max< size_t >( h.index + 1, m_dead_mark.size() * 2 ), false );
+				m_dead_mark[h.index] = true;
+				dead.push_back( h );
+			}
+		}
+	}
+
+	// storage rows of the dead set, highest first - removing them in this
+	// order never swaps a dead row into a hole
+	void dead_rows( component_interface* ci, const std::vector< handle >& dead, std::vector< int >& rows )
+	{
+		rows.clear();
+		component_storage* storage = ci->m_storage;
+		if ( storage->size() <= int( dead.size() ) )
 		{
-			ci->m_index->swap( h, p );
-			for ( auto c : children( h ) )
-				relational_recursive_rebuild( ci, c );
+			for ( int i = storage->size() - 1; i >= 0; --i )
+			{
+				unsigned index = unsigned( storage->index( i ) );
+				if ( index < m_dead_mark.size() && m_dead_mark[index] )
+					rows.push_back( i );
+			}
+			return;
 		}
+		for ( handle h : dead )
+		{
+			int i = ci->m_index->get( h );
+			if ( i >= 0 )
+				rows.push_back( i );
+		}
+		std::sort( rows.begin(), rows.end(), std::greater< int >() );
+	}
+
+	void remove_archetype_entity( handle h )
+	{
+		if ( auto* ids = m_archetypes.components( h ) )
+			for ( int id : *ids )
+				call_destructors( m_component_map[id], m_archetypes.get( h, id ) );
+		m_archetypes.remove_entity( h );
 	}
 
 	void call_destructors( component_interface* ci, void* data )
@@ -691,28 +1659,56 @@ protected:
 
 	void remove_component_by_index( component_interface* ci, int i )
 	{
-		if ( i > ci->m_storage->size() ) return;
+		if ( i >= ci->m_storage->size() ) return;
+		if ( ci->m_group )
+		{
+			handle h = m_handles.get_handle( ci->m_storage->index( i ) );
+			group_leave( ci->m_group, h );
+			i = ci->m_index->get( h );
+		}
 		call_destructors( ci, ci->m_storage->raw( i ) );
 		int dead_eindex = ci->m_index->remove_swap_by_index( i );
 		if ( ci->m_relational )
-			relational_rebuild( ci, dead_eindex );
+			relational_removed( ci, dead_eindex );
 	}
 
 	void remove_component( component_interface* ci, handle h )
 	{
-		void* v = ci->get_raw( h );
-		if ( v == nullptr ) return;
-		call_destructors( ci, v );
-		int dead_eindex = ci->m_index->remove_swap( h );
+		if ( ci->m_archetype )
+		{
+			if ( void* data = m_archetypes.get( h, ci->m_id ) )
+			{
+				call_destructors( ci, data );
+				m_archetypes.remove( h, ci->m_id );
+			}
+			return;
+		}
+		if ( ci->m_group )
+			group_leave( ci->m_group, h );
+		int i = ci->m_index->get( h );
+		if ( i < 0 ) return;
+		call_destructors( ci, ci->m_storage->raw( i ) );
+		int dead_eindex = ci->m_index->remove_swap_by_index( i );
 		if ( ci->m_relational )
-			relational_rebuild( ci, dead_eindex );
+			relational_removed( ci, dead_eindex );
 	}
 
+	std::pmr::memory_resource*                       m_resource;
+	chunk_pool                                       m_chunk_pool; // of chunked_layout storages
 	handle_tree_manager                              m_handles;
-	std::vector< handle >                            m_dead_handles;
+	std::pmr::vector< handle >                       m_dead_handles;
+	std::pmr::vector< bool >                         m_dead_mark;
+	std::pmr::vector< handle >                       m_walk; // recursive_call stack
+	bool                                             m_relational_deferred = false;
 	std::vector< component_interface* >              m_components;
-	std::unordered_map< const std::type_info*, component_interface* > m_component_map;
-	std::vector< update_handler >                    m_update_handlers;
+	std::vector< component_interface* >              m_component_map;
+	archetype_storage                                m_archetypes;
+	std::vector< std::unique_ptr< group_data > >     m_groups;
+	std::vector< update_entry >                      m_update_handlers;
+	std::vector< std::atomic< int > >                m_update_pending;
+	std::atomic< int >                               m_update_remaining{ 0 };
+	std::unique_ptr< thread_pool >                   m_pool;
+	std::vector< std::unique_ptr< command_buffer_type > > m_commands;
 
 	std::vector< std::function< void() > >           m_cleanup;
 };
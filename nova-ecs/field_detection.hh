@@ -4,7 +4,9 @@
 #ifndef NV_ECS_FIELD_DETECTION_HH
 #define NV_ECS_FIELD_DETECTION_HH
 
+#include <utility>
 #include "mpl.hh"
+#include "span.hh"
 
 namespace detail
 {
@@ -33,11 +35,23 @@ namespace detail
 	constexpr bool has_destroy( ... ) { return false; }
 
 	template< typename C >
-	constexpr decltype( std::declval< C::components >(), true) has_components( int ) { return true; }
+	constexpr decltype( std::declval< typename C::components >(), true) has_components( int ) { return true; }
 
 	template< typename C >
 	constexpr bool has_components( ... ) { return false; }
 
+	template< typename C >
+	constexpr decltype( C::parallel, true ) is_parallel( int ) { return C::parallel; }
+
+	template< typename C >
+	constexpr bool is_parallel( ... ) { return false; }
+
+	template< typename C >
+	constexpr decltype( C::ordered, true ) is_ordered( int ) { return C::ordered; }
+
+	template< typename C >
+	constexpr bool is_ordered( ... ) { return false; }
+
 	template < typename S, typename T, typename Cs >
 	struct has_ct_update_helper;
 
@@ -47,6 +61,15 @@ namespace detail
 		static constexpr bool value = detail::has_update< S, Cs&..., T >( 0 );
 	};
 
+	template < typename S, typename T, int K, typename Cs, typename Is >
+	struct has_const_ct_update_helper;
+
+	template < typename S, typename T, int K, typename... Cs, int... Is >
+	struct has_const_ct_update_helper< S, T, K, mpl::list< Cs... >, std::integer_sequence< int, Is... > >
+	{
+		static constexpr bool value = detail::has_update< S, std::conditional_t< Is == K, const Cs&, Cs& >..., T >( 0 );
+	};
+
 	template < typename S, typename E, typename T, typename Cs >
 	struct has_ect_update_helper;
 
@@ -79,9 +102,24 @@ namespace detail
 template < typename S, typename M >
 constexpr bool has_message = detail::has_message<S, const M& >( 0 );
 
+// on( span< const M > ) - all due messages of type M at once
+template < typename S, typename M >
+constexpr bool has_batch_message = detail::has_message<S, span< const M > >( 0 );
+
+// systems declaring static constexpr bool ordered = true get their message
+// batches split into runs, in time order with the other message types
+template < typename S >
+constexpr bool is_ordered_system = detail::is_ordered<S>( 0 );
+
 template < typename S >
 constexpr bool has_components = detail::has_components<S>( 0 );
 
+// systems declaring static constexpr bool parallel = true get their
+// component updates split across the thread pool - those can't take the
+// ecs, as it isn't safe to change from several threads
+template < typename S >
+constexpr bool is_parallel_system = detail::is_parallel<S>( 0 );
+
 template < typename E, typename S, typename T >
 constexpr bool has_ecs_update = detail::has_update<S, E&, T>( 0 );
 
@@ -97,6 +135,10 @@ constexpr bool has_create = detail::has_create<S, H, T& >(0);
 template < typename S, typename Cs, typename T >
 constexpr bool has_component_update = detail::has_ct_update_helper<S, T, Cs >::value;
 
+// true if the K-th component of the update can be passed as const (read-only access)
+template < typename S, typename Cs, typename T, int K >
+constexpr bool has_const_component_update = detail::has_const_ct_update_helper<S, T, K, Cs, std::make_integer_sequence< int, mpl::list_size< Cs >::value > >::value;
+
 template < typename E, typename S, typename Cs, typename T >
 constexpr bool has_ecs_component_update = detail::has_ect_update_helper<S, E, T, Cs >::value;
 
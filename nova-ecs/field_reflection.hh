@@ -0,0 +1,61 @@
+// Copyright (C) 2017-2017 ChaosForge Ltd
+// http://chaosforge.org/
+
+#ifndef NV_ECS_FIELD_REFLECTION_HH
+#define NV_ECS_FIELD_REFLECTION_HH
+
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// Field access for plain aggregates (up to 8 fields, no array members),
+// based on brace initialization and structured bindings.
+
+namespace detail
+{
+	struct any_field
+	{
+		template < typename T >
+		constexpr operator T() const;
+	};
+
+	template< typename T, typename... Fields >
+	constexpr decltype( T{ std::declval< Fields >()... }, true ) is_brace_constructible( int ) { return true; }
+
+	template< typename T, typename... Fields >
+	constexpr bool is_brace_constructible( ... ) { return false; }
+
+	template< typename T, typename... Fields >
+	constexpr int field_count()
+	{
+		if constexpr ( sizeof...( Fields ) <= 8 && is_brace_constructible< T, Fields..., any_field >( 0 ) )
+			return field_count< T, Fields..., any_field >();
+		else
+			return int( sizeof...( Fields ) );
+	}
+}
+
+template < typename T >
+constexpr int field_count = detail::field_count< T >();
+
+// tuple of references to the fields of an aggregate
+template < typename T >
+auto field_tie( T& t )
+{
+	constexpr int count = field_count< std::remove_cv_t< T > >;
+	static_assert( std::is_aggregate< std::remove_cv_t< T > >::value && count > 0 && count <= 8,
+		"field_tie needs an aggregate of 1 to 8 fields!" );
+	if constexpr ( count == 1 ) { auto& [a] = t; return std::tie( a ); }
+	else if constexpr ( count == 2 ) { auto& [a, b] = t; return std::tie( a, b ); }
+	else if constexpr ( count == 3 ) { auto& [a, b, c] = t; return std::tie( a, b, c ); }
+	else if constexpr ( count == 4 ) { auto& [a, b, c, d] = t; return std::tie( a, b, c, d ); }
+	else if constexpr ( count == 5 ) { auto& [a, b, c, d, e] = t; return std::tie( a, b, c, d, e ); }
+	else if constexpr ( count == 6 ) { auto& [a, b, c, d, e, f] = t; return std::tie( a, b, c, d, e, f ); }
+	else if constexpr ( count == 7 ) { auto& [a, b, c, d, e, f, g] = t; return std::tie( a, b, c, d, e, f, g ); }
+	else { auto& [a, b, c, d, e, f, g, h] = t; return std::tie( a, b, c, d, e, f, g, h ); }
+}
+
+template < typename T, int I >
+using field_type = std::remove_reference_t< std::tuple_element_t< I, decltype( field_tie( std::declval< T& >() ) ) > >;
+
+#endif // NV_ECS_FIELD_REFLECTION_HH
@@ -4,37 +4,61 @@
 #ifndef NV_ECS_HANDLE_HH
 #define NV_ECS_HANDLE_HH
 
+#include <climits>
+#include <cstdint>
 #include <functional> // hash
+#include <type_traits>
 
-class handle
+// Handle layout - index bits limit the number of live entities, counter
+// bits how many times an index can be reused before a stale handle aliases
+// a new one. Handles are 32 bits wide up to 32 bits total, 64 bits above.
+// Set both for the whole build, e.g.:
+//   defines { "NV_ECS_HANDLE_INDEX_BITS=24", "NV_ECS_HANDLE_COUNTER_BITS=8" }
+#ifndef NV_ECS_HANDLE_INDEX_BITS
+#define NV_ECS_HANDLE_INDEX_BITS 16
+#endif
+#ifndef NV_ECS_HANDLE_COUNTER_BITS
+#define NV_ECS_HANDLE_COUNTER_BITS 16
+#endif
+
+template < int IndexBits, int CounterBits >
+class basic_handle
 {
 public:
-	static constexpr int INDEX_BITS   = 16;
-	static constexpr int COUNTER_BITS = 16;
+	static_assert( IndexBits > 0 && CounterBits > 0 && IndexBits + CounterBits <= 64, "Invalid handle layout!" );
+	typedef std::conditional_t< IndexBits + CounterBits <= 32, uint32_t, uint64_t > value_type;
+
+	static constexpr int INDEX_BITS   = IndexBits;
+	static constexpr int COUNTER_BITS = CounterBits;
+	static constexpr value_type COUNTER_MASK = value_type( ( uint64_t( 1 ) << CounterBits ) - 1 );
+	// rows and indices are int everywhere else
+	static constexpr int MAX_INDEX = IndexBits < 31 ? int( ( 1u << IndexBits ) - 1 ) : INT_MAX;
 
-	constexpr handle() : index( 0 ), counter( 0 ) {}
-	constexpr handle( unsigned a_index, unsigned a_counter )
+	constexpr basic_handle() : index( 0 ), counter( 0 ) {}
+	constexpr basic_handle( value_type a_index, value_type a_counter )
 		: index( a_index ), counter( a_counter ) {}
-	
-	constexpr inline bool operator==( const handle& rhs ) const	{
+
+	constexpr inline bool operator==( const basic_handle& rhs ) const	{
 		return index == rhs.index && counter == rhs.counter;
 	}
-	constexpr inline bool operator!=( const handle& rhs ) const { return !(*this == rhs); }
+	constexpr inline bool operator!=( const basic_handle& rhs ) const { return !(*this == rhs); }
 
 	constexpr bool is_valid()    const { return !(index == 0 && counter == 0); }
 	constexpr operator bool()    const { return is_valid(); }
-	constexpr unsigned hash()    const { return counter << INDEX_BITS | index; }
-	unsigned index   : INDEX_BITS;
-	unsigned counter : COUNTER_BITS;
+	constexpr value_type hash()  const { return value_type( counter ) << INDEX_BITS | index; }
+	value_type index   : INDEX_BITS;
+	value_type counter : COUNTER_BITS;
 };
 
+typedef basic_handle< NV_ECS_HANDLE_INDEX_BITS, NV_ECS_HANDLE_COUNTER_BITS > handle;
+
 namespace std
 {
-	template<> struct hash<handle>
+	template < int IndexBits, int CounterBits > struct hash< basic_handle< IndexBits, CounterBits > >
 	{
-		size_t operator()( const handle& s ) const noexcept
+		size_t operator()( const basic_handle< IndexBits, CounterBits >& s ) const noexcept
 		{
-			return s.hash();
+			return size_t( s.hash() );
 		}
 	};
 }
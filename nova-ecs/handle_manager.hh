@@ -21,8 +21,9 @@ public:
 	handle create_handle()
 	{
 		value_type i = get_free_entry();
-		m_entries[i].counter++;
-		assert( m_entries[i].counter != 0 && "Out of handles!" );
+		// the counter wraps within the handle, skipping the null handle
+		m_entries[i].counter = ( m_entries[i].counter + 1 ) & handle::COUNTER_MASK;
+		if ( m_entries[i].counter == 0 ) m_entries[i].counter = 1;
 		m_entries[i].next_free = USED;
 		return handle( i, m_entries[i].counter );
 	}
@@ -57,7 +58,7 @@ public:
 
 	handle get_handle( index_type i ) const
 	{
-		if ( i >= 0 && i < m_entries.size() )
+		if ( i >= 0 && i < index_type( m_entries.size() ) )
 			return handle( i, m_entries[i].counter );
 		return {};
 	}
@@ -65,7 +66,7 @@ public:
 private:
 	struct index_entry
 	{
-		value_type counter;
+		handle::value_type counter;
 		index_type next_free;
 
 		index_entry() : counter( 0 ), next_free( NONE ) {}
@@ -81,6 +82,7 @@ private:
 			if ( m_first_free == NONE ) m_last_free = NONE;
 			return result;
 		}
+		assert( m_entries.size() <= size_t( handle::MAX_INDEX ) && "Out of handles!" );
 		m_entries.emplace_back();
 		return value_type( m_entries.size() - 1 );
 	}
@@ -4,10 +4,19 @@
 #ifndef NV_ECS_HANDLE_TREE_MANAGER_HH
 #define NV_ECS_HANDLE_TREE_MANAGER_HH
 
+#include <algorithm>
+#include <memory_resource>
 #include <vector>
 #include <cassert>
 #include "handle.hh"
+#include "span.hh"
 
+// Handles with a parent / child hierarchy. Besides the sibling links, the
+// live handles are kept in depth-first order in one array - every handle is
+// followed by its subtree, so a subtree is a contiguous range of it (see
+// subtree). Children are listed in first / next sibling order, so the
+// latest attached comes first. Freed handles leave null holes, compacted
+// once they outnumber the live handles.
 class handle_tree_manager
 {
 	typedef int index_type;
@@ -17,21 +26,26 @@ public:
 
 	typedef unsigned value_type;
 
-	handle_tree_manager()
-		: m_first_free( NONE ), m_last_free( NONE ) {}
+	explicit handle_tree_manager( std::pmr::memory_resource* resource = std::pmr::get_default_resource() )
+		: m_first_free( NONE ), m_last_free( NONE ), m_entries( resource ), m_order( resource ) {}
 
 	handle create_handle()
 	{
 		value_type i = get_free_entry();
-		m_entries[i].counter++;
-		assert( m_entries[i].counter != 0 && "Out of handles!" );
+		// the counter wraps within the handle, skipping the null handle
+		m_entries[i].counter = ( m_entries[i].counter + 1 ) & handle::COUNTER_MASK;
+		if ( m_entries[i].counter == 0 ) m_entries[i].counter = 1;
 		m_entries[i].next_free = USED;
-		return handle( i, m_entries[i].counter );
+		m_entries[i].position  = index_type( m_order.size() );
+		m_entries[i].subtree   = 1;
+		m_order.push_back( handle( i, m_entries[i].counter ) );
+		return m_order.back();
 	}
 
 	void free_handle( handle h )
 	{
-		remove( h );
+		release( h );
+		compact_if_sparse();
 		value_type index = h.index;
 		m_entries[index].next_free = NONE;
 		if ( m_last_free == NONE )
@@ -43,17 +57,60 @@ public:
 		m_last_free = index_type(index);
 	}
 
+	// makes room for count more handles
+	void reserve( int count )
+	{
+		size_t needed = m_entries.size() + size_t( count );
+		if ( needed > m_entries.capacity() )
+			m_entries.reserve( std::max( needed, m_entries.capacity() * 2 ) );
+		needed = m_order.size() + size_t( count );
+		if ( needed > m_order.capacity() )
+			m_order.reserve( std::max( needed, m_order.capacity() * 2 ) );
+	}
+
+	// frees the handles last to first (so children listed after their
+	// parents go first) and appends them to the free list as one chain
+	void free_handles( span< const handle > handles )
+	{
+		if ( handles.empty() ) return;
+		for ( int i = handles.size() - 1; i >= 0; --i )
+			release( handles[i] );
+		compact_if_sparse();
+		for ( int i = 0; i < handles.size(); ++i )
+			m_entries[handles[i].index].next_free = i + 1 < handles.size() ? index_type( handles[i + 1].index ) : NONE;
+		index_type first = index_type( handles[0].index );
+		if ( m_last_free == NONE )
+			m_first_free = first;
+		else
+			m_entries[m_last_free].next_free = first;
+		m_last_free = index_type( handles[handles.size() - 1].index );
+	}
+
+	// O(depth of parent + slots between parent and the subtree of child) -
+	// the current subtree of parent moves too, so giving one parent n
+	// children one by one is O(n^2)
 	bool attach( handle parent, handle child )
 	{
 		value_type pindex = parent.index;
 		value_type cindex = child.index;
-		if ( m_entries[cindex].parent == pindex )
+		if ( m_entries[cindex].parent == index_type( pindex ) )
 			return false;
 		if ( m_entries[cindex].parent != NONE )
 			detach( child );
+		// move the subtree of child right after parent, where its first child
+		// goes
+		index_type from  = m_entries[cindex].position;
+		index_type count = m_entries[cindex].subtree;
+		index_type to    = m_entries[pindex].position + 1;
+		if ( from >= to )
+			move_range( to, from, from + count );
+		else
+			move_range( from, from + count, to );
+		for ( index_type a = index_type( pindex ); a != NONE; a = m_entries[a].parent )
+			m_entries[a].subtree += count;
 		m_entries[cindex].parent = pindex;
 		m_entries[cindex].next_sibling = m_entries[pindex].first_child;
-		value_type nindex = m_entries[cindex].next_sibling;
+		index_type nindex = m_entries[cindex].next_sibling;
 		if ( nindex != NONE )
 			m_entries[nindex].prev_sibling = cindex;
 		m_entries[cindex].prev_sibling = NONE;
@@ -64,24 +121,66 @@ public:
 	handle get_parent( handle h ) const
 	{
 		assert( is_valid( h ) && "INVALID HANDLE" );
-		value_type pindex = m_entries[h.index].parent;
+		index_type pindex = m_entries[h.index].parent;
 		return pindex == NONE ? handle() : handle( pindex, m_entries[pindex].counter );
 	}
 
 	handle next( handle h ) const
 	{
 		assert( is_valid( h ) && "INVALID HANDLE" );
-		value_type nindex = m_entries[h.index].next_sibling;
+		index_type nindex = m_entries[h.index].next_sibling;
 		return nindex == NONE ? handle() : handle( nindex, m_entries[nindex].counter );
 	}
 
 	handle first( handle h ) const
 	{
 		assert( is_valid( h ) && "INVALID HANDLE" );
-		value_type nindex = m_entries[h.index].first_child;
+		index_type nindex = m_entries[h.index].first_child;
 		return nindex == NONE ? handle() : handle( nindex, m_entries[nindex].counter );
 	}
 
+	// the handle after h in a pre-order walk of the subtree of root, or a
+	// null handle past its end
+	handle next_in_subtree( handle h, handle root ) const
+	{
+		assert( is_valid( h ) && "INVALID HANDLE" );
+		index_type index = index_type( h.index );
+		index_type child = m_entries[index].first_child;
+		if ( child != NONE )
+			return handle( child, m_entries[child].counter );
+		while ( index != index_type( root.index ) )
+		{
+			index_type sibling = m_entries[index].next_sibling;
+			if ( sibling != NONE )
+				return handle( sibling, m_entries[sibling].counter );
+			index = m_entries[index].parent;
+			if ( index == NONE ) break;
+		}
+		return handle();
+	}
+
+	// the subtree of h in depth-first order, h first - null handles in it
+	// are holes left by freed handles. Invalidated by any change to the
+	// hierarchy and by creating handles.
+	span< const handle > subtree( handle h ) const
+	{
+		assert( is_valid( h ) && "INVALID HANDLE" );
+		const index_entry& e = m_entries[h.index];
+		return span< const handle >( m_order.data() + e.position, e.subtree );
+	}
+
+	// all live handles in depth-first order, with holes as above
+	span< const handle > depth_first() const
+	{
+		return span< const handle >( m_order.data(), int( m_order.size() ) );
+	}
+
+	// index of h in depth_first() - ancestors have lower ones
+	int position( handle h ) const
+	{
+		assert( is_valid( h ) && "INVALID HANDLE" );
+		return m_entries[h.index].position;
+	}
 
 	void remove( handle h )
 	{
@@ -101,41 +200,27 @@ public:
 			m_entries[child].next_sibling = NONE;
 			m_entries[child].prev_sibling = NONE;
 		}
+		// the children become roots where they are
+		m_entries[index].subtree = 1;
 	}
 
 	void detach( handle h )
 	{
 		value_type index = h.index;
-		index_type pindex = m_entries[index].parent;
-		index_type next_index = m_entries[index].next_sibling;
-		index_type prev_index = m_entries[index].prev_sibling;
-
-		m_entries[index].parent = NONE;
-		m_entries[index].next_sibling = NONE;
-		m_entries[index].prev_sibling = NONE;
-
-		if ( pindex == NONE )
+		if ( m_entries[index].parent != NONE )
 		{
-			assert( next_index == NONE && "Hierarchy fail! next_index" );
-			assert( prev_index == NONE && "Hierarchy fail! prev_index" );
-			return;
-		}
-		if ( value_type( m_entries[pindex].first_child ) == index )
-		{
-			assert( prev_index == NONE && "Hierarchy fail! prev_index" );
-			m_entries[pindex].first_child = next_index;
-			if ( next_index == NONE ) // only child
-				return;
-			m_entries[next_index].prev_sibling = NONE;
-		}
-		else
-		{
-			assert( prev_index != NONE && "Hierarchy fail! prev_index" );
-			if ( next_index != NONE )
-				m_entries[next_index].prev_sibling = prev_index;
-			if ( prev_index != NONE )
-				m_entries[prev_index].next_sibling = next_index;
+			// ancestors shrink, the subtree moves past the range of the root
+			index_type count = m_entries[index].subtree;
+			index_type root  = NONE;
+			for ( index_type a = m_entries[index].parent; a != NONE; a = m_entries[a].parent )
+			{
+				m_entries[a].subtree -= count;
+				root = a;
+			}
+			index_type from = m_entries[index].position;
+			move_range( from, from + count, m_entries[root].position + m_entries[root].subtree + count );
 		}
+		unlink( index );
 	}
 
 	bool is_valid( handle h ) const
@@ -151,12 +236,21 @@ public:
 		m_first_free = NONE;
 		m_last_free = NONE;
 		m_entries.clear();
+		m_order.clear();
+		m_holes = 0;
+	}
+
+	handle get_handle( index_type i ) const
+	{
+		if ( i >= 0 && i < index_type( m_entries.size() ) )
+			return handle( i, m_entries[i].counter );
+		return {};
 	}
 
 private:
 	struct index_entry
 	{
-		value_type counter;
+		handle::value_type counter;
 		index_type next_free;
 
 		index_type parent;
@@ -164,6 +258,9 @@ private:
 		index_type next_sibling;
 		index_type prev_sibling;
 
+		index_type position; // in m_order
+		index_type subtree;  // slots of m_order the subtree spans, holes included
+
 		index_entry()
 			: counter( 0 )
 			, next_free( NONE )
@@ -171,9 +268,82 @@ private:
 			, first_child( NONE )
 			, next_sibling( NONE )
 			, prev_sibling( NONE )
+			, position( NONE )
+			, subtree( 0 )
 		{}
 	};
 
+	// takes a childless h out of the hierarchy - its slot becomes a hole
+	// inside the ranges of its ancestors, so nothing moves
+	void release( handle h )
+	{
+		assert( m_entries[h.index].first_child == NONE && "Remove called on handle with children!" );
+		unlink( h.index );
+		m_order[m_entries[h.index].position] = handle();
+		m_holes++;
+	}
+
+	// moves [middle, last) in front of [first, middle)
+	void move_range( index_type first, index_type middle, index_type last )
+	{
+		std::rotate( m_order.begin() + first, m_order.begin() + middle, m_order.begin() + last );
+		for ( index_type i = first; i < last; ++i )
+			if ( m_order[i] )
+				m_entries[m_order[i].index].position = i;
+	}
+
+	void compact_if_sparse()
+	{
+		if ( m_holes < 64 || m_holes * 2 < m_order.size() ) return;
+		// live slots before each position give the new positions and sizes
+		std::vector< index_type > live( m_order.size() + 1, 0 );
+		for ( size_t i = 0; i < m_order.size(); ++i )
+			live[i + 1] = live[i] + ( m_order[i] ? 1 : 0 );
+		for ( handle h : m_order )
+			if ( h )
+			{
+				index_entry& e = m_entries[h.index];
+				e.subtree  = live[e.position + e.subtree] - live[e.position];
+				e.position = live[e.position];
+			}
+		m_order.erase( std::remove( m_order.begin(), m_order.end(), handle() ), m_order.end() );
+		m_holes = 0;
+	}
+
+	void unlink( value_type index )
+	{
+		index_type pindex = m_entries[index].parent;
+		index_type next_index = m_entries[index].next_sibling;
+		index_type prev_index = m_entries[index].prev_sibling;
+
+		m_entries[index].parent = NONE;
+		m_entries[index].next_sibling = NONE;
+		m_entries[index].prev_sibling = NONE;
+
+		if ( pindex == NONE )
+		{
+			assert( next_index == NONE && "Hierarchy fail! next_index" );
+			assert( prev_index == NONE && "Hierarchy fail! prev_index" );
+			return;
+		}
+		if ( value_type( m_entries[pindex].first_child ) == index )
+		{
+			assert( prev_index == NONE && "Hierarchy fail! prev_index" );
+			m_entries[pindex].first_child = next_index;
+			if ( next_index == NONE ) // only child
+				return;
+			m_entries[next_index].prev_sibling = NONE;
+		}
+		else
+		{
+			assert( prev_index != NONE && "Hierarchy fail! prev_index" );
+			if ( next_index != NONE )
+				m_entries[next_index].prev_sibling = prev_index;
+			if ( prev_index != NONE )
+				m_entries[prev_index].next_sibling = next_index;
+		}
+	}
+
 	value_type get_free_entry()
 	{
 		if ( m_first_free != NONE )
@@ -184,13 +354,16 @@ private:
 			if ( m_first_free == NONE ) m_last_free = NONE;
 			return result;
 		}
+		assert( m_entries.size() <= size_t( handle::MAX_INDEX ) && "Out of handles!" );
 		m_entries.emplace_back();
 		return value_type( m_entries.size() - 1 );
 	}
 
 	index_type m_first_free;
 	index_type m_last_free;
-	std::vector< index_entry > m_entries;
+	std::pmr::vector< index_entry > m_entries;
+	std::pmr::vector< handle >      m_order; // depth-first, see subtree
+	size_t                          m_holes = 0;
 };
 
 #endif // NV_ECS_HANDLE_TREE_MANAGER_HH
@@ -4,13 +4,16 @@
 #ifndef NV_ECS_INDEX_TABLE_HH
 #define NV_ECS_INDEX_TABLE_HH
 
+#include <algorithm>
+#include <memory_resource>
 #include <vector>
-#include <unordered_map>
 #include "component_storage.hh"
+#include "archetype_storage.hh"
 
 class index_table
 {
 public:
+	virtual ~index_table() {}
 	virtual int insert( handle h ) = 0;
 	virtual bool exists( handle h ) const = 0;
 	virtual int get( handle h ) const = 0;
@@ -19,12 +22,18 @@ public:
 	virtual int remove_swap_by_index( int dead_eindex ) = 0;
 	virtual void clear() = 0;
 	virtual int size() const = 0;
+	// makes room for count more handles, none with index above max_index
+	virtual void reserve( int count, int max_index ) = 0;
+	// points every handle at its row again, after the storage rows were
+	// reordered (see component_storage::permute)
+	virtual void reindex() = 0;
 };
 
-class flat_index_table : public index_table
+class flat_index_table final : public index_table
 {
 public:
-	explicit flat_index_table( component_storage* storage ) : m_storage( storage ) {}
+	explicit flat_index_table( component_storage* storage, std::pmr::memory_resource* resource = std::pmr::get_default_resource() )
+		: m_indexes( resource ), m_storage( storage ) {}
 
 	int insert( handle h )
 	{
@@ -82,9 +91,20 @@ public:
 
 	int size() const { return m_storage->size(); }
 
+	void reserve( int, int max_index )
+	{
+		resize_indexes_to( max_index );
+	}
+
+	void reindex()
+	{
+		for ( int i = 0; i < m_storage->size(); ++i )
+			m_indexes[m_storage->index( i )] = i;
+	}
+
 	int find_index( int idx ) const
 	{
-		for ( int i = 0; i < m_indexes.size(); ++i )
+		for ( int i = 0; i < int( m_indexes.size() ); ++i )
 			if ( m_indexes[i] == idx )
 				return m_storage->index( i );
 		return {};
@@ -102,82 +122,384 @@ private:
 		}
 	}
 
-	std::vector< int > m_indexes;
+	std::pmr::vector< int > m_indexes;
 	component_storage* m_storage = nullptr;
 };
 
-class hashed_index_table : public index_table
+// Splits the flat index into fixed size pages, allocated when the first
+// handle in their range gets inserted and released once they become empty.
+// Unused directory slots point at a shared page of -1s, so get() needs only
+// the directory bounds check.
+class paged_index_table final : public index_table
+{
+public:
+	static constexpr int PAGE_BITS = 8;
+	static constexpr int PAGE_SIZE = 1 << PAGE_BITS;
+	static constexpr int PAGE_MASK = PAGE_SIZE - 1;
+
+	explicit paged_index_table( component_storage* storage, std::pmr::memory_resource* resource = std::pmr::get_default_resource() )
+		: m_pages( resource ), m_counts( resource ), m_storage( storage ) {}
+
+	int insert( handle h )
+	{
+		assert( !exists( h ) && "Reinserting handle!" );
+		int lindex = m_storage->size();
+		set( h.index, lindex );
+		return lindex;
+	}
+
+	bool exists( handle h ) const
+	{
+		return get( h ) >= 0;
+	}
+
+	int get( handle h ) const
+	{
+		unsigned page = h.index >> PAGE_BITS;
+		if ( !h || page >= m_pages.size() ) return -1;
+		return m_pages[page][h.index & PAGE_MASK];
+	}
+
+	void swap( handle a, handle b )
+	{
+		int a_idx = get( a );
+		int b_idx = get( b );
+		if ( a_idx == -1 || b_idx == -1 ) return;
+		entry( a.index ) = b_idx;
+		entry( b.index ) = a_idx;
+		m_storage->swap( a_idx, b_idx );
+	}
+
+	int remove_swap( handle h )
+	{
+		int dead_eindex = get( h );
+		if ( dead_eindex == -1 ) return -1;
+		return remove_swap_by_index( dead_eindex );
+	}
+
+	int remove_swap_by_index( int dead_eindex )
+	{
+		if ( dead_eindex >= m_storage->size() ) return -1;
+		int dead_h_index = m_storage->index( dead_eindex );
+		int swap_handle = m_storage->remove_swap( dead_eindex );
+		if ( swap_handle != -1 )
+			entry( swap_handle ) = dead_eindex;
+		release( dead_h_index );
+		return dead_eindex;
+	}
+
+	void clear()
+	{
+		for ( unsigned i = 0; i < m_pages.size(); ++i )
+			if ( m_counts[i] > 0 )
+				free_page( m_pages[i] );
+		m_pages.clear();
+		m_counts.clear();
+		m_storage->clear();
+	}
+
+	int size() const { return m_storage->size(); }
+
+	void reserve( int, int max_index )
+	{
+		unsigned pages = ( unsigned( max_index ) >> PAGE_BITS ) + 1;
+		if ( pages > m_pages.size() )
+		{
+			m_pages.resize( pages, empty_page() );
+			m_counts.resize( pages, 0 );
+		}
+	}
+
+	void reindex()
+	{
+		for ( int i = 0; i < m_storage->size(); ++i )
+			entry( m_storage->index( i ) ) = i;
+	}
+
+	// number of allocated pages
+	int page_count() const
+	{
+		return int( std::count_if( m_counts.begin(), m_counts.end(), [] ( int c ) { return c > 0; } ) );
+	}
+
+	~paged_index_table()
+	{
+		for ( unsigned i = 0; i < m_pages.size(); ++i )
+			if ( m_counts[i] > 0 )
+				free_page( m_pages[i] );
+	}
+
+private:
+	static int* empty_page()
+	{
+		static int* page = [] ()
+		{
+			static int data[PAGE_SIZE];
+			std::fill( data, data + PAGE_SIZE, -1 );
+			return data;
+		}();
+		return page;
+	}
+
+	int& entry( int index )
+	{
+		return m_pages[index >> PAGE_BITS][index & PAGE_MASK];
+	}
+
+	void set( int index, int value )
+	{
+		unsigned page = unsigned( index ) >> PAGE_BITS;
+		if ( page >= m_pages.size() )
+		{
+			m_pages.resize( page + 1, empty_page() );
+			m_counts.resize( page + 1, 0 );
+		}
+		if ( m_counts[page] == 0 )
+		{
+			m_pages[page] = (int*)m_pages.get_allocator().resource()->allocate( PAGE_SIZE * sizeof( int ), alignof( int ) );
+			std::fill( m_pages[page], m_pages[page] + PAGE_SIZE, -1 );
+		}
+		m_counts[page]++;
+		m_pages[page][index & PAGE_MASK] = value;
+	}
+
+	void release( int index )
+	{
+		unsigned page = unsigned( index ) >> PAGE_BITS;
+		m_pages[page][index & PAGE_MASK] = -1;
+		if ( --m_counts[page] == 0 )
+		{
+			free_page( m_pages[page] );
+			m_pages[page] = empty_page();
+		}
+	}
+
+	void free_page( int* page )
+	{
+		m_pages.get_allocator().resource()->deallocate( page, PAGE_SIZE * sizeof( int ), alignof( int ) );
+	}
+
+	std::pmr::vector< int* > m_pages;
+	std::pmr::vector< int >  m_counts;
+	component_storage*       m_storage = nullptr;
+};
+
+// Open addressing hash of handle index to storage index, with linear
+// probing. Slots are a flat array of key/value pairs, and removal shifts
+// the following cluster back instead of leaving tombstones.
+class hashed_index_table final : public index_table
 {
 public:
-	explicit hashed_index_table( component_storage* storage ) : m_storage( storage ) {}
+	explicit hashed_index_table( component_storage* storage, std::pmr::memory_resource* resource = std::pmr::get_default_resource() )
+		: m_slots( resource ), m_storage( storage ) {}
 
 	int insert( handle h )
 	{
-		assert( m_indexes.find( h.index ) == m_indexes.end() && "Reinserting handle!" );
+		assert( find( h.index ) == -1 && "Reinserting handle!" );
+		if ( ( m_count + 1 ) * 2 > int( m_slots.size() ) )
+			rehash( m_slots.empty() ? 16 : int( m_slots.size() ) * 2 );
 		int lindex = m_storage->size();
-		m_indexes[h.index] = int( lindex );
+		unsigned i = home( h.index );
+		while ( m_slots[i].key != EMPTY )
+			i = ( i + 1 ) & m_mask;
+		m_slots[i].key   = int( h.index );
+		m_slots[i].value = lindex;
+		m_count++;
 		return lindex;
 	}
 
 	bool exists( handle h ) const
 	{
-		auto ih = m_indexes.find( h.index );
-		return ( ih != m_indexes.end() );
+		return h && find( h.index ) != -1;
 	}
 
 	int get( handle h ) const
 	{
-		auto ih = m_indexes.find( h.index );
-		if ( ih == m_indexes.end() ) return -1;
-		return ih->second;
+		if ( !h ) return -1;
+		int slot = find( h.index );
+		return slot == -1 ? -1 : m_slots[slot].value;
 	}
 
 	void swap( handle a, handle b )
 	{
 		if ( !a || !b ) return;
-		auto ai = m_indexes.find( a.index );
-		auto bi = m_indexes.find( b.index );
-		if ( ai == m_indexes.end() || bi == m_indexes.end() ) return;
-		int a_idx = ai->second;
-		int b_idx = bi->second;
-		ai->second = b_idx;
-		bi->second = a_idx;
+		int ai = find( a.index );
+		int bi = find( b.index );
+		if ( ai == -1 || bi == -1 ) return;
+		int a_idx = m_slots[ai].value;
+		int b_idx = m_slots[bi].value;
+		m_slots[ai].value = b_idx;
+		m_slots[bi].value = a_idx;
 		m_storage->swap( a_idx, b_idx );
 	}
 
 	int remove_swap( handle h )
 	{
 		if ( !h ) return -1;
-		int dead_h_index = h.index;
-		auto ih = m_indexes.find( dead_h_index );
-		if ( ih == m_indexes.end() || ih->second == int(-1) ) return -1;
-		return remove_swap_by_index( ih->second );
+		int slot = find( h.index );
+		if ( slot == -1 ) return -1;
+		return remove_swap_by_index( m_slots[slot].value );
 	}
 
 	int remove_swap_by_index( int dead_eindex )
 	{
 		if ( dead_eindex >= m_storage->size() ) return -1;
-		int dead_h_index = m_storage->index(dead_eindex);
-		m_indexes.erase( dead_h_index );
+		int dead_h_index = m_storage->index( dead_eindex );
+		erase( dead_h_index );
 		int swap_handle = m_storage->remove_swap( dead_eindex );
 		if ( swap_handle != -1 )
-			m_indexes[swap_handle] = dead_eindex;
+			m_slots[find( swap_handle )].value = dead_eindex;
 		return dead_eindex;
 	}
 
-
 	void clear()
 	{
-		m_indexes.clear();
+		std::fill( m_slots.begin(), m_slots.end(), slot{} );
+		m_count = 0;
 		m_storage->clear();
 	}
 
 	int size() const { return m_storage->size(); }
 
+	void reserve( int count, int )
+	{
+		int capacity = m_slots.empty() ? 16 : int( m_slots.size() );
+		while ( ( m_count + count ) * 2 > capacity )
+			capacity *= 2;
+		if ( capacity > int( m_slots.size() ) )
+			rehash( capacity );
+	}
+
+	void reindex()
+	{
+		for ( int i = 0; i < m_storage->size(); ++i )
+			m_slots[find( unsigned( m_storage->index( i ) ) )].value = i;
+	}
+
 private:
+	static constexpr int EMPTY = -1;
 
-	std::unordered_map< int, int > m_indexes;
-	component_storage*             m_storage = nullptr;
+	struct slot
+	{
+		int key   = EMPTY;
+		int value = -1;
+	};
+
+	unsigned home( unsigned key ) const
+	{
+		// Fibonacci hashing - sequential handle indices spread over the table
+		return ( key * 2654435769u ) >> m_shift;
+	}
+
+	int find( unsigned key ) const
+	{
+		if ( m_slots.empty() ) return -1;
+		for ( unsigned i = home( key ); ; i = ( i + 1 ) & m_mask )
+		{
+			if ( m_slots[i].key == int( key ) ) return int( i );
+			if ( m_slots[i].key == EMPTY ) return -1;
+		}
+	}
+
+	void erase( int key )
+	{
+		int found = find( unsigned( key ) );
+		if ( found == -1 ) return;
+		unsigned hole = unsigned( found );
+		for ( unsigned i = ( hole + 1 ) & m_mask; m_slots[i].key != EMPTY; i = ( i + 1 ) & m_mask )
+		{
+			// move back entries whose home slot is not in ( hole, i ]
+			unsigned h = home( unsigned( m_slots[i].key ) );
+			if ( ( ( i - h ) & m_mask ) >= ( ( i - hole ) & m_mask ) )
+			{
+				m_slots[hole] = m_slots[i];
+				hole = i;
+			}
+		}
+		m_slots[hole] = slot{};
+		m_count--;
+	}
+
+	void rehash( int capacity )
+	{
+		std::pmr::vector< slot > old( m_slots.get_allocator() );
+		old.swap( m_slots );
+		m_slots.resize( capacity );
+		m_mask  = unsigned( capacity - 1 );
+		m_shift = 32;
+		while ( capacity > 1 ) { capacity >>= 1; m_shift--; }
+		for ( const slot& s : old )
+			if ( s.key != EMPTY )
+			{
+				unsigned i = home( unsigned( s.key ) );
+				while ( m_slots[i].key != EMPTY )
+					i = ( i + 1 ) & m_mask;
+				m_slots[i] = s;
+			}
+	}
+
+	std::pmr::vector< slot > m_slots;
+	int                      m_count = 0;
+	unsigned                 m_mask  = 0;
+	int                      m_shift = 32;
+	component_storage*       m_storage = nullptr;
+};
+
+// Index table policy of a component type - register_component uses it, and
+// typed access (get, joins, message handlers) calls the table directly
+// instead of through the index_table vtable. Specialize to change it:
+//   template <> struct component_index_table< rare_tag > { typedef hashed_index_table type; };
+template < typename Component >
+struct component_index_table
+{
+	typedef flat_index_table type;
+};
+
+template < typename Component >
+using index_table_of = typename component_index_table< Component >::type;
+
+// Typed access path for a registered component - index is null when the
+// component was registered with an index table other than its
+// component_index_table, and then the calls go through the virtual other.
+template < typename Component, typename Layout = storage_layout_of< Component > >
+struct component_accessor
+{
+	index_table_of< Component >*     index;
+	storage_handler_of< Component >* storage;
+	index_table*                     other = nullptr;
+
+	int get_index( handle h ) const { return index ? index->get( h ) : other->get( h ); }
+	int insert( handle h ) const { return index ? index->insert( h ) : other->insert( h ); }
+
+	void reserve( int count, int max_index ) const
+	{
+		if ( index )
+			index->reserve( count, max_index );
+		else
+			other->reserve( count, max_index );
+	}
+
+	Component* get( handle h ) const
+	{
+		static_assert( !std::is_same< storage_layout_of< Component >, soa_layout >::value,
+			"soa_layout components have no Component*, use the storage columns!" );
+		int i = get_index( h );
+		return i >= 0 ? &( *storage )[i] : nullptr;
+	}
+};
+
+// archetype_layout components are found through the entity record, they
+// have no index of their own
+template < typename Component >
+struct component_accessor< Component, archetype_layout >
+{
+	archetype_storage* archetypes;
+	int                id;
+
+	Component* get( handle h ) const
+	{
+		return (Component*)archetypes->get( h, id );
+	}
 };
 
 #endif // NV_ECS_INDEX_TABLE_HH
@@ -13,22 +13,190 @@
 #ifndef NV_ECS_MESSAGE_QUEUE_HH
 #define NV_ECS_MESSAGE_QUEUE_HH
 
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
 #include <queue>
-#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <type_traits>
 #include "handle.hh"
 #include "mpl.hh"
 #include "field_detection.hh"
+#include "timing_wheel.hh"
+#include "command_buffer.hh"
+
+// Payloads up to this size are stored in the message itself, larger ones
+// in the arena of the queue with a pointer in the message. Set it for the
+// whole build, e.g.:
+//   defines { "NV_ECS_MESSAGE_INLINE_PAYLOAD=112" }
+#ifndef NV_ECS_MESSAGE_INLINE_PAYLOAD
+#define NV_ECS_MESSAGE_INLINE_PAYLOAD 48
+#endif
+
+namespace detail
+{
+	template < typename Payload >
+	constexpr bool inline_payload = sizeof( Payload ) <= NV_ECS_MESSAGE_INLINE_PAYLOAD && alignof( Payload ) <= alignof( std::max_align_t );
+
+	// in-message payload storage over all of MessageList
+	template < typename... Payloads >
+	constexpr size_t payload_align( mpl::list< Payloads... > )
+	{
+		size_t result = 1;
+		for ( size_t a : { size_t( 1 ), ( inline_payload< Payloads > ? alignof( Payloads ) : alignof( void* ) )... } )
+			result = std::max( result, a );
+		return result;
+	}
+
+	template < typename... Payloads >
+	constexpr size_t payload_size( mpl::list< Payloads... > l )
+	{
+		size_t result = 1;
+		for ( size_t s : { size_t( 1 ), ( inline_payload< Payloads > ? sizeof( Payloads ) : sizeof( void* ) )... } )
+			result = std::max( result, s );
+		return ( result + payload_align( l ) - 1 ) / payload_align( l ) * payload_align( l );
+	}
+
+	// arena slot over the payloads that don't fit
+	template < typename... Payloads >
+	constexpr size_t spill_size( mpl::list< Payloads... > )
+	{
+		size_t result = 0;
+		for ( size_t s : { size_t( 0 ), ( inline_payload< Payloads > ? 0 : sizeof( Payloads ) )... } )
+			result = std::max( result, s );
+		return result;
+	}
+
+	template < typename... Payloads >
+	constexpr size_t spill_align( mpl::list< Payloads... > )
+	{
+		size_t result = 1;
+		for ( size_t a : { size_t( 1 ), ( inline_payload< Payloads > ? 1 : alignof( Payloads ) )... } )
+			result = std::max( result, a );
+		return result;
+	}
+
+	// spilled payloads are copied between arenas and released without
+	// running destructors
+	template < typename... Payloads >
+	constexpr bool spill_copyable( mpl::list< Payloads... > )
+	{
+		return ( ( inline_payload< Payloads > || std::is_trivially_copyable< Payloads >::value ) && ... );
+	}
+}
 
 template < typename Payload, typename Message >
 static const Payload& message_cast( const Message& m )
 {
-	static_assert( sizeof( Payload ) < sizeof( Message::payload ), "Payload size over limit!" );
 	assert( Payload::message_id == m.type && "Payload cast fail!" );
-	return *reinterpret_cast<const Payload*>( &( m.payload ) );
+	if constexpr ( detail::inline_payload< Payload > )
+	{
+		static_assert( sizeof( Payload ) <= sizeof( Message::payload ), "Payload size over limit!" );
+		return *reinterpret_cast<const Payload*>( &( m.payload ) );
+	}
+	else
+	{
+		const void* data;
+		memcpy( &data, &( m.payload ), sizeof( data ) );
+		return *reinterpret_cast<const Payload*>( data );
+	}
 }
 
+// Fixed size slots for oversized payloads of queued messages, reused
+// through a free list
+template < size_t Size, size_t Align >
+class message_arena
+{
+public:
+	static constexpr size_t SLOT_SIZE   = ( std::max( Size, sizeof( void* ) ) + Align - 1 ) / Align * Align;
+	static constexpr size_t BLOCK_SLOTS = 64;
+
+	explicit message_arena( std::pmr::memory_resource* resource = std::pmr::get_default_resource() )
+		: m_blocks( resource ) {}
+	message_arena( const message_arena& ) = delete;
+	message_arena& operator=( const message_arena& ) = delete;
+
+	void* allocate()
+	{
+		if ( !m_free )
+		{
+			m_blocks.push_back( (block*)m_blocks.get_allocator().resource()->allocate( sizeof( block ), alignof( block ) ) );
+			char* data = m_blocks.back()->data;
+			for ( size_t i = 0; i < BLOCK_SLOTS; ++i )
+				release( data + i * SLOT_SIZE );
+		}
+		void* result = m_free;
+		memcpy( &m_free, m_free, sizeof( m_free ) );
+		return result;
+	}
+
+	void release( void* p )
+	{
+		memcpy( p, &m_free, sizeof( m_free ) );
+		m_free = p;
+	}
+
+	void clear()
+	{
+		m_free = nullptr;
+		for ( auto& b : m_blocks )
+			for ( size_t i = 0; i < BLOCK_SLOTS; ++i )
+				release( b->data + i * SLOT_SIZE );
+	}
+
+	~message_arena()
+	{
+		for ( block* b : m_blocks )
+			m_blocks.get_allocator().resource()->deallocate( b, sizeof( block ), alignof( block ) );
+	}
+
+private:
+	struct block
+	{
+		alignas( Align ) char data[SLOT_SIZE * BLOCK_SLOTS];
+	};
+
+	std::pmr::vector< block* > m_blocks;
+	void*                      m_free = nullptr;
+};
+
+// Backends for delayed messages - Queue::type< Message > is a priority
+// queue on Message::time with push, pop, top, empty and clear, constructed
+// from the memory resource of the queue.
 
-template < typename MessageList >
+// binary heap, O(log n) moves of whole messages per push and pop
+struct heap_queue
+{
+	struct compare
+	{
+		template < typename Message >
+		bool operator()( const Message& l, const Message& r ) const
+		{
+			return l.time > r.time;
+		}
+	};
+
+	template < typename Message >
+	class type : public std::priority_queue< Message, std::pmr::vector< Message >, compare >
+	{
+	public:
+		explicit type( std::pmr::memory_resource* resource = std::pmr::get_default_resource() )
+			: std::priority_queue< Message, std::pmr::vector< Message >, compare >( compare(), std::pmr::vector< Message >( resource ) ) {}
+		void clear() { this->c.clear(); }
+	};
+};
+
+// timing_wheel, O(1) push and pop at a resolution of 1/TicksPerUnit - for
+// many pending timers
+template < unsigned TicksPerUnit = 64 >
+struct wheel_queue
+{
+	template < typename Message >
+	using type = timing_wheel< Message, TicksPerUnit >;
+};
+
+template < typename MessageList, typename Queue = heap_queue >
 class message_queue
 {
 public:
@@ -38,9 +206,23 @@ public:
 
 	constexpr static const int message_list_size = mpl::list_size< message_list >::value;
 
-	message_queue()
+	// sized for the largest payload of message_list that is stored inline
+	constexpr static const size_t payload_size  = detail::payload_size( message_list{} );
+	constexpr static const size_t payload_align = detail::payload_align( message_list{} );
+	static_assert( detail::spill_copyable( message_list{} ), "Payloads over NV_ECS_MESSAGE_INLINE_PAYLOAD must be trivially copyable!" );
+
+	// queued messages and their payloads are allocated from resource,
+	// which only the thread updating the queue touches - post_from
+	// segments are filled by producer threads at once, so they stay on
+	// new_delete_resource()
+	explicit message_queue( std::pmr::memory_resource* resource = std::pmr::get_default_resource() )
+		: m_pqueue( resource ), m_arena( resource )
 	{
 		m_handlers.resize( message_list_size );
+		m_batches.resize( message_list_size );
+		m_producers.emplace_back( new producer_segment() );
+		m_spilled.resize( message_list_size, false );
+		mark_spilled( message_list{} );
 	}
 
 	struct message 
@@ -48,25 +230,40 @@ public:
 		message_type type;
 		int          recursive;
 		time_type    time;
-		char         payload[128 - sizeof( message_type ) - sizeof( time_type ) - sizeof( int ) ];
+		alignas( payload_align ) char payload[payload_size];
 	};
 
-	struct message_compare_type
+	// a plain function on an opaque context - the context is the system
+	// itself, or a copy of the handler owned by the queue
+	struct message_delegate
 	{
-		bool operator()( const message& l, const message& r )
-		{
-			return l.time > r.time;
-		}
+		void ( *call )( void*, const message& );
+		void*  context;
+
+		void operator()( const message& m ) const { call( context, m ); }
 	};
 
-	using message_handler = std::function< void( const message& ) >;
-				
 	struct message_handlers
 	{
-		std::vector< message_handler > list;
+		std::vector< message_delegate > list;
 	};
 
-	typedef std::priority_queue< message, std::vector< message >, message_compare_type > queue_type;
+	// takes count payloads of one type at once, see has_batch_message
+	struct batch_delegate
+	{
+		void ( *call )( void*, const void*, int );
+		void*  context;
+	};
+
+	struct batch_handlers
+	{
+		// payloads of the messages as one array, in buffer if needed
+		const void* ( *gather )( std::vector< char >& buffer, const message* const* msgs, int count ) = nullptr;
+		std::vector< batch_delegate > ordered;
+		std::vector< batch_delegate > unordered;
+	};
+
+	typedef typename Queue::template type< message > queue_type;
 
 	template< typename Handler >
 	void register_handler( Handler* c )
@@ -82,23 +279,25 @@ public:
 	{
 		for ( auto& h : m_handlers[m.type].list )
 			h( m );
+		if ( m_batched )
+		{
+			const message* single = &m;
+			call_batch( m_batches[m.type].ordered, m.type, &single, 1 );
+			call_batch( m_batches[m.type].unordered, m.type, &single, 1 );
+		}
 		return true;
 	}
 
 	template < typename Payload, typename ...Args >
 	bool dispatch( Args&&... args )
 	{
-		message m{ Payload::message_id, 0, time_type( 0 ) };
-		new( &m.payload ) Payload{ std::forward<Args>( args )... };
-		return dispatch( m );
+		return dispatch_now< Payload >( 0, std::forward<Args>( args )... );
 	}
 
 	template < typename Payload, typename ...Args >
 	bool dispatch_recursive( Args&&... args )
 	{
-		message m{ Payload::message_id, 1, time_type( 0 ) };
-		new( &m.payload ) Payload{ std::forward<Args>( args )... };
-		return dispatch( m );
+		return dispatch_now< Payload >( 1, std::forward<Args>( args )... );
 	}
 
 	bool queue( const message& m )
@@ -110,16 +309,16 @@ public:
 	template < typename Payload, typename ...Args >
 	bool queue( time_type delay, Args&&... args )
 	{
-		message m{ Payload::message_id, 0, m_time + delay };
-		new( &m.payload ) Payload{ std::forward<Args>( args )... };
+		message m{ Payload::message_id, 0, m_time + delay, {} };
+		construct_payload< Payload >( m_arena, m, std::forward<Args>( args )... );
 		return queue( m );
 	}
 
 	template < typename Payload, typename ...Args >
 	bool queue_recursive( time_type delay, Args&&... args )
 	{
-		message m{ Payload::message_id, 1, m_time + delay };
-		new( &m.payload ) Payload{ nv::forward<Args>( args )... };
+		message m{ Payload::message_id, 1, m_time + delay, {} };
+		construct_payload< Payload >( m_arena, m, std::forward<Args>( args )... );
 		return queue( m );
 	}
 
@@ -135,47 +334,284 @@ public:
 		return m_pqueue.top();
 	}
 
+	// Queues from other threads - every thread posts as its own producer
+	// (see set_producer_count), so posting takes no locks. Posted messages
+	// are merged in by update_time and update_step, by time, then by the
+	// command_key of the poster, the producer and the posting order - the
+	// latter only survive with a FIFO Queue (wheel_queue), heap_queue
+	// leaves equal times unordered.
+	template < typename Payload, typename ...Args >
+	bool post_from( unsigned producer, time_type delay, Args&&... args )
+	{
+		assert( producer < m_producers.size() && "Unknown producer!" );
+		producer_segment& p = *m_producers[producer];
+		message m{ Payload::message_id, 0, m_time + delay, {} };
+		construct_payload< Payload >( p.arena, m, std::forward<Args>( args )... );
+		p.list.push_back( posted{ m, command_key::current() } );
+		return true;
+	}
+
+	// not thread-safe, merges what was posted so far
+	void set_producer_count( unsigned count )
+	{
+		merge_posted();
+		while ( m_producers.size() < count )
+			m_producers.emplace_back( new producer_segment() );
+	}
+
+	unsigned producer_count() const { return unsigned( m_producers.size() ); }
+
 	void reset_events()
 	{
 		m_pqueue.clear();
+		m_arena.clear();
+		for ( auto& p : m_producers )
+		{
+			p->list.clear();
+			p->arena.clear();
+		}
 		m_time = time_type( 0 );
 	}
 
 	void update_time( time_type dtime )
 	{
+		merge_posted();
 		if ( dtime == time_type( 0 ) ) return;
 		m_time += dtime;
+		if ( m_batched )
+			return dispatch_due();
 		while ( !m_pqueue.empty() && m_pqueue.top().time <= m_time )
 		{
 			message msg = m_pqueue.top();
 			m_pqueue.pop();
 			dispatch( msg );
+			release_payload( msg );
 		}
 	}
 
 	time_type update_step()
 	{
+		merge_posted();
 		if ( !m_pqueue.empty() )
 		{
 			message msg = m_pqueue.top();
-			m_time = msg.time;
+			m_time = std::max( m_time, msg.time );
 			m_pqueue.pop();
 			dispatch( msg );
+			release_payload( msg );
 		}
 		return m_time;
 	}
 
-	void register_callback( message_type msg, message_handler&& handler )
+	void register_delegate( message_type msg, void ( *call )( void*, const message& ), void* context )
+	{
+		m_handlers[msg].list.push_back( message_delegate{ call, context } );
+	}
+
+	// with ordered set, update_time passes runs of consecutive messages of
+	// Payload in time order with the other handlers - otherwise all due
+	// Payload messages at once, after the in-order handlers
+	template < typename Payload >
+	void register_batch_delegate( bool ordered, void ( *call )( void*, const void*, int ), void* context )
+	{
+		static_assert( alignof( Payload ) <= alignof( std::max_align_t ), "Overaligned message payload!" );
+		batch_handlers& b = m_batches[Payload::message_id];
+		b.gather = [] ( std::vector< char >& buffer, const message* const* msgs, int count ) -> const void*
+		{
+			if ( count == 1 ) return &message_cast< Payload >( *msgs[0] );
+			buffer.resize( count * sizeof( Payload ) );
+			Payload* result = (Payload*)buffer.data();
+			for ( int i = 0; i < count; ++i )
+				new( result + i ) Payload( message_cast< Payload >( *msgs[i] ) );
+			return result;
+		};
+		( ordered ? b.ordered : b.unordered ).push_back( batch_delegate{ call, context } );
+		m_batched = true;
+	}
+
+	// handler is copied into the queue once, dispatch calls it directly
+	template < typename Handler >
+	void register_callback( message_type msg, Handler&& handler )
 	{
-		m_handlers[msg].list.push_back( handler );
+		typedef std::decay_t< Handler > handler_type;
+		handler_type* h = new handler_type( std::forward< Handler >( handler ) );
+		m_contexts.emplace_back( h, [] ( void* p ) { delete (handler_type*)p; } );
+		register_delegate( msg, [] ( void* c, const message& m ) { ( *(handler_type*)c )( m ); }, h );
 	}
 
 protected:
+	typedef message_arena< detail::spill_size( message_list{} ), detail::spill_align( message_list{} ) > arena_type;
+
+	template < typename Payload, typename ...Args >
+	bool dispatch_now( int recursive, Args&&... args )
+	{
+		message m{ Payload::message_id, recursive, time_type( 0 ), {} };
+		if constexpr ( detail::inline_payload< Payload > )
+		{
+			new( &m.payload ) Payload{ std::forward<Args>( args )... };
+			return dispatch( m );
+		}
+		else
+		{
+			// on the stack for the duration of the dispatch
+			alignas( Payload ) char storage[sizeof( Payload )];
+			void* data = new( storage ) Payload{ std::forward<Args>( args )... };
+			memcpy( &m.payload, &data, sizeof( data ) );
+			return dispatch( m );
+		}
+	}
+
+	struct posted
+	{
+		message     msg;
+		command_key key;
+	};
+
+	struct alignas( 64 ) producer_segment
+	{
+		producer_segment() : list( std::pmr::new_delete_resource() ), arena( std::pmr::new_delete_resource() ) {}
+		std::pmr::vector< posted > list;
+		arena_type                 arena;
+	};
+
+	template < typename Payload, typename ...Args >
+	void construct_payload( arena_type& arena, message& m, Args&&... args )
+	{
+		if constexpr ( detail::inline_payload< Payload > )
+			new( &m.payload ) Payload{ std::forward<Args>( args )... };
+		else
+		{
+			void* data = new( arena.allocate() ) Payload{ std::forward<Args>( args )... };
+			memcpy( &m.payload, &data, sizeof( data ) );
+		}
+	}
+
+	void call_batch( const std::vector< batch_delegate >& list, message_type type, const message* const* msgs, int count )
+	{
+		if ( list.empty() || count == 0 ) return;
+		const void* data = m_batches[type].gather( m_gather, msgs, count );
+		for ( auto& d : list )
+			d.call( d.context, data, count );
+	}
+
+	// takes out everything due, dispatches it in time order to the plain and
+	// ordered batch handlers, then by type to the other batch handlers -
+	// repeats for messages these queue for the current time
+	void dispatch_due()
+	{
+		while ( !m_pqueue.empty() && m_pqueue.top().time <= m_time )
+		{
+			m_due.clear();
+			do
+			{
+				m_due.push_back( m_pqueue.top() );
+				m_pqueue.pop();
+			} while ( !m_pqueue.empty() && m_pqueue.top().time <= m_time );
+
+			for ( size_t i = 0; i < m_due.size(); )
+			{
+				message_type type = m_due[i].type;
+				size_t end = i + 1;
+				while ( end < m_due.size() && m_due[end].type == type ) ++end;
+				for ( size_t k = i; k < end; ++k )
+					for ( auto& h : m_handlers[type].list )
+						h( m_due[k] );
+				if ( !m_batches[type].ordered.empty() )
+				{
+					m_bucket.clear();
+					for ( size_t k = i; k < end; ++k )
+						m_bucket.push_back( &m_due[k] );
+					call_batch( m_batches[type].ordered, type, m_bucket.data(), int( m_bucket.size() ) );
+				}
+				i = end;
+			}
+
+			// bucket by type, keeping time order within a type
+			m_offsets.assign( message_list_size + 1, 0 );
+			for ( const message& m : m_due )
+				if ( !m_batches[m.type].unordered.empty() )
+					m_offsets[m.type + 1]++;
+			for ( int t = 0; t < message_list_size; ++t )
+				m_offsets[t + 1] += m_offsets[t];
+			m_bucket.resize( m_offsets[message_list_size] );
+			for ( const message& m : m_due )
+				if ( !m_batches[m.type].unordered.empty() )
+					m_bucket[m_offsets[m.type]++] = &m;
+			for ( int t = 0, start = 0; t < message_list_size; ++t )
+			{
+				call_batch( m_batches[t].unordered, message_type( t ), m_bucket.data() + start, m_offsets[t] - start );
+				start = m_offsets[t];
+			}
+
+			for ( const message& m : m_due )
+				release_payload( m );
+		}
+	}
+
+	void merge_posted()
+	{
+		m_merge.clear();
+		for ( auto& p : m_producers )
+			for ( const posted& e : p->list )
+				m_merge.push_back( &e );
+		if ( m_merge.empty() ) return;
+		// gathered by producer and posting order already
+		std::stable_sort( m_merge.begin(), m_merge.end(), [] ( const posted* a, const posted* b )
+		{
+			if ( a->msg.time != b->msg.time ) return a->msg.time < b->msg.time;
+			return a->key < b->key;
+		} );
+		for ( const posted* e : m_merge )
+		{
+			message m = e->msg;
+			if constexpr ( detail::spill_size( message_list{} ) > 0 )
+				if ( m_spilled[m.type] )
+				{
+					// out of the producer arena into the shared one
+					void* data;
+					memcpy( &data, &m.payload, sizeof( data ) );
+					void* moved = m_arena.allocate();
+					memcpy( moved, data, arena_type::SLOT_SIZE );
+					memcpy( &m.payload, &moved, sizeof( moved ) );
+				}
+			m_pqueue.push( m );
+		}
+		for ( auto& p : m_producers )
+		{
+			if constexpr ( detail::spill_size( message_list{} ) > 0 )
+				for ( const posted& e : p->list )
+					if ( m_spilled[e.msg.type] )
+					{
+						void* data;
+						memcpy( &data, &e.msg.payload, sizeof( data ) );
+						p->arena.release( data );
+					}
+			p->list.clear();
+		}
+	}
+
+	void release_payload( const message& m )
+	{
+		if constexpr ( detail::spill_size( message_list{} ) > 0 )
+		{
+			if ( !m_spilled[m.type] ) return;
+			void* data;
+			memcpy( &data, &m.payload, sizeof( data ) );
+			m_arena.release( data );
+		}
+	}
+
+	template < typename... Payloads >
+	void mark_spilled( mpl::list< Payloads... >&& )
+	{
+		( ( m_spilled[Payloads::message_id] = !detail::inline_payload< Payloads > ), ... );
+	}
+
 
 	template < typename System, template <class...> class List, typename... Messages >
 	void register_messages( System* h, List<Messages...>&& )
 	{
-		int unused[] = { ( register_message<System,Messages>( h ), 0 )... };
+		( register_message<System,Messages>( h ), ... );
 	}
 
 
@@ -183,15 +619,32 @@ protected:
 	void register_message( System* s )
 	{
 		if constexpr( has_message< System, Message > )
-			register_callback( Message::message_id, [=] ( const message& msg )
+			register_delegate( Message::message_id, [] ( void* c, const message& msg )
+			{
+				( (System*)c )->on( message_cast<Message>( msg ) );
+			}, s );
+		if constexpr( has_batch_message< System, Message > )
+			register_batch_delegate< Message >( is_ordered_system< System >, [] ( void* c, const void* data, int count )
 			{
-				s->on( message_cast<Message>( msg ) );
-			} );
+				( (System*)c )->on( span< const Message >( (const Message*)data, count ) );
+			}, s );
 	}
 
 	time_type                       m_time = time_type( 0 );
 	queue_type                      m_pqueue;
 	std::vector< message_handlers > m_handlers;
+	std::vector< std::unique_ptr< void, void(*)( void* ) > > m_contexts; // of register_callback
+	std::vector< batch_handlers >   m_batches;
+	bool                            m_batched = false;
+	std::vector< std::unique_ptr< producer_segment > > m_producers;
+	std::vector< const posted* >    m_merge;
+	// dispatch_due scratch
+	std::vector< message >          m_due;
+	std::vector< const message* >   m_bucket;
+	std::vector< int >              m_offsets;
+	std::vector< char >             m_gather;
+	std::vector< bool >             m_spilled; // message type -> payload in m_arena
+	arena_type                      m_arena;
 };
 
 #endif // NV_ECS_MESSAGE_QUEUE_HH
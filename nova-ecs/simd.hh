@@ -0,0 +1,245 @@
+// Copyright (C) 2017-2017 ChaosForge Ltd
+// http://chaosforge.org/
+
+#ifndef NV_ECS_SIMD_HH
+#define NV_ECS_SIMD_HH
+
+#include "span.hh"
+
+#if defined( _M_X64 ) || defined( __x86_64__ ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 ) || defined( __SSE2__ )
+#define NV_SIMD_X86 1
+#include <immintrin.h>
+#if defined( _MSC_VER )
+#include <intrin.h>
+#define NV_TARGET_AVX2
+#else
+#define NV_TARGET_AVX2 __attribute__(( target( "avx2" ) ))
+#endif
+#endif
+
+// Column kernels over contiguous lanes, with the instruction set picked
+// once at run time (AVX2, SSE2 or plain scalar code).
+namespace simd
+{
+	enum class isa
+	{
+		scalar,
+		sse2,
+		avx2,
+	};
+
+	inline isa detect()
+	{
+#if NV_SIMD_X86
+#if defined( _MSC_VER )
+		int info[4];
+		__cpuid( info, 0 );
+		if ( info[0] >= 7 )
+		{
+			__cpuid( info, 1 );
+			bool os_avx = ( info[2] & ( 1 << 27 ) ) && ( info[2] & ( 1 << 28 ) ) && ( _xgetbv( 0 ) & 6 ) == 6;
+			__cpuidex( info, 7, 0 );
+			if ( os_avx && ( info[1] & ( 1 << 5 ) ) )
+				return isa::avx2;
+		}
+#else
+		__builtin_cpu_init();
+		if ( __builtin_cpu_supports( "avx2" ) )
+			return isa::avx2;
+#endif
+		return isa::sse2;
+#else
+		return isa::scalar;
+#endif
+	}
+
+	inline isa current()
+	{
+		static const isa result = detect();
+		return result;
+	}
+
+	namespace detail
+	{
+		inline void madd_scalar( float* y, const float* x, float a, int i, int count )
+		{
+			for ( ; i < count; ++i )
+				y[i] += x[i] * a;
+		}
+
+		inline void sub_clamp_scalar( float* y, float a, float lo, int i, int count )
+		{
+			for ( ; i < count; ++i )
+				y[i] = y[i] - a > lo ? y[i] - a : lo;
+		}
+
+		inline void add_scalar( int* y, const int* x, int i, int count )
+		{
+			for ( ; i < count; ++i )
+				y[i] += x[i];
+		}
+
+		inline void sub_clamp_scalar( int* y, int a, int lo, int i, int count )
+		{
+			for ( ; i < count; ++i )
+				y[i] = y[i] - a > lo ? y[i] - a : lo;
+		}
+
+#if NV_SIMD_X86
+		inline int madd_sse2( float* y, const float* x, float a, int count )
+		{
+			__m128 va = _mm_set1_ps( a );
+			int i = 0;
+			for ( ; i + 4 <= count; i += 4 )
+				_mm_storeu_ps( y + i, _mm_add_ps( _mm_loadu_ps( y + i ), _mm_mul_ps( _mm_loadu_ps( x + i ), va ) ) );
+			return i;
+		}
+
+		inline int sub_clamp_sse2( float* y, float a, float lo, int count )
+		{
+			__m128 va = _mm_set1_ps( a );
+			__m128 vl = _mm_set1_ps( lo );
+			int i = 0;
+			for ( ; i + 4 <= count; i += 4 )
+				_mm_storeu_ps( y + i, _mm_max_ps( _mm_sub_ps( _mm_loadu_ps( y + i ), va ), vl ) );
+			return i;
+		}
+
+		inline int add_sse2( int* y, const int* x, int count )
+		{
+			int i = 0;
+			for ( ; i + 4 <= count; i += 4 )
+			{
+				__m128i vy = _mm_loadu_si128( (const __m128i*)( y + i ) );
+				__m128i vx = _mm_loadu_si128( (const __m128i*)( x + i ) );
+				_mm_storeu_si128( (__m128i*)( y + i ), _mm_add_epi32( vy, vx ) );
+			}
+			return i;
+		}
+
+		inline int sub_clamp_sse2( int* y, int a, int lo, int count )
+		{
+			// no _mm_max_epi32 in SSE2, blend through the compare mask
+			__m128i va = _mm_set1_epi32( a );
+			__m128i vl = _mm_set1_epi32( lo );
+			int i = 0;
+			for ( ; i + 4 <= count; i += 4 )
+			{
+				__m128i v    = _mm_sub_epi32( _mm_loadu_si128( (const __m128i*)( y + i ) ), va );
+				__m128i mask = _mm_cmpgt_epi32( v, vl );
+				v = _mm_or_si128( _mm_and_si128( mask, v ), _mm_andnot_si128( mask, vl ) );
+				_mm_storeu_si128( (__m128i*)( y + i ), v );
+			}
+			return i;
+		}
+
+		NV_TARGET_AVX2 inline int madd_avx2( float* y, const float* x, float a, int count )
+		{
+			__m256 va = _mm256_set1_ps( a );
+			int i = 0;
+			for ( ; i + 8 <= count; i += 8 )
+				_mm256_storeu_ps( y + i, _mm256_add_ps( _mm256_loadu_ps( y + i ), _mm256_mul_ps( _mm256_loadu_ps( x + i ), va ) ) );
+			return i;
+		}
+
+		NV_TARGET_AVX2 inline int sub_clamp_avx2( float* y, float a, float lo, int count )
+		{
+			__m256 va = _mm256_set1_ps( a );
+			__m256 vl = _mm256_set1_ps( lo );
+			int i = 0;
+			for ( ; i + 8 <= count; i += 8 )
+				_mm256_storeu_ps( y + i, _mm256_max_ps( _mm256_sub_ps( _mm256_loadu_ps( y + i ), va ), vl ) );
+			return i;
+		}
+
+		NV_TARGET_AVX2 inline int add_avx2( int* y, const int* x, int count )
+		{
+			int i = 0;
+			for ( ; i + 8 <= count; i += 8 )
+			{
+				__m256i vy = _mm256_loadu_si256( (const __m256i*)( y + i ) );
+				__m256i vx = _mm256_loadu_si256( (const __m256i*)( x + i ) );
+				_mm256_storeu_si256( (__m256i*)( y + i ), _mm256_add_epi32( vy, vx ) );
+			}
+			return i;
+		}
+
+		NV_TARGET_AVX2 inline int sub_clamp_avx2( int* y, int a, int lo, int count )
+		{
+			__m256i va = _mm256_set1_epi32( a );
+			__m256i vl = _mm256_set1_epi32( lo );
+			int i = 0;
+			for ( ; i + 8 <= count; i += 8 )
+			{
+				__m256i v = _mm256_sub_epi32( _mm256_loadu_si256( (const __m256i*)( y + i ) ), va );
+				_mm256_storeu_si256( (__m256i*)( y + i ), _mm256_max_epi32( v, vl ) );
+			}
+			return i;
+		}
+#endif
+	}
+
+	// y[i] += x[i] * a
+	inline void madd( span< float > y, span< const float > x, float a )
+	{
+		assert( y.size() == x.size() && "simd::madd size mismatch!" );
+		int i = 0;
+#if NV_SIMD_X86
+		switch ( current() )
+		{
+		case isa::avx2 : i = detail::madd_avx2( y.data(), x.data(), a, y.size() ); break;
+		case isa::sse2 : i = detail::madd_sse2( y.data(), x.data(), a, y.size() ); break;
+		default: break;
+		}
+#endif
+		detail::madd_scalar( y.data(), x.data(), a, i, y.size() );
+	}
+
+	// y[i] = max( y[i] - a, lo ) - timers and cooldowns
+	inline void sub_clamp( span< float > y, float a, float lo )
+	{
+		int i = 0;
+#if NV_SIMD_X86
+		switch ( current() )
+		{
+		case isa::avx2 : i = detail::sub_clamp_avx2( y.data(), a, lo, y.size() ); break;
+		case isa::sse2 : i = detail::sub_clamp_sse2( y.data(), a, lo, y.size() ); break;
+		default: break;
+		}
+#endif
+		detail::sub_clamp_scalar( y.data(), a, lo, i, y.size() );
+	}
+
+	// y[i] += x[i]
+	inline void add( span< int > y, span< const int > x )
+	{
+		assert( y.size() == x.size() && "simd::add size mismatch!" );
+		int i = 0;
+#if NV_SIMD_X86
+		switch ( current() )
+		{
+		case isa::avx2 : i = detail::add_avx2( y.data(), x.data(), y.size() ); break;
+		case isa::sse2 : i = detail::add_sse2( y.data(), x.data(), y.size() ); break;
+		default: break;
+		}
+#endif
+		detail::add_scalar( y.data(), x.data(), i, y.size() );
+	}
+
+	// y[i] = max( y[i] - a, lo )
+	inline void sub_clamp( span< int > y, int a, int lo )
+	{
+		int i = 0;
+#if NV_SIMD_X86
+		switch ( current() )
+		{
+		case isa::avx2 : i = detail::sub_clamp_avx2( y.data(), a, lo, y.size() ); break;
+		case isa::sse2 : i = detail::sub_clamp_sse2( y.data(), a, lo, y.size() ); break;
+		default: break;
+		}
+#endif
+		detail::sub_clamp_scalar( y.data(), a, lo, i, y.size() );
+	}
+}
+
+#endif // NV_ECS_SIMD_HH
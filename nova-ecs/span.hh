@@ -0,0 +1,53 @@
+// Copyright (C) 2017-2017 ChaosForge Ltd
+// http://chaosforge.org/
+
+#ifndef NV_ECS_SPAN_HH
+#define NV_ECS_SPAN_HH
+
+#include <cassert>
+#include <type_traits>
+
+// Non-owning view of a contiguous range of T
+template < typename T >
+class span
+{
+public:
+	typedef T         value_type;
+	typedef T*        iterator;
+	typedef T&        reference;
+
+	constexpr span() : m_data( nullptr ), m_size( 0 ) {}
+	constexpr span( T* data, int size ) : m_data( data ), m_size( size ) {}
+
+	template < typename U, typename = std::enable_if_t< std::is_convertible< U(*)[], T(*)[] >::value > >
+	constexpr span( const span< U >& other ) : m_data( other.data() ), m_size( other.size() ) {}
+
+	template < typename Container, typename = std::enable_if_t<
+		std::is_convertible< decltype( std::declval< Container& >().data() ), T* >::value > >
+	constexpr span( Container& c ) : m_data( c.data() ), m_size( int( c.size() ) ) {}
+
+	constexpr T* data() const { return m_data; }
+	constexpr int size() const { return m_size; }
+	constexpr bool empty() const { return m_size == 0; }
+
+	T& operator[]( int i ) const
+	{
+		assert( i >= 0 && i < m_size && "span index out of range!" );
+		return m_data[i];
+	}
+
+	constexpr iterator begin() const { return m_data; }
+	constexpr iterator end() const { return m_data + m_size; }
+
+	span subspan( int offset, int count ) const
+	{
+		assert( offset >= 0 && offset + count <= m_size && "subspan out of range!" );
+		return span( m_data + offset, count );
+	}
+
+private:
+	T*  m_data;
+	int m_size;
+};
+
+#endif // NV_ECS_SPAN_HH
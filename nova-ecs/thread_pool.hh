@@ -0,0 +1,170 @@
+// Copyright (C) 2017-2017 ChaosForge Ltd
+// http://chaosforge.org/
+//
+// This file is part of Nova libraries.
+// For conditions of distribution and use, see copying.txt file in root folder.
+
+/**
+* @file thread_pool.hh
+* @author Kornel Kisielewicz epyon@chaosforge.org
+* @brief Work-stealing thread pool
+*/
+
+#ifndef NV_ECS_THREAD_POOL_HH
+#define NV_ECS_THREAD_POOL_HH
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+
+// Each worker owns a deque - it pushes and pops its own tasks from the back,
+// and steals from the front of the other deques when it runs dry. The thread
+// that owns the pool gets its own deque too, and helps out while it waits.
+class thread_pool
+{
+public:
+	using task = std::function< void() >;
+
+	explicit thread_pool( unsigned count )
+	{
+		if ( count == 0 ) count = 1;
+		for ( unsigned i = 0; i <= count; ++i )
+			m_queues.emplace_back( new worker_queue );
+		for ( unsigned i = 0; i < count; ++i )
+			m_threads.emplace_back( [this, i] () { run( i ); } );
+	}
+
+	unsigned size() const { return unsigned( m_threads.size() ); }
+
+	// queue of the calling thread - its worker index, or size() for any
+	// thread outside the pool
+	unsigned current_queue() const
+	{
+		return t_owner == this ? t_index : unsigned( m_threads.size() );
+	}
+
+	void submit( task&& t )
+	{
+		worker_queue& q = *m_queues[ current_queue() ];
+		{
+			std::lock_guard< std::mutex > guard( q.lock );
+			q.tasks.push_back( std::move( t ) );
+		}
+		{
+			std::lock_guard< std::mutex > guard( m_sleep_lock );
+			m_queued++;
+		}
+		m_sleep.notify_one();
+	}
+
+	// calls f( begin, end ) for consecutive ranges of at most grain elements,
+	// returns once all of them finished
+	template < typename F >
+	void parallel_for( int count, int grain, const F& f )
+	{
+		std::atomic< int > pending( ( count + grain - 1 ) / grain );
+		for ( int begin = 0; begin < count; begin += grain )
+		{
+			int end = begin + grain < count ? begin + grain : count;
+			submit( [&f, &pending, begin, end] ()
+			{
+				f( begin, end );
+				pending.fetch_sub( 1, std::memory_order_acq_rel );
+			} );
+		}
+		wait( pending );
+	}
+
+	// runs pending tasks on the calling thread until the counter drops to zero
+	void wait( const std::atomic< int >& counter )
+	{
+		unsigned self = current_queue();
+		while ( counter.load( std::memory_order_acquire ) > 0 )
+			if ( !run_one( self ) )
+				std::this_thread::yield();
+	}
+
+	~thread_pool()
+	{
+		{
+			std::lock_guard< std::mutex > guard( m_sleep_lock );
+			m_stop = true;
+		}
+		m_sleep.notify_all();
+		for ( auto& t : m_threads )
+			t.join();
+	}
+
+private:
+	struct worker_queue
+	{
+		std::mutex         lock;
+		std::deque< task > tasks;
+	};
+
+	bool pop( unsigned self, task& result )
+	{
+		unsigned count = unsigned( m_queues.size() );
+		for ( unsigned i = 0; i < count; ++i )
+		{
+			worker_queue& q = *m_queues[ ( self + i ) % count ];
+			std::lock_guard< std::mutex > guard( q.lock );
+			if ( q.tasks.empty() ) continue;
+			if ( i == 0 )
+			{
+				result = std::move( q.tasks.back() );
+				q.tasks.pop_back();
+			}
+			else
+			{
+				result = std::move( q.tasks.front() );
+				q.tasks.pop_front();
+			}
+			std::lock_guard< std::mutex > sguard( m_sleep_lock );
+			m_queued--;
+			return true;
+		}
+		return false;
+	}
+
+	bool run_one( unsigned self )
+	{
+		task t;
+		if ( !pop( self, t ) ) return false;
+		t();
+		return true;
+	}
+
+	void run( unsigned index )
+	{
+		t_owner = this;
+		t_index = index;
+		for ( ;; )
+		{
+			if ( run_one( index ) ) continue;
+			std::unique_lock< std::mutex > guard( m_sleep_lock );
+			m_sleep.wait( guard, [this] () { return m_stop || m_queued > 0; } );
+			if ( m_stop ) return;
+		}
+	}
+
+	static thread_local const thread_pool* t_owner;
+	static thread_local unsigned           t_index;
+
+	std::vector< std::unique_ptr< worker_queue > > m_queues;
+	std::vector< std::thread >                     m_threads;
+	std::mutex                                     m_sleep_lock;
+	std::condition_variable                        m_sleep;
+	int                                            m_queued = 0;
+	bool                                           m_stop   = false;
+};
+
+inline thread_local const thread_pool* thread_pool::t_owner = nullptr;
+inline thread_local unsigned           thread_pool::t_index = 0;
+
+#endif // NV_ECS_THREAD_POOL_HH
@@ -0,0 +1,205 @@
+// Copyright (C) 2017-2017 ChaosForge Ltd
+// http://chaosforge.org/
+
+#ifndef NV_ECS_TIMING_WHEEL_HH
+#define NV_ECS_TIMING_WHEEL_HH
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
+#if defined( _MSC_VER )
+#include <intrin.h>
+#endif
+
+// Hierarchical timing wheel over Message::time - a drop-in for the heap of
+// message_queue (see wheel_queue). Time is cut into ticks of 1/TicksPerUnit,
+// and every level has SLOTS slots covering SLOTS times the span of a slot on
+// the level below. Messages pop in ( tick, push order ) order - within one
+// tick they are FIFO whatever their exact times, so one can come out up to
+// a tick after a later message of its tick. Messages before the current
+// tick are due at once. Slots are FIFO buckets, so push, top and pop are
+// O(1) - a message moves down a level at most LEVELS times before it
+// expires. Messages past the top level wait in a heap.
+template < typename Message, unsigned TicksPerUnit = 64 >
+class timing_wheel
+{
+public:
+	static constexpr int SLOT_BITS = 6;
+	static constexpr int SLOTS     = 1 << SLOT_BITS;
+	static constexpr int LEVELS    = 4;
+
+	explicit timing_wheel( std::pmr::memory_resource* resource = std::pmr::get_default_resource() )
+		: m_ready( resource ), m_overflow( resource ), m_slots( resource )
+	{
+		m_slots.resize( LEVELS * SLOTS );
+	}
+
+	bool empty() const { return m_count == 0; }
+	size_t size() const { return m_count; }
+
+	void push( const Message& m )
+	{
+		m_count++;
+		insert( entry{ m, to_tick( m.time ), m_seq++ } );
+	}
+
+	// the head of the ready bucket, else the first earliest message of the
+	// lowest occupied slot, else of the overflow heap
+	const Message& top() const
+	{
+		assert( m_count > 0 && "Empty timing wheel!" );
+		if ( m_head < m_ready.size() )
+			return m_ready[m_head].msg;
+		for ( int l = 0; l < LEVELS; ++l )
+			if ( m_mask[l] )
+			{
+				int s = l * SLOTS + lowest_bit( m_mask[l] );
+				return m_slots[s][m_first[s]].msg;
+			}
+		return m_overflow.front().msg;
+	}
+
+	void pop()
+	{
+		assert( m_count > 0 && "Empty timing wheel!" );
+		if ( m_head == m_ready.size() )
+			advance();
+		if ( ++m_head == m_ready.size() )
+		{
+			m_ready.clear();
+			m_head = 0;
+		}
+		m_count--;
+	}
+
+	void clear()
+	{
+		m_ready.clear();
+		m_overflow.clear();
+		for ( auto& s : m_slots )
+			s.clear();
+		for ( int l = 0; l < LEVELS; ++l )
+			m_mask[l] = 0;
+		m_head   = 0;
+		m_cursor = 0;
+		m_seq    = 0;
+		m_count  = 0;
+	}
+
+private:
+	struct entry
+	{
+		Message  msg;
+		uint64_t tick;
+		uint64_t seq; // push order, for the overflow heap
+	};
+
+	static uint64_t to_tick( double time )
+	{
+		double t = time * TicksPerUnit;
+		if ( !( t > 0.0 ) ) return 0;
+		return t < double( uint64_t( 1 ) << 62 ) ? uint64_t( t ) : uint64_t( 1 ) << 62;
+	}
+
+	static int highest_bit( uint64_t v )
+	{
+#if defined( _MSC_VER )
+		unsigned long result;
+		_BitScanReverse64( &result, v );
+		return int( result );
+#else
+		return 63 - __builtin_clzll( v );
+#endif
+	}
+
+	static int lowest_bit( uint64_t v )
+	{
+#if defined( _MSC_VER )
+		unsigned long result;
+		_BitScanForward64( &result, v );
+		return int( result );
+#else
+		return __builtin_ctzll( v );
+#endif
+	}
+
+	// later first, so the heap keeps the earliest at the front
+	static bool after( const entry& a, const entry& b )
+	{
+		return a.tick != b.tick ? a.tick > b.tick : a.seq > b.seq;
+	}
+
+	// messages up to the cursor tick are appended to the ready bucket, the
+	// rest to a slot on the level of the highest slot digit they differ
+	// from the cursor in - m_first tracks the first earliest one per slot
+	void insert( const entry& e )
+	{
+		if ( e.tick <= m_cursor )
+		{
+			m_ready.push_back( e );
+			return;
+		}
+		int level = highest_bit( e.tick ^ m_cursor ) / SLOT_BITS;
+		if ( level >= LEVELS )
+		{
+			m_overflow.push_back( e );
+			std::push_heap( m_overflow.begin(), m_overflow.end(), after );
+			return;
+		}
+		int digit = int( e.tick >> ( level * SLOT_BITS ) ) & ( SLOTS - 1 );
+		int s     = level * SLOTS + digit;
+		std::pmr::vector< entry >& slot = m_slots[s];
+		if ( slot.empty() || e.tick < slot[m_first[s]].tick )
+			m_first[s] = uint32_t( slot.size() );
+		slot.push_back( e );
+		m_mask[level] |= uint64_t( 1 ) << digit;
+	}
+
+	// moves the cursor to the tick of top and empties its slot - into the
+	// ready bucket when it has nothing but that tick (always on level 0),
+	// otherwise down the levels. Slots below it are empty, as it holds the
+	// earliest message, and every other one stays right for the new cursor.
+	void advance()
+	{
+		int level = 0;
+		while ( level < LEVELS && !m_mask[level] ) level++;
+		if ( level < LEVELS )
+		{
+			int digit = lowest_bit( m_mask[level] );
+			int s     = level * SLOTS + digit;
+			m_mask[level] &= ~( uint64_t( 1 ) << digit );
+			m_cursor = m_slots[s][m_first[s]].tick;
+			if ( level == 0 )
+				m_ready.swap( m_slots[s] );
+			else
+			{
+				for ( const entry& e : m_slots[s] )
+					insert( e );
+				m_slots[s].clear();
+			}
+			return;
+		}
+		const int shift = LEVELS * SLOT_BITS;
+		m_cursor = m_overflow.front().tick;
+		while ( !m_overflow.empty() && ( m_overflow.front().tick >> shift ) == ( m_cursor >> shift ) )
+		{
+			std::pop_heap( m_overflow.begin(), m_overflow.end(), after );
+			insert( m_overflow.back() );
+			m_overflow.pop_back();
+		}
+	}
+
+	std::pmr::vector< entry >    m_ready;    // tick <= m_cursor, FIFO from m_head
+	std::pmr::vector< entry >    m_overflow; // heap, past the top level
+	std::pmr::vector< std::pmr::vector< entry > > m_slots; // [level * SLOTS + digit]
+	uint32_t                     m_first[LEVELS * SLOTS] = {};
+	uint64_t                     m_mask[LEVELS] = {};
+	size_t                       m_head   = 0;
+	uint64_t                     m_cursor = 0;
+	uint64_t                     m_seq    = 0;
+	size_t                       m_count  = 0;
+};
+
+#endif // NV_ECS_TIMING_WHEEL_HH
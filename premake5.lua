@@ -34,6 +34,9 @@ workspace "nova-ecs"
 		buildoptions { "/std:c++latest", "/permissive-" }
 		flags { "MultiProcessorCompile" }
 
+	filter { "system:not windows" }
+		links { "pthread" }
+
 	filter {}
 
 project "test"
@@ -43,3 +46,30 @@ project "test"
 	includedirs { "nova-ecs" }
 	location ("build/".._ACTION)
 	targetname "test"
+
+-- one console app per benchmark in bench/, bench_handles once per handle
+-- layout (index and counter bits, see handle.hh)
+local handle_layouts = { { 16, 16 }, { 24, 8 }, { 32, 32 } }
+
+local function bench_project( name, file, defs )
+	project( name )
+		language "C++"
+		kind "ConsoleApp"
+		files { file, "bench/*.hh", "nova-ecs/**.hh" }
+		includedirs { "nova-ecs" }
+		defines( defs )
+		location ( "build/".._ACTION )
+		targetname( name )
+end
+
+for _, file in ipairs( os.matchfiles( "bench/*.cc" ) ) do
+	local name = "bench_" .. path.getbasename( file )
+	if name == "bench_handles" then
+		for _, layout in ipairs( handle_layouts ) do
+			bench_project( name .. "_" .. layout[1] .. "_" .. layout[2], file,
+				{ "NV_ECS_HANDLE_INDEX_BITS=" .. layout[1], "NV_ECS_HANDLE_COUNTER_BITS=" .. layout[2] } )
+		end
+	else
+		bench_project( name, file, {} )
+	end
+end
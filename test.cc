@@ -1,9 +1,22 @@
 // Copyright (C) 2017-2017 ChaosForge Ltd
 // http://chaosforge.org/
 
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <memory_resource>
+#include <set>
+#include <string>
+#include <thread>
 #include "nova-ecs/field_detection.hh"
 #include "nova-ecs/ecs.hh"
 
+static int g_failed = 0;
+
+#define CHECK( expr ) \
+	do { if ( !( expr ) ) { printf( "%s:%d: CHECK( %s ) failed\n", __FILE__, __LINE__, #expr ); g_failed++; } } while ( 0 )
+
 struct position
 {
 	int x;
@@ -45,18 +58,20 @@ using game_ecs = ecs< msg_list >;
 
 struct position_system
 {
-	void update( game_ecs& ecs, position& p )
+	using components = mpl::list< position >;
+
+	void update( game_ecs&, position& p, float )
 	{
 		p.x++;
 	}
 
-	void on( const msg_action& a, position& p )
+	void on( const msg_action&, position& p )
 	{
 		p.y--;
 	}
 };
 
-int main( int argc, char* argv[] )
+static void test_basic()
 {
 	game_ecs e;
 	e.register_component< position >();
@@ -66,8 +81,2055 @@ int main( int argc, char* argv[] )
 	e.add_component< position >( being, 3, 4 );
 
 	e.dispatch< msg_action >( being );
+	CHECK( e.get< position >( being )->y == 3 );
 
 	e.update( 1.0f );
+	CHECK( e.get< position >( being )->x == 4 );
+}
+
+// update handlers run on the pool as their conflicting predecessors finish
+namespace scheduler_test
+{
+	struct source { int v; };
+	struct doubled { int v; };
+	struct summed { int v; };
+
+	// writers of a component must never overlap each other or its readers
+	std::atomic< int > g_writing[3];
+
+	struct exclusive_write
+	{
+		explicit exclusive_write( int c ) : m_c( c ), m_ok( g_writing[c].fetch_add( 1 ) == 0 ) {}
+		~exclusive_write() { g_writing[m_c].fetch_sub( 1 ); }
+		int  m_c;
+		bool m_ok;
+	};
+
+	std::atomic< int > g_overlaps{ 0 };
+
+	struct grow_system
+	{
+		using components = mpl::list< source >;
+		void update( source& s, float )
+		{
+			exclusive_write w( 0 );
+			if ( !w.m_ok ) g_overlaps++;
+			s.v += 1;
+		}
+	};
+
+	struct double_system
+	{
+		using components = mpl::list< doubled, source >;
+		void update( doubled& d, const source& s, float )
+		{
+			exclusive_write w( 1 );
+			if ( !w.m_ok || g_writing[0] > 0 ) g_overlaps++;
+			d.v = d.v + s.v * 2;
+		}
+	};
+
+	struct sum_system
+	{
+		using components = mpl::list< summed, source >;
+		void update( summed& m, const source& s, float )
+		{
+			exclusive_write w( 2 );
+			if ( !w.m_ok || g_writing[0] > 0 ) g_overlaps++;
+			m.v = m.v * 3 + s.v;
+		}
+	};
+
+	unsigned long long run( unsigned threads )
+	{
+		game_ecs e;
+		e.register_component< source >();
+		e.register_component< doubled >();
+		e.register_component< summed >();
+		e.register_system< grow_system >();
+		e.register_system< double_system >();
+		e.register_system< sum_system >();
+		e.register_system< grow_system >();
+		if ( threads > 0 )
+			e.set_thread_count( threads );
+		for ( int i = 0; i < 3000; ++i )
+		{
+			handle h = e.create();
+			e.add_component< source >( h, i );
+			e.add_component< doubled >( h, 0 );
+			e.add_component< summed >( h, 1 );
+		}
+		for ( int f = 0; f < 10; ++f )
+			e.update( 0.1f );
+		unsigned long long result = 0;
+		e.for_each< doubled, summed, source >( [&] ( doubled& d, summed& m, source& s )
+		{
+			result = result * 31 + d.v + m.v % 1000 + s.v;
+		} );
+		return result;
+	}
+}
+
+static void test_scheduler()
+{
+	using namespace scheduler_test;
+	unsigned long long serial = run( 0 );
+	CHECK( run( 1 ) == serial );
+	CHECK( run( 3 ) == serial );
+	CHECK( g_overlaps == 0 );
+}
+
+// parallel_for_each and parallel systems split the storage across the pool
+namespace parallel_test
+{
+	struct value { int v; };
+	struct scale { int k; };
+	struct triple { float x; float y; float z; };
+	struct mixed { double d; char c; };
+
+	struct scale_system
+	{
+		static constexpr bool parallel = true;
+		using components = mpl::list< value, scale >;
+		void update( value& x, const scale& s, float )
+		{
+			x.v = x.v * s.k + 1;
+		}
+	};
+
+	unsigned long long checksum( game_ecs& e )
+	{
+		unsigned long long result = 0;
+		e.for_each< value >( [&] ( value& x ) { result = result * 31 + unsigned( x.v ); } );
+		return result;
+	}
+
+	unsigned long long run( unsigned threads )
+	{
+		game_ecs e;
+		e.register_component< value >();
+		e.register_component< scale >();
+		e.register_system< scale_system >();
+		if ( threads > 0 )
+			e.set_thread_count( threads );
+		for ( int i = 0; i < 20000; ++i )
+		{
+			handle h = e.create();
+			e.add_component< value >( h, i );
+			if ( i % 3 != 0 )
+				e.add_component< scale >( h, i % 5 );
+		}
+		e.update( 0.1f );
+		std::atomic< int > visits{ 0 };
+		e.parallel_for_each< value, scale >( [&] ( value& x, scale& s )
+		{
+			x.v -= s.k;
+			visits++;
+		} );
+		CHECK( visits == 20000 - 6667 );
+		return checksum( e );
+	}
+}
+
+template <> struct component_storage_layout< parallel_test::mixed > { typedef soa_layout type; };
+
+static void test_parallel()
+{
+	using namespace parallel_test;
+	unsigned long long serial = run( 0 );
+	CHECK( run( 1 ) == serial );
+	CHECK( run( 3 ) == serial );
+
+	// chunks of line_rows rows start on a cache line in every array
+	game_ecs e;
+	e.register_component< triple >();
+	e.register_component< mixed >();
+	for ( int i = 0; i < 1000; ++i )
+	{
+		handle h = e.create();
+		e.add_component< triple >( h, float( i ), 0.0f, 0.0f );
+		e.add_component< mixed >( h, double( i ), char( i ) );
+	}
+	auto* t = e.get_storage< triple >();
+	auto* m = e.get_storage< mixed >();
+	CHECK( t->line_rows() == 16 );
+	CHECK( m->line_rows() == 64 );
+	CHECK( uintptr_t( t->data() ) % 64 == 0 );
+	CHECK( uintptr_t( t->data() + t->line_rows() ) % 64 == 0 );
+	CHECK( uintptr_t( m->column< 0 >().data() ) % 64 == 0 );
+	CHECK( uintptr_t( m->column< 1 >().data() + m->line_rows() ) % 64 == 0 );
+}
+
+// joins iterate the smallest storage and probe the others
+namespace join_test
+{
+	struct place { int x; };
+	struct burning { int heat; };
+	struct tag { int id; };
+
+	std::vector< int > g_visits;
+
+	struct burn_system
+	{
+		using components = mpl::list< place, burning >;
+		void update( place& p, burning& b, float )
+		{
+			CHECK( b.heat == p.x * 10 );
+			g_visits.push_back( p.x );
+		}
+	};
+}
+
+static void test_join()
+{
+	using namespace join_test;
+	game_ecs e;
+	e.register_component< place >();
+	e.register_component< burning >();
+	e.register_component< tag >();
+	e.register_system< burn_system >();
+
+	std::vector< handle > hs( 1000 );
+	e.create_n( 1000, hs.begin() );
+	for ( int i = 0; i < 1000; ++i )
+		e.add_component< place >( hs[i], i );
+	// added in reverse, so driving by burning visits them in that order
+	for ( int i = 990; i >= 0; i -= 10 )
+		e.add_component< burning >( hs[i], i * 10 );
+
+	e.update( 0.1f );
+	CHECK( g_visits.size() == 100 );
+	CHECK( g_visits.front() == 990 && g_visits.back() == 0 );
+
+	// the head is the small one now, arguments stay in declared order
+	int count = 0;
+	e.add_component< tag >( hs[500], 500 );
+	e.add_component< tag >( hs[7], 7 );
+	e.for_each< tag, place >( [&] ( tag& t, place& p )
+	{
+		CHECK( t.id == p.x );
+		count++;
+	} );
+	CHECK( count == 2 );
+
+	count = 0;
+	e.for_each< place, tag, burning >( [&] ( place& p, tag& t, burning& b )
+	{
+		CHECK( p.x == 500 && t.id == 500 && b.heat == 5000 );
+		count++;
+	} );
+	CHECK( count == 1 );
+}
+
+// component ids are dense, per type and shared by all worlds
+namespace component_id_test
+{
+	template < int K >
+	struct comp { int v; };
+
+	template < size_t... Ks >
+	void register_all( game_ecs& e, std::index_sequence< Ks... >&& )
+	{
+		( e.register_component< comp< int( Ks ) > >(), ... );
+	}
+
+	template < size_t... Ks >
+	bool distinct_ids( std::index_sequence< Ks... >&& )
+	{
+		std::vector< int > ids = { component_id< comp< int( Ks ) > >::value... };
+		std::sort( ids.begin(), ids.end() );
+		return ids.front() >= 0 && std::unique( ids.begin(), ids.end() ) == ids.end();
+	}
+}
+
+static void test_component_id()
+{
+	using namespace component_id_test;
+	game_ecs a;
+	CHECK( a.get_interface< comp< 99 > >() == nullptr );
+	// worlds on different threads register their components concurrently
+	std::thread other( [] { game_ecs b; register_all( b, std::make_index_sequence< 16 >() ); } );
+	register_all( a, std::make_index_sequence< 32 >() );
+	other.join();
+	CHECK( distinct_ids( std::make_index_sequence< 32 >() ) );
+
+	game_ecs c;
+	c.register_component< comp< 7 > >();
+	c.register_component< comp< 3 > >();
+	CHECK( c.get_interface< comp< 7 > >()->m_id == component_id< comp< 7 > >::value );
+	CHECK( c.get_interface< comp< 5 > >() == nullptr );
+
+	handle h = c.create();
+	c.add_component< comp< 3 > >( h, 3 );
+	c.add_component< comp< 7 > >( h, 7 );
+	CHECK( c.get< comp< 3 > >( h )->v == 3 && c.get< comp< 7 > >( h )->v == 7 );
+}
+
+// typed index calls, with the trait table or an explicitly chosen one
+namespace index_policy_test
+{
+	struct flat_c { int v; };
+	struct explicit_c { int v; };
+	struct hashed_c { int v; };
+}
+
+template <> struct component_index_table< index_policy_test::hashed_c > { typedef hashed_index_table type; };
+
+static void test_index_policy()
+{
+	using namespace index_policy_test;
+	game_ecs e;
+	e.register_component< flat_c >();
+	e.register_component< explicit_c, hashed_index_table >();
+	e.register_component< hashed_c >();
+	CHECK( e.get_interface< flat_c >()->m_typed_index );
+	CHECK( !e.get_interface< explicit_c >()->m_typed_index );
+	CHECK( dynamic_cast< hashed_index_table* >( e.get_interface< explicit_c >()->m_index ) != nullptr );
+	CHECK( dynamic_cast< hashed_index_table* >( e.get_interface< hashed_c >()->m_index ) != nullptr );
+
+	std::vector< handle > hs( 300 );
+	e.create_n( 300, hs.begin() );
+	std::vector< explicit_c > values;
+	for ( int i = 0; i < 100; ++i )
+		values.push_back( { i } );
+	e.add_components< explicit_c >( span< const handle >( hs.data(), 100 ), span< const explicit_c >( values.data(), 100 ) );
+	for ( int i = 0; i < 300; ++i )
+	{
+		e.add_component< flat_c >( hs[i], i );
+		if ( i >= 100 && i % 2 == 0 )
+			e.add_component< explicit_c >( hs[i], i );
+		if ( i % 3 == 0 )
+			e.add_component< hashed_c >( hs[i], i );
+	}
+	for ( int i = 0; i < 300; i += 5 )
+		e.remove_component< explicit_c >( hs[i] );
+
+	bool ok = true;
+	for ( int i = 0; i < 300; ++i )
+	{
+		explicit_c* c = e.get< explicit_c >( hs[i] );
+		bool present = ( i < 100 || i % 2 == 0 ) && i % 5 != 0;
+		ok = ok && ( present ? c && c->v == i : c == nullptr );
+		ok = ok && e.get< flat_c >( hs[i] )->v == i;
+		ok = ok && ( i % 3 == 0 ? e.get< hashed_c >( hs[i] )->v == i : e.get< hashed_c >( hs[i] ) == nullptr );
+	}
+	CHECK( ok );
+
+	int count = 0;
+	e.for_each< explicit_c, flat_c >( [&] ( explicit_c& x, flat_c& f )
+	{
+		CHECK( x.v == f.v );
+		count++;
+	} );
+	CHECK( count == 100 - 20 + 100 - 20 );
+}
+
+// paged index tables only hold pages for populated handle ranges
+namespace paged_test
+{
+	struct sparse_c { int v; };
+}
+
+template <> struct component_index_table< paged_test::sparse_c > { typedef paged_index_table type; };
+
+static void test_paged_index()
+{
+	using namespace paged_test;
+	game_ecs e;
+	e.register_component< sparse_c >();
+	auto* table = static_cast< paged_index_table* >( e.get_interface< sparse_c >()->m_index );
+
+	std::vector< handle > hs( 60100 );
+	e.create_n( 60100, hs.begin() );
+	for ( int i = 60000; i < 60020; ++i )
+		e.add_component< sparse_c >( hs[i], i );
+	CHECK( table->page_count() == 1 );
+	e.add_component< sparse_c >( hs[3], 3 );
+	e.add_component< sparse_c >( hs[300], 300 );
+	CHECK( table->page_count() == 3 );
+
+	CHECK( e.get< sparse_c >( hs[300] )->v == 300 );
+	CHECK( e.get< sparse_c >( hs[301] ) == nullptr );
+	CHECK( e.get< sparse_c >( hs[40000] ) == nullptr );
+	CHECK( e.get< sparse_c >( handle() ) == nullptr );
+
+	// emptying a page releases it, the moved rows stay reachable
+	e.remove_component< sparse_c >( hs[3] );
+	CHECK( table->page_count() == 2 );
+	for ( int i = 60000; i < 60020; i += 2 )
+		e.remove_component< sparse_c >( hs[i] );
+	bool ok = true;
+	for ( int i = 60000; i < 60020; ++i )
+		ok = ok && ( i % 2 == 0 ? e.get< sparse_c >( hs[i] ) == nullptr : e.get< sparse_c >( hs[i] )->v == i );
+	CHECK( ok );
+	CHECK( e.get< sparse_c >( hs[300] )->v == 300 );
+	e.remove( hs[300] );
+	CHECK( table->page_count() == 1 );
+	CHECK( table->size() == 10 );
+}
+
+// hashed_index_table keeps the index_table contract through heavy churn
+static void test_hashed_index()
+{
+	component_storage_handler< int > storage( true );
+	hashed_index_table table( &storage );
+	std::vector< bool > present( 4096, false );
+	auto valid = [&] ()
+	{
+		for ( int i = 1; i < 4096; ++i )
+		{
+			int row = table.get( handle( i, 1 ) );
+			if ( present[i] ? row < 0 || storage[row] != i : row != -1 )
+				return false;
+		}
+		return table.size() == int( std::count( present.begin(), present.end(), true ) );
+	};
+
+	// clustered keys, so removal has to shift whole probe runs back
+	unsigned seed = 7;
+	for ( int step = 0; step < 20000; ++step )
+	{
+		seed = seed * 1103515245u + 12345u;
+		int key = 1 + int( ( seed >> 8 ) % 4095 );
+		handle h( key, 1 );
+		if ( !present[key] )
+		{
+			table.insert( h );
+			storage.append< int >( key, key );
+			present[key] = true;
+		}
+		else if ( step % 3 == 0 )
+		{
+			table.remove_swap( h );
+			present[key] = false;
+		}
+		else if ( step % 3 == 1 && table.size() > 0 )
+		{
+			int row = int( seed % unsigned( table.size() ) );
+			present[storage[row]] = false;
+			CHECK( table.remove_swap_by_index( row ) == row );
+		}
+		else
+		{
+			handle other( 1 + int( seed % 4095 ), 1 );
+			table.swap( h, other );
+		}
+	}
+	CHECK( valid() );
+	CHECK( table.get( handle() ) == -1 );
+
+	table.clear();
+	std::fill( present.begin(), present.end(), false );
+	CHECK( valid() );
+	table.reserve( 1000, 4095 );
+	for ( int i = 1; i < 1000; ++i )
+	{
+		table.insert( handle( i * 4, 1 ) );
+		storage.append< int >( i * 4, i * 4 );
+		present[i * 4] = true;
+	}
+	CHECK( valid() );
+}
+
+// soa_layout keeps one array per field, in lockstep with the owners
+namespace soa_test
+{
+	struct velocity { float x; float y; int flags; };
+}
+
+template <> struct component_storage_layout< soa_test::velocity > { typedef soa_layout type; };
+
+static void test_soa()
+{
+	using namespace soa_test;
+	game_ecs e;
+	e.register_component< velocity >();
+	auto* storage = e.get_storage< velocity >();
+	CHECK( storage->FIELD_COUNT == 3 );
+
+	std::vector< handle > hs( 100 );
+	e.create_n( 100, hs.begin() );
+	for ( int i = 0; i < 50; ++i )
+		e.add_component< velocity >( hs[i], float( i ), float( -i ), i );
+	e.add_components< velocity >( span< const handle >( hs.data() + 50, 50 ), 1.0f, 2.0f, 7 );
+	CHECK( storage->size() == 100 );
+
+	// remove_swap moves every column and the owner index together
+	for ( int i = 0; i < 50; i += 3 )
+		e.remove_component< velocity >( hs[i] );
+	bool ok = true;
+	for ( int row = 0; row < storage->size(); ++row )
+	{
+		int owner = storage->index( row );
+		velocity v = ( *storage )[row];
+		int i = int( std::find_if( hs.begin(), hs.end(), [&] ( handle h ) { return int( h.index ) == owner; } ) - hs.begin() );
+		if ( i < 50 )
+			ok = ok && i % 3 != 0 && v.x == float( i ) && v.y == float( -i ) && v.flags == i;
+		else
+			ok = ok && v.x == 1.0f && v.y == 2.0f && v.flags == 7;
+	}
+	CHECK( ok );
+
+	// columns are plain spans, proxies read and write through them
+	span< float > xs = storage->column< 0 >();
+	CHECK( xs.size() == storage->size() );
+	for ( float& x : xs )
+		x = 5.0f;
+	( *storage )[0] = velocity{ 1.5f, 2.5f, 3 };
+	CHECK( ( *storage )[0].get< 1 >() == 2.5f );
+	float sum = 0.0f;
+	e.for_each< velocity >( [&] ( auto v ) { sum += v.template get< 0 >(); } );
+	CHECK( sum == 1.5f + 5.0f * float( storage->size() - 1 ) );
+}
+
+// kernels over soa_layout components match the scalar result, in place
+// and through gathered batches
+namespace kernel_test
+{
+	struct pos { float x; float y; };
+	struct vel { float x; float y; };
+	struct timer { float t; int n; };
+}
+
+template <> struct component_storage_layout< kernel_test::pos > { typedef soa_layout type; };
+template <> struct component_storage_layout< kernel_test::vel > { typedef soa_layout type; };
+template <> struct component_storage_layout< kernel_test::timer > { typedef soa_layout type; };
+
+static void test_kernel()
+{
+	using namespace kernel_test;
+	game_ecs e;
+	e.register_component< pos >();
+	e.register_component< vel >();
+	e.register_component< timer >();
+
+	// a dense prefix the kernel runs in place, then a sparse, reordered tail
+	std::vector< handle > hs( 2000 );
+	e.create_n( 2000, hs.begin() );
+	for ( int i = 0; i < 2000; ++i )
+	{
+		e.add_component< pos >( hs[i], float( i ), 0.0f );
+		if ( i < 1000 || i % 3 != 0 )
+			e.add_component< vel >( hs[i], 1.0f, float( i % 7 ) );
+		e.add_component< timer >( hs[i], float( i % 10 ), i % 5 );
+	}
+	e.remove_component< vel >( hs[600] );
+	e.remove_component< pos >( hs[1200] );
+
+	int batches = 0;
+	for ( int frame = 0; frame < 3; ++frame )
+		e.kernel< pos, const vel >( [&] ( auto& p, const auto& v )
+		{
+			CHECK( p.size() == v.size() && p.size() <= game_ecs::KERNEL_BATCH );
+			simd::madd( p.template field< 0 >(), v.template field< 0 >(), 0.5f );
+			simd::madd( p.template field< 1 >(), v.template field< 1 >(), 0.5f );
+			batches++;
+		} );
+	CHECK( batches > 0 );
+
+	bool ok = true;
+	for ( int i = 0; i < 2000; ++i )
+	{
+		if ( i == 1200 )
+			continue;
+		pos p = ( *e.get_storage< pos >() )[e.get_debug_index< pos >( hs[i] )];
+		bool moves = ( i < 1000 || i % 3 != 0 ) && i != 600;
+		ok = ok && p.x == float( i ) + ( moves ? 1.5f : 0.0f ) && p.y == ( moves ? 1.5f * float( i % 7 ) : 0.0f );
+	}
+	CHECK( ok );
+
+	// const components are never written back
+	e.kernel< const pos, vel >( [] ( const auto& p, auto& v )
+	{
+		simd::madd( v.template field< 0 >(), p.template field< 0 >(), 1.0f );
+	} );
+	CHECK( ( *e.get_storage< pos >() )[e.get_debug_index< pos >( hs[5] )].get< 0 >() == 6.5f );
+	CHECK( ( *e.get_storage< vel >() )[e.get_debug_index< vel >( hs[5] )].get< 0 >() == 7.5f );
+
+	e.kernel< timer >( [] ( auto& t )
+	{
+		simd::sub_clamp( t.template field< 0 >(), 3.0f, 0.0f );
+		simd::sub_clamp( t.template field< 1 >(), 2, 0 );
+	} );
+	ok = true;
+	for ( int i = 0; i < 2000; ++i )
+	{
+		timer t = ( *e.get_storage< timer >() )[e.get_debug_index< timer >( hs[i] )];
+		ok = ok && t.t == std::max( float( i % 10 ) - 3.0f, 0.0f ) && t.n == std::max( i % 5 - 2, 0 );
+	}
+	CHECK( ok );
+}
+
+// archetype_layout components move between tables as their set changes
+namespace archetype_test
+{
+	struct name { std::string text; };
+	struct health { int hp; };
+	struct armor { int value; std::vector< int > layers; };
+
+	struct heal_system
+	{
+		using components = mpl::list< health, name >;
+		void update( health& h, name& n, float )
+		{
+			h.hp += int( n.text.size() );
+		}
+	};
+}
+
+template <> struct component_storage_layout< archetype_test::name > { typedef archetype_layout type; };
+template <> struct component_storage_layout< archetype_test::health > { typedef archetype_layout type; };
+template <> struct component_storage_layout< archetype_test::armor > { typedef archetype_layout type; };
+
+static void test_archetype()
+{
+	using namespace archetype_test;
+	game_ecs e;
+	e.register_component< name >();
+	e.register_component< health >();
+	e.register_component< armor >();
+	e.register_system< heal_system >();
+
+	// short strings point into themselves, so a bytewise move would be caught
+	auto label = [] ( int i ) { return i % 2 ? std::to_string( i ) : "entity number " + std::to_string( i ) + " with a long name"; };
+	std::vector< handle > hs( 600 );
+	e.create_n( 600, hs.begin() );
+	for ( int i = 0; i < 600; ++i )
+	{
+		e.add_component< name >( hs[i], label( i ) );
+		if ( i % 2 == 0 )
+			e.add_component< health >( hs[i], i );
+		if ( i % 3 == 0 )
+			e.add_component< armor >( hs[i], i, std::vector< int >( 3, i ) );
+	}
+	// moving to smaller sets and removing whole rows relocates the rest
+	for ( int i = 0; i < 600; i += 4 )
+		e.remove_component< name >( hs[i] );
+	for ( int i = 0; i < 600; i += 9 )
+		e.remove_component< armor >( hs[i] );
+	for ( int i = 1; i < 600; i += 10 )
+		e.remove( hs[i] );
+
+	e.update( 0.1f );
+
+	bool ok = true;
+	for ( int i = 0; i < 600; ++i )
+	{
+		if ( i % 10 == 1 )
+		{
+			ok = ok && !e.is_valid( hs[i] );
+			continue;
+		}
+		name* n = e.get< name >( hs[i] );
+		health* h = e.get< health >( hs[i] );
+		armor* a = e.get< armor >( hs[i] );
+		ok = ok && ( i % 4 == 0 ? n == nullptr : n && n->text == label( i ) );
+		ok = ok && ( i % 2 != 0 ? h == nullptr : h && h->hp == i + ( n ? int( n->text.size() ) : 0 ) );
+		ok = ok && ( i % 3 != 0 || i % 9 == 0 ? a == nullptr : a && a->value == i && a->layers == std::vector< int >( 3, i ) );
+	}
+	CHECK( ok );
+
+	int count = 0;
+	e.for_each< armor, name >( [&] ( armor& a, name& n )
+	{
+		CHECK( n.text == label( a.value ) );
+		count++;
+	} );
+	CHECK( count > 0 );
+}
+
+// owning groups keep the entities having all members in a shared prefix
+namespace group_test
+{
+	struct place { float x; float y; };
+	struct ai_state { int state; };
+
+	struct think_system
+	{
+		using components = mpl::list< ai_state, place >;
+		void update( ai_state& a, place& p, float dt )
+		{
+			p.x += dt;
+			a.state += 100000;
+		}
+	};
+
+	struct model
+	{
+		std::vector< handle > handles;
+		std::vector< bool >   has_place;
+		std::vector< bool >   has_ai;
+		std::vector< bool >   alive;
+	};
+
+	bool consistent( game_ecs& e, model& m )
+	{
+		auto g = e.group< ai_state, place >();
+		bool ok = true;
+		int members = 0;
+		for ( size_t i = 0; i < m.handles.size(); ++i )
+		{
+			handle h = m.handles[i];
+			if ( !m.alive[i] )
+			{
+				ok = ok && !e.is_valid( h );
+				continue;
+			}
+			place* p = e.get< place >( h );
+			ai_state* a = e.get< ai_state >( h );
+			ok = ok && ( p != nullptr ) == m.has_place[i] && ( a != nullptr ) == m.has_ai[i];
+			ok = ok && ( !p || p->y == float( i ) ) && ( !a || a->state % 100000 == int( i ) );
+			if ( p && a )
+			{
+				members++;
+				int row = e.get_debug_index< place >( h );
+				ok = ok && row == e.get_debug_index< ai_state >( h ) && row < g.size();
+			}
+		}
+		int visited = 0;
+		g.each( [&] ( ai_state& a, place& p )
+		{
+			ok = ok && a.state % 100000 == int( p.y );
+			visited++;
+		} );
+		return ok && g.size() == members && visited == members;
+	}
+}
+
+static void test_group()
+{
+	using namespace group_test;
+	game_ecs e;
+	e.register_component< place >();
+	e.register_component< ai_state >();
+
+	model m;
+	unsigned seed = 1;
+	auto random = [&] ( unsigned n ) { seed = seed * 1103515245u + 12345u; return ( seed >> 8 ) % n; };
+	for ( int i = 0; i < 3000; ++i )
+	{
+		handle h = e.create();
+		m.handles.push_back( h );
+		m.has_place.push_back( random( 2 ) == 0 );
+		m.has_ai.push_back( random( 5 ) == 0 );
+		m.alive.push_back( true );
+		if ( m.has_place[i] )
+			e.add_component< place >( h, 0.0f, float( i ) );
+		if ( m.has_ai[i] )
+			e.add_component< ai_state >( h, i );
+	}
+	CHECK( consistent( e, m ) );
+
+	for ( int step = 0; step < 20000; ++step )
+	{
+		int i = int( random( 3000 ) );
+		if ( !m.alive[i] )
+			continue;
+		switch ( random( 4 ) )
+		{
+		case 0:
+			if ( m.has_place[i] )
+				e.remove_component< place >( m.handles[i] );
+			else
+				e.add_component< place >( m.handles[i], 0.0f, float( i ) );
+			m.has_place[i] = !m.has_place[i];
+			break;
+		case 1:
+			if ( m.has_ai[i] )
+				e.remove_component< ai_state >( m.handles[i] );
+			else
+				e.add_component< ai_state >( m.handles[i], i );
+			m.has_ai[i] = !m.has_ai[i];
+			break;
+		case 2:
+			if ( random( 10 ) == 0 )
+			{
+				e.remove( m.handles[i] );
+				m.alive[i] = false;
+			}
+			break;
+		default:
+			if ( random( 50 ) == 0 )
+			{
+				int k = int( random( 7 ) );
+				e.remove_component_if< place >( [&] ( const place& p )
+				{
+					if ( int( p.y ) % 7 != k )
+						return false;
+					m.has_place[int( p.y )] = false;
+					return true;
+				} );
+			}
+		}
+	}
+	CHECK( consistent( e, m ) );
+
+	// systems and joins over exactly the members go through the group
+	e.register_system< think_system >();
+	e.update( 1.0f );
+	CHECK( consistent( e, m ) );
+	e.set_thread_count( 2 );
+	std::atomic< int > visited{ 0 };
+	e.parallel_for_each< ai_state, place >( [&] ( ai_state&, place& ) { visited++; } );
+	int members = e.group< ai_state, place >().size();
+	CHECK( visited == members );
+}
+
+static void test_handles()
+{
+	typedef basic_handle< 24, 8 > handle_24_8;
+	typedef basic_handle< 32, 32 > handle_32_32;
+	static_assert( sizeof( handle ) == 4 && sizeof( handle_24_8 ) == 4 && sizeof( handle_32_32 ) == 8, "Handle sizes!" );
+	CHECK( handle_24_8::MAX_INDEX == 0xFFFFFF && handle_24_8::COUNTER_MASK == 0xFF );
+	CHECK( handle_32_32::MAX_INDEX == INT_MAX && handle_32_32::COUNTER_MASK == 0xFFFFFFFFu );
+
+	handle_24_8 a( 0xABCDEF, 0x12 );
+	CHECK( a.index == 0xABCDEF && a.counter == 0x12 && a.hash() == 0x12ABCDEF );
+	handle_32_32 b( 0x7FFFFFFF, 0xFFFFFFFF );
+	CHECK( b.index == 0x7FFFFFFF && b.counter == 0xFFFFFFFF && b.is_valid() );
+	CHECK( !handle_32_32().is_valid() && handle_32_32( 0, 1 ).is_valid() );
+	CHECK( std::hash< handle_32_32 >()( b ) == size_t( b.hash() ) );
+
+	// reusing one index wraps the counter past the null handle, stale
+	// handles stay invalid
+	handle_manager hm;
+	handle first = hm.create_handle();
+	handle h = first;
+	bool ok = true;
+	for ( uint64_t i = 0; i < handle::COUNTER_MASK; ++i )
+	{
+		hm.free_handle( h );
+		handle next = hm.create_handle();
+		ok = ok && next.is_valid() && next.index == first.index && next.counter != h.counter;
+		ok = ok && hm.is_valid( next ) && !hm.is_valid( h );
+		h = next;
+	}
+	CHECK( ok );
+	CHECK( h == first );
+
+	game_ecs e;
+	e.register_component< position >();
+	handle x = e.create();
+	e.add_component< position >( x, 1, 2 );
+	e.remove( x );
+	handle y = e.create();
+	CHECK( y.index == x.index && y != x );
+	CHECK( !e.is_valid( x ) && e.is_valid( y ) && e.get< position >( y ) == nullptr );
+}
+
+namespace remove_test
+{
+	struct hp { int v; };
+	struct tag { int v; };
+
+	struct hp_system
+	{
+		using components = mpl::list< hp >;
+		int destroyed = 0;
+		void destroy( hp& ) { destroyed++; }
+	};
+}
+
+static void test_remove_batch()
+{
+	using namespace remove_test;
+	game_ecs e;
+	e.register_component< hp >();
+	e.register_component< tag >();
+	hp_system* s = e.register_system< hp_system >();
+
+	std::vector< handle > hs( 1000 );
+	e.create_n( 1000, hs.begin() );
+	bool ok = true;
+	for ( int i = 0; i < 1000; ++i )
+	{
+		ok = ok && e.is_valid( hs[i] ) && ( i == 0 || hs[i] != hs[i - 1] );
+		e.add_component< hp >( hs[i], i );
+		if ( i % 3 == 0 )
+			e.add_component< tag >( hs[i], i );
+	}
+	CHECK( ok );
+	// 500..599 are children of 0..99, 900 a grandchild of 0
+	for ( int i = 0; i < 100; ++i )
+		e.attach( hs[i], hs[i + 500] );
+	e.attach( hs[500], hs[900] );
+
+	// the set is larger than the tag storage (scan) and smaller than hp
+	// (lookups); repeated, null and stale handles are skipped
+	handle stale = e.create();
+	e.remove( stale );
+	std::vector< handle > set( hs.begin(), hs.begin() + 400 );
+	set.push_back( hs[10] );
+	set.push_back( hs[510] );
+	set.push_back( handle() );
+	set.push_back( stale );
+	e.remove( set );
+
+	auto dead = [] ( int i ) { return i < 400 || ( i >= 500 && i < 600 ) || i == 900; };
+	int alive = 0;
+	for ( int i = 0; i < 1000; ++i )
+	{
+		if ( dead( i ) )
+		{
+			ok = ok && !e.is_valid( hs[i] );
+			continue;
+		}
+		alive++;
+		const hp* h = e.get< hp >( hs[i] );
+		const tag* t = e.get< tag >( hs[i] );
+		ok = ok && e.is_valid( hs[i] ) && h && h->v == i && ( t != nullptr ) == ( i % 3 == 0 ) && ( !t || t->v == i );
+	}
+	CHECK( ok );
+	CHECK( s->destroyed == 1000 - alive );
+	CHECK( e.get_storage< hp >()->size() == alive );
+
+	// freed indices are reused with new counters
+	std::vector< handle > again( 501 );
+	e.create_n( 501, again.begin() );
+	int reused = 0;
+	for ( handle h : again )
+		reused += int( e.is_valid( h ) && h.index <= stale.index );
+	CHECK( reused == 501 );
+
+	// marked handles go at the end of update, in one batch
+	e.mark_remove( hs[400] );
+	e.mark_remove( hs[401] );
+	e.mark_remove( hs[401] );
+	e.update( 0.0f );
+	CHECK( !e.is_valid( hs[400] ) && !e.is_valid( hs[401] ) && e.is_valid( hs[402] ) );
+	CHECK( s->destroyed == 1000 - alive + 2 );
+}
+
+namespace bulk_test
+{
+	struct pod { int a; float b; };
+	struct label { std::string text; int n; };
+	struct col { float x; int n; };
+	struct kind { int v; };
+	struct extra { int v; };
+
+	struct label_system
+	{
+		using components = mpl::list< label >;
+		int created = 0;
+		bool ok = true;
+		void create( handle, label& l ) { created++; ok = ok && l.text.size() > 16; }
+	};
+}
+
+template <> struct component_storage_layout< bulk_test::col > { typedef soa_layout type; };
+template <> struct component_storage_layout< bulk_test::kind > { typedef archetype_layout type; };
+template <> struct component_index_table< bulk_test::extra > { typedef paged_index_table type; };
+
+// add_components matches add_component one by one, for every layout
+static void test_add_components()
+{
+	using namespace bulk_test;
+	game_ecs e;
+	e.register_component< pod >();
+	e.register_component< label >();
+	e.register_component< col >();
+	e.register_component< kind >();
+	e.register_component< extra >();
+	label_system* s = e.register_system< label_system >();
+
+	std::vector< handle > hs( 3000 );
+	e.create_n( 3000, hs.begin() );
+	// some rows exist already, so the batches append after them
+	for ( int i = 0; i < 10; ++i )
+		e.add_component< pod >( hs[2990 + i], -1, 0.0f );
+
+	std::vector< pod > pods;
+	std::vector< label > labels;
+	std::vector< col > cols;
+	for ( int i = 0; i < 2990; ++i )
+	{
+		pods.push_back( pod{ i, float( i ) * 0.5f } );
+		labels.push_back( label{ "a long string to force the heap " + std::to_string( i ), i } );
+		cols.push_back( col{ float( i ), -i } );
+	}
+	span< const handle > batch( hs.data(), 2990 );
+	e.add_components< pod >( batch, span< const pod >( pods ) );
+	e.add_components< label >( batch, span< const label >( labels ) );
+	e.add_components< col >( batch, span< const col >( cols ) );
+	e.add_components< kind >( batch, 7 );
+	e.add_components< extra >( span< const handle >( hs.data() + 1000, 1000 ), 42 );
+
+	bool ok = true;
+	for ( int i = 0; i < 2990; ++i )
+	{
+		const pod* p = e.get< pod >( hs[i] );
+		const label* l = e.get< label >( hs[i] );
+		const kind* k = e.get< kind >( hs[i] );
+		const extra* x = e.get< extra >( hs[i] );
+		ok = ok && p && p->a == i && p->b == float( i ) * 0.5f;
+		ok = ok && l && l->n == i && l->text == labels[i].text;
+		ok = ok && k && k->v == 7;
+		ok = ok && ( x != nullptr ) == ( i >= 1000 && i < 2000 ) && ( !x || x->v == 42 );
+	}
+	int n = 0;
+	e.for_each< col >( [&] ( auto c ) { ok = ok && c.template get< 1 >() == -int( c.template get< 0 >() ); n++; } );
+	CHECK( ok );
+	CHECK( n == 2990 );
+	CHECK( e.get< pod >( hs[2995] )->a == -1 && e.get_storage< pod >()->size() == 3000 );
+	CHECK( s->created == 2990 && s->ok );
+
+	// the rows remove like any others
+	e.remove( span< const handle >( hs.data(), 1500 ) );
+	CHECK( e.get_storage< label >()->size() == 1490 && e.get< label >( hs[2000] )->n == 2000 );
+	CHECK( e.get< extra >( hs[1999] )->v == 42 && e.get_storage< extra >()->size() == 500 );
+}
+
+namespace command_test
+{
+	struct seed { int v; };
+	struct spawned { handle from; int v; };
+
+	using cmd_ecs = game_ecs;
+
+	// every seed spawns an entity from a parallel loop
+	struct spawn_system
+	{
+		void update( cmd_ecs& e, float )
+		{
+			e.parallel_for_each< seed >( [&] ( seed& s )
+			{
+				auto& cb = e.commands();
+				handle h = cb.create();
+				cb.add_component< spawned >( h, h, s.v );
+			} );
+		}
+	};
+
+	std::vector< int > spawn_order( unsigned threads )
+	{
+		cmd_ecs e;
+		e.register_component< seed >();
+		e.register_component< spawned >();
+		e.register_system< spawn_system >();
+		e.set_thread_count( threads );
+		for ( int i = 0; i < 20000; ++i )
+			e.add_component< seed >( e.create(), i );
+		e.update( 0.0f );
+		std::vector< int > result;
+		e.for_each< spawned >( [&] ( spawned& s ) { result.push_back( s.v ); } );
+		return result;
+	}
+}
+
+static void test_commands()
+{
+	using namespace command_test;
+	cmd_ecs e;
+	e.register_component< seed >();
+	e.register_component< spawned >();
+	handle a = e.create();
+	handle b = e.create();
+	e.add_component< seed >( b, 1 );
+
+	// pending handles resolve in later commands, including handle arguments
+	auto& cb = e.commands();
+	handle p = cb.create();
+	handle q = cb.create();
+	CHECK( p.counter == 0 && q.counter == 0 && p != q );
+	cb.add_component< spawned >( p, q, 1 );
+	cb.add_component< spawned >( q, p, 2 );
+	cb.attach( a, p );
+	cb.remove_component< seed >( b );
+	cb.remove( e.create() );
+	CHECK( e.get_storage< spawned >()->size() == 0 && e.get< seed >( b ) != nullptr );
+
+	e.apply_commands();
+	CHECK( cb.empty() );
+	handle rp = e.first_child( a );
+	CHECK( e.is_valid( rp ) && e.get< spawned >( rp ) && e.get< spawned >( rp )->v == 1 );
+	handle rq = e.get< spawned >( rp )->from;
+	CHECK( e.is_valid( rq ) && e.get< spawned >( rq )->from == rp && e.get< spawned >( rq )->v == 2 );
+	CHECK( e.get< seed >( b ) == nullptr );
+
+	// commands on handles that died meanwhile are dropped
+	cb.add_component< seed >( b, 3 );
+	e.remove( b );
+	e.apply_commands();
+	CHECK( e.get_storage< seed >()->size() == 0 );
+
+	// the buffer starts over after playback
+	CHECK( cb.create() == p );
+	e.apply_commands();
+
+	// playback order doesn't depend on the thread count
+	std::vector< int > serial = spawn_order( 0 );
+	CHECK( serial.size() == 20000 );
+	CHECK( spawn_order( 1 ) == serial );
+	CHECK( spawn_order( 3 ) == serial );
+}
+
+namespace wheel_test
+{
+	struct timed { float time; int id; };
+
+	struct msg_tick
+	{
+		static const int message_id = 0;
+		int   id;
+		float due;
+	};
+
+	// every message fires once, with the time never going back, not before
+	// it is due and at most late by the frame plus slack (a wheel tick) -
+	// returns the ids that fired, sorted, or nothing if a check failed
+	template < typename Queue >
+	std::vector< int > fire_check( float slack )
+	{
+		typedef message_queue< mpl::list< msg_tick >, Queue > queue_type;
+		struct recorder
+		{
+			queue_type* q;
+			float       late = 0.0f;
+			bool        ok = true;
+			float       last = 0.0f;
+			std::vector< int > ids;
+			void on( const msg_tick& m )
+			{
+				float now = q->get_time();
+				ok = ok && now >= last && now >= m.due && now - m.due <= late;
+				last = now;
+				ids.push_back( m.id );
+				if ( m.id % 5 == 0 && m.id < 100000 )
+				{
+					float delay = float( m.id % 97 ) * 0.37f + 0.001f * float( m.id % 13 );
+					q->template queue< msg_tick >( delay, m.id + 100000, now + delay );
+				}
+			}
+		};
+		queue_type q;
+		recorder r;
+		r.q = &q;
+		q.register_handler( &r );
+		for ( int i = 0; i < 5000; ++i )
+		{
+			float delay = float( ( i * 7919 ) % 5000 ) * 0.013f;
+			q.template queue< msg_tick >( delay, i, delay );
+		}
+		r.late = 0.25f + slack;
+		for ( int f = 0; f < 30; ++f )
+			q.update_time( 0.25f );
+		r.late = slack;
+		while ( q.events_pending() )
+			q.update_step();
+		std::sort( r.ids.begin(), r.ids.end() );
+		return r.ok ? r.ids : std::vector< int >();
+	}
+
+	// tick of t, as timing_wheel< timed > cuts it
+	uint64_t tick_of( float t ) { return uint64_t( double( t ) * 64.0 ); }
+}
+
+// the wheel pops by ( tick, push order ), earlier ticks are due at once
+static void test_timing_wheel()
+{
+	using namespace wheel_test;
+	timing_wheel< timed > wheel;
+	std::set< std::pair< uint64_t, int > > model;
+	unsigned seed = 3;
+	auto random = [&] ( unsigned n ) { seed = seed * 1103515245u + 12345u; return ( seed >> 8 ) % n; };
+	float now = 0.0f;
+	uint64_t cursor = 0;
+	int id = 0;
+	bool ok = true;
+	for ( int step = 0; step < 60000; ++step )
+	{
+		if ( random( 3 ) != 0 || model.empty() )
+		{
+			// past, near, far and beyond the top wheel level
+			static const float spans[] = { 0.0f, 0.5f, 40.0f, 300000.0f };
+			float span = spans[random( 4 )];
+			timed t{ std::max( now - 1.0f, 0.0f ) + float( random( 1000000 ) ) * 1e-6f * span, id++ };
+			wheel.push( t );
+			model.insert( { std::max( tick_of( t.time ), cursor ), t.id } );
+		}
+		else
+		{
+			ok = ok && wheel.size() == model.size() && wheel.top().id == model.begin()->second;
+			cursor = model.begin()->first;
+			now = wheel.top().time;
+			model.erase( model.begin() );
+			wheel.pop();
+		}
+	}
+	while ( !model.empty() )
+	{
+		ok = ok && !wheel.empty() && wheel.top().id == model.begin()->second;
+		model.erase( model.begin() );
+		wheel.pop();
+	}
+	CHECK( ok );
+	CHECK( wheel.empty() );
+
+	wheel.clear();
+	ok = true;
+	for ( int i = 0; i < 100; ++i )
+		wheel.push( timed{ float( i % 3 ), i } );
+	for ( int i = 0; i < 100; ++i )
+	{
+		int expected = i < 34 ? i * 3 : i < 67 ? ( i - 34 ) * 3 + 1 : ( i - 67 ) * 3 + 2;
+		ok = ok && wheel.top().id == expected;
+		wheel.pop();
+	}
+	CHECK( ok );
+
+	// within a tick push order wins over the exact time
+	wheel.push( timed{ 5.010f, 1 } );
+	wheel.push( timed{ 5.005f, 2 } );
+	wheel.push( timed{ 5.000f, 3 } );
+	wheel.push( timed{ 4.990f, 4 } );
+	int first = wheel.top().id;
+	wheel.pop();
+	int second = wheel.top().id;
+	wheel.pop();
+	CHECK( first == 4 && second == 1 );
+	wheel.clear();
+
+	// through message_queue, with handlers queueing more
+	std::vector< int > by_heap = fire_check< heap_queue >( 0.0f );
+	CHECK( by_heap.size() == 6000 );
+	CHECK( fire_check< wheel_queue<> >( 1.0f / 64.0f ) == by_heap );
+	CHECK( fire_check< wheel_queue< 8 > >( 1.0f / 8.0f ) == by_heap );
+}
+
+namespace payload_test
+{
+	struct msg_small { static const int message_id = 0; int v; };
+	struct msg_big   { static const int message_id = 1; int v; int data[60]; };
+
+	typedef message_queue< mpl::list< msg_small, msg_big > > queue_type;
+
+	struct receiver
+	{
+		std::vector< int > got;
+		bool ok = true;
+		void on( const msg_small& m ) { got.push_back( m.v ); }
+		void on( const msg_big& m )
+		{
+			got.push_back( m.v );
+			for ( int i = 0; i < 60; ++i )
+				ok = ok && m.data[i] == m.v + i;
+		}
+	};
+
+	msg_big big( int v )
+	{
+		msg_big result{ v, {} };
+		for ( int i = 0; i < 60; ++i )
+			result.data[i] = v + i;
+		return result;
+	}
+}
+
+// the message is sized by the inline payloads, bigger ones go through the
+// arena - queued, posted and dispatched alike
+static void test_payloads()
+{
+	using namespace payload_test;
+	static_assert( sizeof( queue_type::message ) <= 24, "Spilled payload sized the message!" );
+	queue_type q;
+	receiver r;
+	q.register_handler( &r );
+	q.set_producer_count( 2 );
+
+	for ( int i = 0; i < 200; ++i )
+	{
+		if ( i % 2 )
+			q.queue< msg_big >( float( i ), big( i ) );
+		else
+			q.queue< msg_small >( float( i ), i );
+	}
+	q.post_from< msg_big >( 1, 500.0f, big( 500 ) );
+	q.post_from< msg_small >( 0, 501.0f, 501 );
+	q.dispatch< msg_big >( big( -100 ) );
+	q.update_time( 1000.0f );
+
+	CHECK( r.ok );
+	CHECK( r.got.size() == 203 && r.got[0] == -100 && r.got[1] == 0 && r.got[200] == 199 );
+	CHECK( r.got[201] == 500 && r.got[202] == 501 );
+	CHECK( !q.events_pending() );
+
+	// released arena slots are reused
+	r.got.clear();
+	for ( int round = 0; round < 3; ++round )
+	{
+		for ( int i = 0; i < 100; ++i )
+			q.queue< msg_big >( 1.0f, big( round * 1000 + i ) );
+		q.update_time( 1.0f );
+	}
+	CHECK( r.ok && r.got.size() == 300 && *std::max_element( r.got.begin(), r.got.end() ) == 2099 );
+}
+
+namespace delegate_test
+{
+	struct msg_ping { static const int message_id = 0; int v; };
+	typedef message_queue< mpl::list< msg_ping > > queue_type;
+
+	struct listener
+	{
+		std::vector< int >* log;
+		int id;
+		void on( const msg_ping& m ) { log->push_back( id * 1000 + m.v ); }
+	};
+
+	// counts its copies, the queue should make exactly one
+	struct counted
+	{
+		std::vector< int >* log;
+		int* copies;
+		counted( std::vector< int >* l, int* c ) : log( l ), copies( c ) {}
+		counted( const counted& o ) : log( o.log ), copies( o.copies ) { ( *copies )++; }
+		void operator()( const queue_type::message& m ) const { log->push_back( -message_cast< msg_ping >( m ).v ); }
+	};
+}
+
+// systems, callbacks and raw delegates run in registration order
+static void test_delegates()
+{
+	using namespace delegate_test;
+	std::vector< int > log;
+	int copies = 0;
+	queue_type q;
+	listener a{ &log, 1 };
+	listener b{ &log, 2 };
+	q.register_handler( &a );
+	{
+		counted c( &log, &copies );
+		q.register_callback( msg_ping::message_id, c );
+	}
+	q.register_delegate( msg_ping::message_id, [] ( void* ctx, const queue_type::message& m )
+	{
+		( (std::vector< int >*)ctx )->push_back( 500 + message_cast< msg_ping >( m ).v );
+	}, &log );
+	q.register_handler( &b );
+	CHECK( copies == 1 );
+
+	q.dispatch< msg_ping >( 7 );
+	q.queue< msg_ping >( 1.0f, 8 );
+	q.update_time( 1.0f );
+	std::vector< int > expected{ 1007, -7, 507, 2007, 1008, -8, 508, 2008 };
+	CHECK( log == expected );
+	CHECK( copies == 1 );
+
+	// ecs systems reach the same delegates
+	game_ecs e;
+	e.register_component< position >();
+	e.register_system< position_system >();
+	handle h = e.create();
+	e.add_component< position >( h, 0, 0 );
+	for ( int i = 0; i < 3; ++i )
+		e.dispatch< msg_action >( h );
+	CHECK( e.get< position >( h )->y == -3 );
+}
+
+namespace batch_msg_test
+{
+	struct msg_a { static const int message_id = 0; int v; };
+	struct msg_b { static const int message_id = 1; int v; int pad[20]; };
+	struct msg_c { static const int message_id = 2; int v; };
+	typedef message_queue< mpl::list< msg_a, msg_b, msg_c > > queue_type;
+
+	// everything one by one, in time order
+	struct plain
+	{
+		std::vector< int > seen;
+		void on( const msg_a& m ) { seen.push_back( m.v ); }
+		void on( const msg_b& m ) { seen.push_back( m.v ); }
+		void on( const msg_c& m ) { seen.push_back( m.v ); }
+	};
+
+	// runs of consecutive messages, in time order with plain
+	struct ordered_batch
+	{
+		static constexpr bool ordered = true;
+		std::vector< int > seen;
+		int calls = 0;
+		void on( span< const msg_a > ms ) { calls++; for ( auto& m : ms ) seen.push_back( m.v ); }
+		void on( span< const msg_b > ms ) { calls++; for ( auto& m : ms ) seen.push_back( m.v ); }
+	};
+
+	// all due messages of a type at once
+	struct bulk
+	{
+		queue_type* q;
+		std::vector< std::vector< int > > calls;
+		bool ok = true;
+		void on( span< const msg_b > ms )
+		{
+			calls.emplace_back();
+			for ( auto& m : ms )
+			{
+				calls.back().push_back( m.v );
+				ok = ok && m.pad[19] == m.v;
+			}
+		}
+		void on( span< const msg_c > ms )
+		{
+			calls.emplace_back();
+			for ( auto& m : ms )
+			{
+				calls.back().push_back( m.v );
+				// queued for now, handled within the same update_time
+				if ( m.v < 1000 )
+					q->queue< msg_c >( 0.0f, m.v + 1000 );
+			}
+		}
+	};
+}
+
+static void test_batch_messages()
+{
+	using namespace batch_msg_test;
+	queue_type q;
+	plain p;
+	ordered_batch o;
+	bulk b{ &q, {}, true };
+	q.register_handler( &p );
+	q.register_handler( &o );
+	q.register_handler( &b );
+
+	// a a b b b c a b c, at distinct times
+	const int types[] = { 0, 0, 1, 1, 1, 2, 0, 1, 2 };
+	for ( int i = 0; i < 9; ++i )
+	{
+		float t = 0.1f * float( 9 - i );
+		int v = 8 - i; // v follows time order
+		if ( types[8 - i] == 0 ) q.queue< msg_a >( t, v );
+		if ( types[8 - i] == 1 ) { msg_b m{ v, {} }; m.pad[19] = v; q.queue< msg_b >( t, m ); }
+		if ( types[8 - i] == 2 ) q.queue< msg_c >( t, v );
+	}
+	q.update_time( 1.0f );
+
+	std::vector< int > all{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 1005, 1008 };
+	CHECK( p.seen == all );
+	std::vector< int > ab{ 0, 1, 2, 3, 4, 6, 7 };
+	CHECK( o.seen == ab && o.calls == 4 );
+	std::vector< std::vector< int > > bulk_calls{ { 2, 3, 4, 7 }, { 5, 8 }, { 1005, 1008 } };
+	CHECK( b.calls == bulk_calls && b.ok );
+	CHECK( !q.events_pending() );
+
+	// update_step and dispatch pass single message spans
+	b.calls.clear();
+	q.queue< msg_c >( 1.0f, 2000 );
+	q.update_step();
+	q.dispatch< msg_c >( 3000 );
+	std::vector< std::vector< int > > single{ { 2000 }, { 3000 } };
+	CHECK( b.calls == single );
+}
+
+namespace post_test
+{
+	struct msg_note { static const int message_id = 0; int v; };
+	struct msg_blob { static const int message_id = 1; int v; int pad[30]; };
+	// the heap leaves equal times unordered, the wheel keeps merge order
+	typedef message_queue< mpl::list< msg_note, msg_blob >, wheel_queue<> > queue_type;
+
+	struct recorder
+	{
+		std::vector< int > seen;
+		void on( const msg_note& m ) { seen.push_back( m.v ); }
+		void on( const msg_blob& m ) { seen.push_back( m.pad[29] == m.v ? m.v : -1 ); }
+	};
+
+	struct tick { int v; };
+	struct msg_tick_post { static const int message_id = 0; handle entity; int v; };
+	typedef ecs< mpl::list< msg_tick_post > > post_ecs;
+
+	struct poster
+	{
+		void update( post_ecs& e, float )
+		{
+			e.parallel_for_each< tick >( [&] ( tick& t )
+			{
+				e.post< msg_tick_post >( float( t.v % 3 ), handle(), t.v );
+			} );
+		}
+	};
+
+	struct post_recorder
+	{
+		std::vector< int > seen;
+		void on( const msg_tick_post& m ) { seen.push_back( m.v ); }
+	};
+
+	std::vector< int > post_order( unsigned threads )
+	{
+		post_ecs e;
+		e.register_component< tick >();
+		e.register_system< poster >();
+		post_recorder* r = e.register_system< post_recorder >();
+		e.set_thread_count( threads );
+		for ( int i = 0; i < 10000; ++i )
+			e.add_component< tick >( e.create(), i );
+		for ( int f = 0; f < 5; ++f )
+			e.update( 1.0f );
+		return r->seen;
+	}
+}
+
+// posts merge by time, then command_key, producer and posting order
+static void test_post()
+{
+	using namespace post_test;
+	queue_type q;
+	recorder r;
+	q.register_handler( &r );
+	q.set_producer_count( 3 );
+	{
+		command_scope scope( 1 );
+		q.post_from< msg_note >( 2, 1.0f, 10 );
+		q.post_from< msg_note >( 1, 1.0f, 11 );
+		q.post_from< msg_note >( 2, 0.5f, 12 );
+	}
+	{
+		command_scope scope( 0, 1, 3 );
+		msg_blob b{ 13, {} };
+		b.pad[29] = 13;
+		q.post_from< msg_blob >( 0, 1.0f, b );
+	}
+	q.post_from< msg_note >( 0, 1.0f, 14 );
+	q.queue< msg_note >( 2.0f, 15 );
+	CHECK( q.events_pending() && r.seen.empty() );
+	q.update_time( 1.0f );
+	std::vector< int > expected{ 12, 14, 13, 11, 10 };
+	CHECK( r.seen == expected );
+	q.update_step();
+	CHECK( r.seen.size() == 6 && r.seen.back() == 15 );
+
+	// raising the producer count merges what was posted already
+	q.post_from< msg_note >( 2, 0.0f, 16 );
+	q.set_producer_count( 5 );
+	CHECK( q.producer_count() == 5 && q.events_pending() );
+	q.update_time( 1.0f );
+	CHECK( r.seen.back() == 16 );
+
+	// ecs::post from parallel loops, independent of the worker count
+	std::vector< int > serial = post_order( 0 );
+	// the last frame's posts and the delay 2 ones of the one before are
+	// still pending
+	CHECK( serial.size() == 36667 );
+	CHECK( post_order( 1 ) == serial );
+	CHECK( post_order( 4 ) == serial );
+}
+
+// recursive_call visits the subtree as it was on entry, whatever the
+// handler does to the hierarchy
+static void test_recursive_call()
+{
+	game_ecs e;
+	e.register_component< position >();
+	e.register_system< position_system >();
+	// root - a ( a1, a2 ), b ( b1 ), c
+	handle root = e.create();
+	handle a = e.create(), a1 = e.create(), a2 = e.create();
+	handle b = e.create(), b1 = e.create(), c = e.create();
+	e.attach( root, c );
+	e.attach( root, b );
+	e.attach( b, b1 );
+	e.attach( root, a );
+	e.attach( a, a2 );
+	e.attach( a, a1 );
+	for ( handle h : { root, a, a1, a2, b, b1, c } )
+		e.add_component< position >( h, 0, 0 );
+
+	std::vector< handle > visited;
+	e.recursive_call( root, [&] ( handle h ) { visited.push_back( h ); } );
+	std::vector< handle > expected{ root, a, a1, a2, b, b1, c };
+	CHECK( visited == expected );
+
+	// removing a later subtree skips it, attaching doesn't add to the walk,
+	// and moving a visited node behind the walk doesn't visit it twice
+	visited.clear();
+	handle added;
+	e.recursive_call( root, [&] ( handle h )
+	{
+		visited.push_back( h );
+		if ( h == a )
+		{
+			e.remove( b );
+			added = e.create();
+			e.attach( a1, added );
+		}
+		if ( h == a1 )
+			e.attach( c, a1 );
+	} );
+	expected = { root, a, a1, a2, c };
+	CHECK( visited == expected );
+	CHECK( e.get_parent( a1 ) == c && e.get_parent( added ) == a1 && !e.is_valid( b1 ) );
+
+	// nested walks share the scratch stack
+	int outer = 0, inner = 0;
+	e.recursive_call( root, [&] ( handle h )
+	{
+		outer++;
+		e.recursive_call( h, [&] ( handle ) { inner++; } );
+	} );
+	// root ( a ( a2 ), c ( a1 ( added ) ) ) - sum of subtree sizes
+	CHECK( outer == 6 && inner == 6 + 2 + 1 + 3 + 2 + 1 );
+
+	int touched = 0;
+	e.recursive_component_call< position >( a, [&] ( position* p ) { p->x = 7; touched++; } );
+	CHECK( touched == 2 && e.get< position >( a2 )->x == 7 && e.get< position >( c )->x == 0 );
+	e.recursive_call( b, [&] ( handle ) { touched++; } );
+	CHECK( touched == 2 );
+
+	// recursive messages reach the whole subtree once
+	e.dispatch_recursive< msg_action >( c );
+	CHECK( e.get< position >( c )->y == -1 && e.get< position >( a1 )->y == -1 && e.get< position >( root )->y == 0 );
+}
+
+namespace hierarchy_test
+{
+	void preorder( const handle_tree_manager& t, handle h, std::vector< handle >& out )
+	{
+		out.push_back( h );
+		for ( handle c = t.first( h ); c; c = t.next( c ) )
+			preorder( t, c, out );
+	}
+
+	// the flat order is the first / next sibling walk of every root, and
+	// every subtree is its contiguous range
+	bool flat_order_ok( const handle_tree_manager& t )
+	{
+		std::vector< handle > live, walked;
+		for ( handle h : t.depth_first() )
+			if ( h )
+			{
+				live.push_back( h );
+				if ( !t.get_parent( h ) )
+					preorder( t, h, walked );
+			}
+		if ( live != walked ) return false;
+		for ( handle h : live )
+		{
+			std::vector< handle > sub, range;
+			preorder( t, h, sub );
+			for ( handle r : t.subtree( h ) )
+				if ( r ) range.push_back( r );
+			if ( sub != range || t.depth_first()[t.position( h )] != h ) return false;
+		}
+		return true;
+	}
+}
+
+// random attach, detach and removal keep the flat depth-first order
+static void test_hierarchy()
+{
+	using namespace hierarchy_test;
+	handle_tree_manager t;
+	std::vector< handle > hs;
+	for ( int i = 0; i < 200; ++i )
+		hs.push_back( t.create_handle() );
+	unsigned seed = 11;
+	auto random = [&] ( unsigned n ) { seed = seed * 1103515245u + 12345u; return ( seed >> 8 ) % n; };
+	auto is_ancestor = [&] ( handle a, handle h ) { for ( ; h; h = t.get_parent( h ) ) if ( h == a ) return true; return false; };
+	bool ok = true;
+	for ( int step = 0; step < 3000; ++step )
+	{
+		handle a = hs[random( unsigned( hs.size() ) )];
+		handle b = hs[random( unsigned( hs.size() ) )];
+		switch ( random( 6 ) )
+		{
+		case 0: case 1: case 2:
+			if ( !is_ancestor( b, a ) )
+				t.attach( a, b );
+			break;
+		case 3:
+			t.detach( b );
+			break;
+		case 4:
+			if ( !t.first( b ) )
+			{
+				t.free_handle( b );
+				hs.erase( std::find( hs.begin(), hs.end(), b ) );
+				hs.push_back( t.create_handle() );
+			}
+			break;
+		default:
+			t.remove_and_orphan( b );
+			t.free_handle( b );
+			hs.erase( std::find( hs.begin(), hs.end(), b ) );
+			hs.push_back( t.create_handle() );
+		}
+		if ( step % 50 == 0 )
+			ok = ok && flat_order_ok( t );
+	}
+	CHECK( ok && flat_order_ok( t ) );
+
+	// the latest attached child comes first in both orders
+	handle p = t.create_handle(), c1 = t.create_handle(), c2 = t.create_handle();
+	t.attach( p, c1 );
+	t.attach( p, c2 );
+	CHECK( t.first( p ) == c2 && t.next( c2 ) == c1 );
+	CHECK( t.position( c2 ) == t.position( p ) + 1 && t.position( c1 ) == t.position( p ) + 2 );
+}
+
+namespace relational_test
+{
+	struct node { handle owner; int v; };
+
+	// a parent having node sits in an earlier row than its child
+	bool parents_first( game_ecs& e, const std::vector< handle >& hs )
+	{
+		for ( handle h : hs )
+		{
+			if ( !e.is_valid( h ) || !e.get< node >( h ) ) continue;
+			handle p = e.get_parent( h );
+			if ( p && e.get< node >( p ) && e.get_debug_index< node >( p ) > e.get_debug_index< node >( h ) )
+				return false;
+		}
+		return true;
+	}
+}
+
+// deferred reordering ends with the same invariant and the same rows as
+// keeping relational storages ordered on every change
+static void test_relational_deferred()
+{
+	using namespace relational_test;
+	game_ecs eager, lazy;
+	for ( game_ecs* e : { &eager, &lazy } )
+		e->register_component< node >( true );
+	lazy.set_relational_deferred( true );
+
+	std::vector< handle > hs[2];
+	unsigned seed = 5;
+	auto random = [&] ( unsigned n ) { seed = seed * 1103515245u + 12345u; return ( seed >> 8 ) % n; };
+	bool ok = true;
+	for ( int frame = 0; frame < 20; ++frame )
+	{
+		for ( int step = 0; step < 200; ++step )
+		{
+			unsigned op = random( 8 );
+			unsigned a = random( 400 ), b = random( 400 );
+			for ( int w = 0; w < 2; ++w )
+			{
+				game_ecs& e = w ? lazy : eager;
+				std::vector< handle >& v = hs[w];
+				if ( v.size() < 400 )
+				{
+					handle h = e.create();
+					v.push_back( h );
+					if ( op % 4 != 0 )
+						e.add_component< node >( h, h, int( v.size() ) );
+					continue;
+				}
+				handle x = v[a], y = v[b];
+				bool cycle = false;
+				for ( handle p = x; p; p = e.get_parent( p ) )
+					cycle = cycle || p == y;
+				if ( op < 4 && !cycle )
+					e.attach( x, y );
+				else if ( op == 4 )
+					e.detach( y );
+				else if ( op == 5 && e.get< node >( y ) )
+					e.remove_component< node >( y );
+				else if ( op == 6 && !e.get< node >( y ) )
+					e.add_component< node >( y, y, int( b ) );
+			}
+		}
+		lazy.update( 0.0f );
+		ok = ok && parents_first( eager, hs[0] ) && parents_first( lazy, hs[1] );
+		ok = ok && eager.get_storage< node >()->size() == lazy.get_storage< node >()->size();
+		for ( size_t i = 0; i < hs[0].size(); ++i )
+		{
+			const node* n0 = eager.get< node >( hs[0][i] );
+			const node* n1 = lazy.get< node >( hs[1][i] );
+			ok = ok && ( n0 != nullptr ) == ( n1 != nullptr ) && ( !n0 || ( n0->v == n1->v && n1->owner == hs[1][i] ) );
+		}
+	}
+	CHECK( ok );
+
+	// switching back reorders right away
+	lazy.attach( hs[1][0], hs[1][1] );
+	lazy.attach( hs[1][1], hs[1][2] );
+	lazy.set_relational_deferred( false );
+	CHECK( parents_first( lazy, hs[1] ) );
+}
+
+// chunked_layout components never move while their storage grows, and are
+// moved with their move constructor when rows are removed or swapped
+namespace chunked_test
+{
+	struct name
+	{
+		std::string text;
+		static int live;
+		name( std::string t = std::string() ) : text( std::move( t ) ) { live++; }
+		name( name&& other ) : text( std::move( other.text ) ) { live++; }
+		~name() { live--; }
+	};
+	int name::live = 0;
+
+	std::string long_text( int i ) { return "a component name too long for short strings #" + std::to_string( i ); }
+}
+
+template <> struct component_storage_layout< chunked_test::name > { typedef chunked_layout type; };
+
+static void test_chunked()
+{
+	using namespace chunked_test;
+	{
+		game_ecs e;
+		e.register_component< name >();
+		auto* storage = e.get_storage< name >();
+		const int count = storage->chunk_rows() * 5 + 3;
+		std::vector< handle > hs( count );
+		e.create_n( count, hs.begin() );
+		e.add_component< name >( hs[0], long_text( 0 ) );
+		const name* first = e.get< name >( hs[0] );
+		for ( int i = 1; i < count; ++i )
+			e.add_component< name >( hs[i], long_text( i ) );
+		CHECK( e.get< name >( hs[0] ) == first );
+		CHECK( name::live == count );
+
+		// remove_swap relocates the last row and its owner
+		for ( int i = 0; i < count; i += 4 )
+			e.remove_component< name >( hs[i] );
+		bool ok = true;
+		for ( int i = 0; i < count; ++i )
+		{
+			const name* n = e.get< name >( hs[i] );
+			ok = ok && ( i % 4 == 0 ? n == nullptr : n && n->text == long_text( i ) );
+		}
+		for ( int row = 0; row < storage->size(); ++row )
+		{
+			int owner = storage->index( row );
+			ok = ok && ( *storage )[row].text == long_text( int( std::find_if( hs.begin(), hs.end(), [&] ( handle h ) { return int( h.index ) == owner; } ) - hs.begin() ) );
+		}
+		CHECK( ok );
+		CHECK( name::live == storage->size() );
+
+		// rows() walks the storage a block at a time
+		int walked = 0;
+		for ( int row = 0; row < storage->size(); row += int( storage->rows( row, storage->size() ).size() ) )
+			walked += int( storage->rows( row, storage->size() ).size() );
+		CHECK( walked == storage->size() );
+	}
+	CHECK( name::live == 0 );
+
+	// swap goes through a stack buffer - no extra row, even on a full block
+	{
+		chunked_storage_handler< name > storage( false );
+		const int count = storage.chunk_rows();
+		for ( int i = 0; i < count; ++i )
+			storage.append< name >( i, long_text( i ) );
+		CHECK( storage.capacity() == count );
+		storage.swap( 0, count - 1 );
+		storage.swap( 1, 2 );
+		storage.swap( 3, 3 );
+		CHECK( storage.capacity() == count );
+		CHECK( name::live == count );
+		std::string t0 = storage[0].text, tl = storage[count - 1].text, t1 = storage[1].text, t3 = storage[3].text;
+		CHECK( t0 == long_text( count - 1 ) && tl == long_text( 0 ) );
+		CHECK( t1 == long_text( 2 ) && t3 == long_text( 3 ) );
+		CHECK( storage.index( 0 ) == count - 1 && storage.index( count - 1 ) == 0 && storage.index( 2 ) == 1 );
+	}
+	CHECK( name::live == 0 );
+}
+
+// a world allocates from its resource only on the thread changing it, and
+// gives every byte back
+namespace memory_test
+{
+	struct msg_note { static const int message_id = 0; handle entity; int v; };
+	struct msg_blob { static const int message_id = 1; handle entity; int data[30]; };
+	using memory_ecs = ecs< mpl::list< msg_note, msg_blob > >;
+
+	struct pos { float x; float y; };
+	struct vel { float x; float y; };
+	struct col { float a; float b; };
+	struct kind { int v; };
+	struct rare { int v; };
+	struct sparse { int v; };
+	struct node { handle owner; };
+
+	class counting_resource : public std::pmr::memory_resource
+	{
+	public:
+		size_t          live = 0;
+		int             calls = 0;
+		int             foreign = 0; // calls from other threads
+		std::thread::id owner = std::this_thread::get_id();
+	private:
+		void* do_allocate( size_t bytes, size_t align ) override
+		{
+			count();
+			live += bytes;
+			return std::pmr::new_delete_resource()->allocate( bytes, align );
+		}
+		void do_deallocate( void* p, size_t bytes, size_t align ) override
+		{
+			count();
+			live -= bytes;
+			std::pmr::new_delete_resource()->deallocate( p, bytes, align );
+		}
+		bool do_is_equal( const std::pmr::memory_resource& other ) const noexcept override { return this == &other; }
+		void count()
+		{
+			calls++;
+			if ( std::this_thread::get_id() != owner )
+				foreign++;
+		}
+	};
+}
+
+template <> struct component_storage_layout< memory_test::vel > { typedef chunked_layout type; };
+template <> struct component_storage_layout< memory_test::col > { typedef soa_layout type; };
+template <> struct component_storage_layout< memory_test::kind > { typedef archetype_layout type; };
+template <> struct component_index_table< memory_test::rare > { typedef hashed_index_table type; };
+template <> struct component_index_table< memory_test::sparse > { typedef paged_index_table type; };
+
+static void test_memory_resource()
+{
+	using namespace memory_test;
+	counting_resource resource;
+	{
+		memory_ecs e( &resource );
+		e.register_component< pos >();
+		e.register_component< vel >();
+		e.register_component< col >();
+		e.register_component< kind >();
+		e.register_component< rare >();
+		e.register_component< sparse >();
+		e.register_component< node >( true );
+		const int count = 5000;
+		std::vector< handle > hs( count );
+		e.create_n( count, hs.begin() );
+		for ( int i = 0; i < count; ++i )
+		{
+			handle h = hs[i];
+			e.add_component< pos >( h, float( i ), 0.0f );
+			if ( i % 2 == 0 ) e.add_component< vel >( h, 1.0f, 1.0f );
+			if ( i % 3 == 0 ) e.add_component< col >( h, 1.0f, 2.0f );
+			if ( i % 4 == 0 ) e.add_component< kind >( h, i );
+			if ( i % 97 == 0 ) e.add_component< rare >( h, i );
+			if ( i % 5 == 0 ) e.add_component< sparse >( h, i );
+			if ( i % 4 == 0 ) e.add_component< node >( h, h );
+			if ( i > 0 && i % 4 == 0 ) e.attach( hs[i / 8 * 4], h );
+			if ( i % 7 == 0 ) e.queue< msg_note >( float( i % 13 ), h, i );
+			if ( i % 50 == 0 ) e.queue< msg_blob >( 2.0f, msg_blob{ h, { i } } );
+		}
+		CHECK( resource.live > 0 );
+		size_t filled = resource.live;
+
+		// producer threads post without touching the resource
+		e.set_producer_count( 4 );
+		int calls = resource.calls;
+		std::vector< std::thread > producers;
+		for ( unsigned p = 0; p < 4; ++p )
+			producers.emplace_back( [&e, &hs, p] ()
+			{
+				for ( int i = int( p ); i < 2000; i += 4 )
+				{
+					if ( i % 8 == 0 )
+						e.post_from< msg_blob >( p, 1.0f, msg_blob{ hs[i], { i } } );
+					else
+						e.post_from< msg_note >( p, 1.0f, hs[i], i );
+				}
+			} );
+		for ( auto& t : producers )
+			t.join();
+		CHECK( resource.foreign == 0 );
+		CHECK( resource.calls == calls );
+
+		for ( int i = 0; i < count; i += 9 )
+			e.mark_remove( hs[i] );
+		e.update( 20.0f );
+		CHECK( resource.live > 0 && resource.live <= filled * 2 );
+	}
+	CHECK( resource.live == 0 );
+	CHECK( resource.foreign == 0 );
+
+	// archetype tables take their chunks from the resource too
+	{
+		counting_resource tables;
+		{
+			archetype_storage a( &tables );
+			a.register_type( 0, sizeof( int ), alignof( int ), raw_destroy_object< int >, nullptr );
+			for ( unsigned i = 0; i < 10000; ++i )
+				a.add< int >( handle( i, 1 ), 0, int( i ) );
+			CHECK( tables.live >= 10000 * sizeof( int ) );
+		}
+		CHECK( tables.calls > 0 && tables.live == 0 );
+	}
+
+	// storages and pools made outside of a world use the default resource
+	{
+		counting_resource fallback;
+		std::pmr::memory_resource* previous = std::pmr::set_default_resource( &fallback );
+		{
+			chunk_pool pool;
+			component_storage_handler< pos > aos( false );
+			chunked_storage_handler< vel > chunked( false, std::pmr::get_default_resource(), &pool );
+			for ( int i = 0; i < 100; ++i )
+			{
+				aos.append< pos >( i, float( i ), 0.0f );
+				chunked.append< vel >( i, float( i ), 0.0f );
+			}
+			CHECK( fallback.live >= 100 * sizeof( pos ) + chunk_pool::CHUNK_SIZE );
+		}
+		std::pmr::set_default_resource( previous );
+		CHECK( fallback.calls > 0 && fallback.live == 0 );
+	}
+
+	// a monotonic resource drops the world without frees
+	{
+		std::pmr::monotonic_buffer_resource arena( 1 << 16, &resource );
+		{
+			memory_ecs e( &arena );
+			e.register_component< pos >();
+			e.register_component< vel >();
+			for ( int i = 0; i < 3000; ++i )
+			{
+				handle h = e.create();
+				e.add_component< pos >( h, float( i ), 0.0f );
+				e.add_component< vel >( h, 1.0f, 1.0f );
+			}
+			float sum = 0.0f;
+			e.for_each< pos >( [&] ( const pos& p ) { sum += p.x; } );
+			CHECK( sum == 2999.0f * 3000.0f / 2.0f );
+		}
+		arena.release();
+	}
+	CHECK( resource.live == 0 );
+}
+
+int main( int, char*[] )
+{
+	test_basic();
+	test_scheduler();
+	test_parallel();
+	test_join();
+	test_component_id();
+	test_index_policy();
+	test_paged_index();
+	test_hashed_index();
+	test_soa();
+	test_kernel();
+	test_archetype();
+	test_group();
+	test_handles();
+	test_remove_batch();
+	test_add_components();
+	test_commands();
+	test_timing_wheel();
+	test_payloads();
+	test_delegates();
+	test_batch_messages();
+	test_post();
+	test_recursive_call();
+	test_hierarchy();
+	test_relational_deferred();
+	test_chunked();
+	test_memory_resource();
 
-	return 0;
+	if ( g_failed > 0 )
+		printf( "%d checks failed\n", g_failed );
+	return g_failed > 0 ? 1 : 0;
 }